@@ -0,0 +1,414 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_ASYNC_IO_HPP_
+#define SRC_CPP_ASYNC_IO_HPP_
+
+// Background reads and writes of file descriptors. Not available on Windows,
+// where FileDisk does all I/O synchronously.
+#ifndef _WIN32
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "exceptions.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#else
+#define HAVE_IO_URING 0
+#endif
+
+// Queue of reads and writes that complete in the background, so a caller can
+// keep several of them in flight while it works. It uses io_uring when the
+// kernel supports it, and a pool of threads doing pread()/pwrite() otherwise.
+// Short reads and writes are continued until the whole range is transferred.
+class AsyncIO {
+public:
+    // The maximum number of requests in flight. Submitting more blocks until
+    // one completes
+    static uint32_t const kQueueDepth = 64;
+    // Number of threads doing I/O when io_uring is not available
+    static uint32_t const kFallbackThreads = 4;
+
+    enum class backend_t : uint8_t { io_uring, threads };
+
+    explicit AsyncIO(backend_t const backend = backend_t::io_uring)
+    {
+#if HAVE_IO_URING
+        if (backend == backend_t::io_uring && SetupRing()) {
+            backend_ = backend_t::io_uring;
+            return;
+        }
+#endif
+        backend_ = backend_t::threads;
+        for (uint32_t i = 0; i < kFallbackThreads; ++i) {
+            workers_.emplace_back([this] { WorkerThread(); });
+        }
+    }
+
+    AsyncIO(const AsyncIO &) = delete;
+    AsyncIO &operator=(const AsyncIO &) = delete;
+
+    ~AsyncIO()
+    {
+        {
+            std::unique_lock<std::mutex> l(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto &t : workers_) t.join();
+#if HAVE_IO_URING
+        if (ring_fd_ >= 0) {
+            ::munmap(sqes_, sqes_size_);
+            if (cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_ring_size_);
+            ::munmap(sq_ring_, sq_ring_size_);
+            ::close(ring_fd_);
+        }
+#endif
+    }
+
+    // The queue shared by all FileDisks
+    static AsyncIO &Instance()
+    {
+        static AsyncIO instance;
+        return instance;
+    }
+
+    backend_t Backend() const { return backend_; }
+
+    // Starts reading length bytes at offset of fd into buffer. Returns a
+    // ticket to pass to Wait()
+    uint64_t Read(int const fd, uint64_t const offset, uint8_t *buffer, uint64_t const length)
+    {
+        return Submit(false, fd, offset, buffer, length);
+    }
+
+    uint64_t Write(int const fd, uint64_t const offset, uint8_t const *buffer, uint64_t const length)
+    {
+        return Submit(true, fd, offset, const_cast<uint8_t *>(buffer), length);
+    }
+
+    // Blocks until the request is done. Returns 0 on success, or the errno it
+    // failed with. EIO stands in for reads past the end of the file.
+    int Wait(uint64_t const ticket)
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        for (;;) {
+            auto const it = requests_.find(ticket);
+            if (it == requests_.end()) {
+                throw InvalidStateException("Waiting for unknown I/O request");
+            }
+            if (it->second.done) {
+                int const error = it->second.error;
+                requests_.erase(it);
+                return error;
+            }
+            WaitForCompletions(l);
+        }
+    }
+
+private:
+    struct request_t {
+        bool write;
+        int fd;
+        uint64_t offset;
+        uint8_t *buffer;
+        uint64_t remaining;
+        bool done = false;
+        int error = 0;
+    };
+
+    uint64_t Submit(bool const write, int const fd, uint64_t const offset, uint8_t *buffer,
+        uint64_t const length)
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        while (in_flight_ >= kQueueDepth) WaitForCompletions(l);
+
+        uint64_t const ticket = next_ticket_++;
+        request_t &r = requests_[ticket];
+        r.write = write;
+        r.fd = fd;
+        r.offset = offset;
+        r.buffer = buffer;
+        r.remaining = length;
+        ++in_flight_;
+
+        if (length == 0) {
+            Complete(r, 0);
+        } else if (backend_ == backend_t::threads) {
+            queue_.push_back(ticket);
+            cv_.notify_all();
+        } else {
+#if HAVE_IO_URING
+            QueueSqe(ticket, r);
+            SubmitSqes(1);
+#endif
+        }
+        return ticket;
+    }
+
+    // Marks a request as done, the caller holds mutex_
+    void Complete(request_t &r, int const error)
+    {
+        r.done = true;
+        r.error = error;
+        --in_flight_;
+        cv_.notify_all();
+    }
+
+    // Waits until at least one request completes, with mutex_ held by l
+    void WaitForCompletions(std::unique_lock<std::mutex> &l)
+    {
+#if HAVE_IO_URING
+        if (backend_ == backend_t::io_uring && !reaping_) {
+            // This thread reaps completions for everyone, without holding
+            // the lock while it's blocked in the kernel
+            reaping_ = true;
+            l.unlock();
+            int const error = Enter(0, 1, IORING_ENTER_GETEVENTS);
+            l.lock();
+            reaping_ = false;
+            if (error != 0 && error != EINTR) {
+                throw InvalidStateException(
+                    std::string("io_uring_enter() failed: ") + ::strerror(error));
+            }
+            ReapCompletions();
+            cv_.notify_all();
+            return;
+        }
+#endif
+        cv_.wait(l);
+    }
+
+    void WorkerThread()
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        for (;;) {
+            cv_.wait(l, [this] { return stop_ || !queue_.empty(); });
+            if (stop_) return;
+            uint64_t const ticket = queue_.front();
+            queue_.pop_front();
+            request_t r = requests_[ticket];
+            l.unlock();
+
+            int error = 0;
+            while (r.remaining > 0) {
+                ssize_t const n = r.write ? ::pwrite(r.fd, r.buffer, r.remaining, r.offset)
+                                          : ::pread(r.fd, r.buffer, r.remaining, r.offset);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    error = n < 0 ? errno : EIO;
+                    break;
+                }
+                r.buffer += n;
+                r.offset += n;
+                r.remaining -= n;
+            }
+
+            l.lock();
+            Complete(requests_[ticket], error);
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<uint64_t, request_t> requests_;
+    uint64_t next_ticket_ = 1;
+    uint32_t in_flight_ = 0;
+    backend_t backend_ = backend_t::threads;
+
+    // The thread pool backend
+    std::deque<uint64_t> queue_;
+    std::vector<std::thread> workers_;
+    bool stop_ = false;
+
+#if HAVE_IO_URING
+    // Maps the submission and completion rings, as described in io_uring(7)
+    bool SetupRing()
+    {
+        io_uring_params p;
+        ::memset(&p, 0, sizeof(p));
+        int const fd = ::syscall(__NR_io_uring_setup, kQueueDepth, &p);
+        if (fd < 0) return false;
+        // IORING_OP_READ and IORING_OP_WRITE need Linux 5.6, as does probing
+        // for them
+        std::vector<uint8_t> probe_buf(
+            sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe *const probe = reinterpret_cast<io_uring_probe *>(probe_buf.data());
+        if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+            probe->last_op < IORING_OP_WRITE ||
+            !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+            !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)) {
+            ::close(fd);
+            return false;
+        }
+
+        sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool const single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+
+        sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        cq_ring_ = single_mmap ? sq_ring_
+                               : ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        void *const sqes = (cq_ring_ == MAP_FAILED)
+            ? MAP_FAILED
+            : ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                  IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_ring_size_);
+            ::munmap(sq_ring_, sq_ring_size_);
+            ::close(fd);
+            return false;
+        }
+        sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+        uint8_t *const sq = static_cast<uint8_t *>(sq_ring_);
+        sq_tail_ = reinterpret_cast<uint32_t *>(sq + p.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<uint32_t *>(sq + p.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<uint32_t *>(sq + p.sq_off.array);
+
+        uint8_t *const cq = static_cast<uint8_t *>(cq_ring_);
+        cq_head_ = reinterpret_cast<uint32_t *>(cq + p.cq_off.head);
+        cq_tail_ = reinterpret_cast<uint32_t *>(cq + p.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<uint32_t *>(cq + p.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+
+        ring_fd_ = fd;
+        return true;
+    }
+
+    // Adds the (rest of the) request to the submission ring. There is always
+    // room, since at most kQueueDepth requests are in flight
+    void QueueSqe(uint64_t const ticket, request_t const &r)
+    {
+        uint32_t const tail = *sq_tail_;
+        uint32_t const index = tail & sq_mask_;
+        io_uring_sqe &sqe = sqes_[index];
+        ::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = r.write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = r.fd;
+        sqe.off = r.offset;
+        sqe.addr = reinterpret_cast<uint64_t>(r.buffer);
+        // the length field is 32 bits, longer requests are continued as
+        // short ones
+        sqe.len = static_cast<uint32_t>(std::min<uint64_t>(r.remaining, 1 << 30));
+        sqe.user_data = ticket;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    // Returns 0 or the errno of io_uring_enter()
+    int Enter(uint32_t const to_submit, uint32_t const min_complete, uint32_t const flags)
+    {
+        int const ret =
+            ::syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, nullptr, 0);
+        return ret < 0 ? errno : 0;
+    }
+
+    // Hands queued SQEs to the kernel. They are already in the ring, so
+    // there's no recovering from a failure here
+    void SubmitSqes(uint32_t const count)
+    {
+        int error;
+        while ((error = Enter(count, 0, 0)) == EINTR) {
+        }
+        if (error != 0) {
+            throw InvalidStateException(
+                std::string("io_uring_enter() failed: ") + ::strerror(error));
+        }
+    }
+
+    // Processes the completion ring, resubmitting the rest of short transfers.
+    // The caller holds mutex_
+    void ReapCompletions()
+    {
+        uint32_t head = *cq_head_;
+        uint32_t const tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        uint32_t resubmit = 0;
+        for (; head != tail; ++head) {
+            io_uring_cqe const &cqe = cqes_[head & cq_mask_];
+            auto const it = requests_.find(cqe.user_data);
+            if (it == requests_.end() || it->second.done) continue;
+            request_t &r = it->second;
+            if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                QueueSqe(cqe.user_data, r);
+                ++resubmit;
+                continue;
+            }
+            if (cqe.res <= 0) {
+                Complete(r, cqe.res < 0 ? -cqe.res : EIO);
+                continue;
+            }
+            r.buffer += cqe.res;
+            r.offset += cqe.res;
+            r.remaining -= cqe.res;
+            if (r.remaining == 0) {
+                Complete(r, 0);
+            } else {
+                QueueSqe(cqe.user_data, r);
+                ++resubmit;
+            }
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        if (resubmit > 0) SubmitSqes(resubmit);
+    }
+
+    int ring_fd_ = -1;
+    // Set while a thread waits for completions in the kernel
+    bool reaping_ = false;
+
+    void *sq_ring_ = nullptr;
+    void *cq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    size_t sqes_size_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+
+    uint32_t *sq_tail_ = nullptr;
+    uint32_t sq_mask_ = 0;
+    uint32_t *sq_array_ = nullptr;
+
+    uint32_t *cq_head_ = nullptr;
+    uint32_t *cq_tail_ = nullptr;
+    uint32_t cq_mask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+#endif
+};
+
+#endif  // _WIN32
+
+#endif  // SRC_CPP_ASYNC_IO_HPP_
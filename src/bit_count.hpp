@@ -0,0 +1,209 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_BIT_COUNT_HPP_
+#define SRC_CPP_BIT_COUNT_HPP_
+
+#include <stdint.h>
+
+#include "util.hpp"
+
+// Counts the set bits of arrays of 64-bit words, like the bitfields of phase 2
+// and 3. Where the CPU supports it, the AVX-512 VPOPCNTDQ instructions count 8
+// words at once, or AVX2 counts the bits of 4 words with a nibble lookup table.
+// Totals over AVX2 vectors use the Harley-Seal carry-save adder tree (Mula,
+// Kurz and Lemire, "Faster Population Counts Using AVX2 Instructions"), which
+// needs one lookup for every 16 vectors.
+namespace BitCount {
+
+    inline uint64_t CountGeneric(uint64_t const *words, uint64_t const n)
+    {
+        uint64_t ret = 0;
+        for (uint64_t i = 0; i < n; i++) ret += Util::PopCount(words[i]);
+        return ret;
+    }
+
+    inline void WordCountsGeneric(uint64_t const *words, uint64_t const n, uint8_t *counts)
+    {
+        for (uint64_t i = 0; i < n; i++) counts[i] = Util::PopCount(words[i]);
+    }
+
+#if defined(HAVE_X86_SIMD)
+
+    // The bit counts of the 4 words of v
+    __attribute__((target("avx2"))) inline __m256i PopCount256(__m256i const v)
+    {
+        __m256i const lookup = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        __m256i const low_mask = _mm256_set1_epi8(0x0f);
+        __m256i const lo = _mm256_and_si256(v, low_mask);
+        __m256i const hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+        __m256i const bytes = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+        return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+    }
+
+    // Carry-save adder, adds the bits of a, b and c
+    __attribute__((target("avx2"))) inline void CSA(
+        __m256i &high,
+        __m256i &low,
+        __m256i const a,
+        __m256i const b,
+        __m256i const c)
+    {
+        __m256i const u = _mm256_xor_si256(a, b);
+        high = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+        low = _mm256_xor_si256(u, c);
+    }
+
+    __attribute__((target("avx2"))) inline uint64_t CountAVX2(
+        uint64_t const *words,
+        uint64_t const n)
+    {
+        __m256i const *v = reinterpret_cast<__m256i const *>(words);
+        uint64_t const num_vectors = n / 4;
+        __m256i total = _mm256_setzero_si256();
+        __m256i ones = _mm256_setzero_si256();
+        __m256i twos = _mm256_setzero_si256();
+        __m256i fours = _mm256_setzero_si256();
+        __m256i eights = _mm256_setzero_si256();
+        __m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b, sixteens;
+
+        uint64_t i = 0;
+        for (; i + 16 <= num_vectors; i += 16) {
+            CSA(twos_a, ones, ones, _mm256_loadu_si256(v + i), _mm256_loadu_si256(v + i + 1));
+            CSA(twos_b, ones, ones, _mm256_loadu_si256(v + i + 2), _mm256_loadu_si256(v + i + 3));
+            CSA(fours_a, twos, twos, twos_a, twos_b);
+            CSA(twos_a, ones, ones, _mm256_loadu_si256(v + i + 4), _mm256_loadu_si256(v + i + 5));
+            CSA(twos_b, ones, ones, _mm256_loadu_si256(v + i + 6), _mm256_loadu_si256(v + i + 7));
+            CSA(fours_b, twos, twos, twos_a, twos_b);
+            CSA(eights_a, fours, fours, fours_a, fours_b);
+            CSA(twos_a, ones, ones, _mm256_loadu_si256(v + i + 8), _mm256_loadu_si256(v + i + 9));
+            CSA(twos_b, ones, ones, _mm256_loadu_si256(v + i + 10), _mm256_loadu_si256(v + i + 11));
+            CSA(fours_a, twos, twos, twos_a, twos_b);
+            CSA(twos_a, ones, ones, _mm256_loadu_si256(v + i + 12), _mm256_loadu_si256(v + i + 13));
+            CSA(twos_b, ones, ones, _mm256_loadu_si256(v + i + 14), _mm256_loadu_si256(v + i + 15));
+            CSA(fours_b, twos, twos, twos_a, twos_b);
+            CSA(eights_b, fours, fours, fours_a, fours_b);
+            CSA(sixteens, eights, eights, eights_a, eights_b);
+            total = _mm256_add_epi64(total, PopCount256(sixteens));
+        }
+        total = _mm256_slli_epi64(total, 4);
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(PopCount256(eights), 3));
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(PopCount256(fours), 2));
+        total = _mm256_add_epi64(total, _mm256_slli_epi64(PopCount256(twos), 1));
+        total = _mm256_add_epi64(total, PopCount256(ones));
+        for (; i < num_vectors; i++) {
+            total = _mm256_add_epi64(total, PopCount256(_mm256_loadu_si256(v + i)));
+        }
+
+        uint64_t lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), total);
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+               CountGeneric(words + num_vectors * 4, n - num_vectors * 4);
+    }
+
+    __attribute__((target("avx2"))) inline void WordCountsAVX2(
+        uint64_t const *words,
+        uint64_t const n,
+        uint8_t *counts)
+    {
+        __m256i const *v = reinterpret_cast<__m256i const *>(words);
+        uint64_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m256i const c0 = PopCount256(_mm256_loadu_si256(v + i / 4));
+            __m256i const c1 = PopCount256(_mm256_loadu_si256(v + i / 4 + 1));
+            __m256i const c2 = PopCount256(_mm256_loadu_si256(v + i / 4 + 2));
+            __m256i const c3 = PopCount256(_mm256_loadu_si256(v + i / 4 + 3));
+            // Narrow the counts to bytes. Packing works within the 128-bit
+            // halves, the low half ends up with the counts of words 0-1 of
+            // each vector, and the high half with those of words 2-3.
+            __m256i const c01 = _mm256_packus_epi32(c0, c1);
+            __m256i const c23 = _mm256_packus_epi32(c2, c3);
+            __m256i const c0123 = _mm256_packus_epi16(c01, c23);
+            __m256i const bytes = _mm256_packus_epi16(c0123, c0123);
+            __m128i const ordered = _mm_unpacklo_epi16(
+                _mm256_castsi256_si128(bytes), _mm256_extracti128_si256(bytes, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(counts + i), ordered);
+        }
+        WordCountsGeneric(words + i, n - i, counts + i);
+    }
+
+    __attribute__((target("avx512f,avx512vpopcntdq"))) inline uint64_t CountAVX512(
+        uint64_t const *words,
+        uint64_t const n)
+    {
+        __m512i total = _mm512_setzero_si512();
+        uint64_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_loadu_si512(words + i)));
+        }
+        // _mm512_reduce_add_epi64() trips GCC's uninitialized warnings
+        uint64_t lanes[8];
+        _mm512_storeu_si512(lanes, total);
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] +
+               lanes[7] + CountGeneric(words + i, n - i);
+    }
+
+    __attribute__((target("avx512f,avx512vpopcntdq"))) inline void WordCountsAVX512(
+        uint64_t const *words,
+        uint64_t const n,
+        uint8_t *counts)
+    {
+        uint64_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            // The masked form, the unmasked one trips GCC's uninitialized warnings
+            __m128i const c =
+                _mm512_maskz_cvtepi64_epi8(0xff, _mm512_popcnt_epi64(_mm512_loadu_si512(words + i)));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(counts + i), c);
+        }
+        WordCountsGeneric(words + i, n - i, counts + i);
+    }
+
+#endif  // HAVE_X86_SIMD
+
+    // Below this many words, the generic loop is as fast
+    const uint64_t kMinVectorWords = 16;
+
+    // The number of set bits of the n words
+    inline uint64_t Count(uint64_t const *words, uint64_t const n)
+    {
+#if defined(HAVE_X86_SIMD)
+        if (n >= kMinVectorWords) {
+            static const bool have_avx512 = Util::HaveAVX512Popcnt();
+            static const bool have_avx2 = Util::HaveAVX2();
+            if (have_avx512) return CountAVX512(words, n);
+            if (have_avx2) return CountAVX2(words, n);
+        }
+#endif
+        return CountGeneric(words, n);
+    }
+
+    // Writes the number of set bits of each of the n words to counts
+    inline void WordCounts(uint64_t const *words, uint64_t const n, uint8_t *counts)
+    {
+#if defined(HAVE_X86_SIMD)
+        if (n >= kMinVectorWords) {
+            static const bool have_avx512 = Util::HaveAVX512Popcnt();
+            static const bool have_avx2 = Util::HaveAVX2();
+            if (have_avx512) return WordCountsAVX512(words, n, counts);
+            if (have_avx2) return WordCountsAVX2(words, n, counts);
+        }
+#endif
+        WordCountsGeneric(words, n, counts);
+    }
+}
+
+#endif  // SRC_CPP_BIT_COUNT_HPP_
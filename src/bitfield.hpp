@@ -16,6 +16,8 @@
 
 #include <memory>
 
+#include "bit_count.hpp"
+
 struct bitfield
 {
     explicit bitfield(int64_t size)
@@ -31,6 +33,18 @@ struct bitfield
         buffer_[bit / 64] |= uint64_t(1) << (bit % 64);
     }
 
+    // set() for a bitfield that other threads set bits in at the same time
+    void set_atomic(int64_t const bit)
+    {
+        assert(bit / 64 < size_);
+        uint64_t const mask = uint64_t(1) << (bit % 64);
+#if defined(_MSC_VER)
+        _InterlockedOr64(reinterpret_cast<volatile int64_t*>(&buffer_[bit / 64]), mask);
+#else
+        __atomic_fetch_or(&buffer_[bit / 64], mask, __ATOMIC_RELAXED);
+#endif
+    }
+
     bool get(int64_t const bit) const
     {
         assert(bit / 64 < size_);
@@ -58,11 +72,7 @@ struct bitfield
 
         uint64_t const* start = buffer_.get() + start_bit / 64;
         uint64_t const* end = buffer_.get() + end_bit / 64;
-        int64_t ret = 0;
-        while (start != end) {
-            ret += Util::PopCount(*start);
-            ++start;
-        }
+        int64_t ret = BitCount::Count(start, end - start);
         int const tail = end_bit % 64;
         if (tail > 0) {
             uint64_t const mask = (uint64_t(1) << tail) - 1;
@@ -71,6 +81,35 @@ struct bitfield
         return ret;
     }
 
+    // writes the number of set bits of each of the n 64-bit words starting
+    // with word start to counts
+    void word_counts(int64_t const start, int64_t const n, uint8_t* counts) const
+    {
+        assert(start + n <= size_);
+        BitCount::WordCounts(buffer_.get() + start, n, counts);
+    }
+
+    // returns the index of the n-th set bit (counting from 0) at or after
+    // start_bit, or size() if there aren't that many. Whole words are
+    // skipped by their popcount, so long runs of cleared bits are cheap.
+    int64_t find_set(int64_t const start_bit, int64_t n = 0) const
+    {
+        assert(n >= 0);
+        int64_t word = start_bit / 64;
+        if (word >= size_) return size();
+        uint64_t bits = buffer_[word] & (~uint64_t(0) << (start_bit % 64));
+        for (;;) {
+            int64_t const set = Util::PopCount(bits);
+            if (n < set) break;
+            n -= set;
+            if (++word == size_) return size();
+            bits = buffer_[word];
+        }
+        // drop the lowest n set bits of the word
+        while (n-- > 0) bits &= bits - 1;
+        return word * 64 + Util::CountTrailingZeros(bits);
+    }
+
     void free_memory()
     {
         buffer_.reset();
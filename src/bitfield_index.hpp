@@ -19,45 +19,68 @@
 
 struct bitfield_index
 {
-    // Cache the number of set bits every kIndexBucket bits.
-    // For a bitfield of size 2^32, this means a 32 MiB index
-    static inline const int64_t kIndexBucket = 1024;
+    // A two-level rank index, rank9 from Vigna's "Broadword Implementation of
+    // Rank/Select Queries". For every kIndexBucket bits it caches the number
+    // of set bits before them, and the number of set bits before each of
+    // their 64-bit words, relative to the bucket, in 9 bits each. For a
+    // bitfield of size 2^32, this means a 128 MiB index.
+    static inline const int64_t kIndexBucket = 512;
 
     bitfield_index(bitfield const& b) : bitfield_(b)
     {
-        uint64_t counter = 0;
-        index_.reserve(bitfield_.size() / kIndexBucket);
+        int64_t const size = bitfield_.size();
+        int64_t const num_words = size / 64;
+        int64_t const bucket_words = kIndexBucket / 64;
+        index_.resize((num_words + bucket_words - 1) / bucket_words * 2);
 
-        for (int64_t idx = 0; idx < int64_t(bitfield_.size()); idx += kIndexBucket) {
-            index_.push_back(counter);
-            int64_t const left = std::min(int64_t(bitfield_.size()) - idx, kIndexBucket);
-            counter += bitfield_.count(idx, idx + left);
+        // the bit counts of the words, 64 buckets at a time
+        uint8_t counts[64 * (kIndexBucket / 64)];
+        uint64_t counter = 0;
+        for (int64_t chunk = 0; chunk < num_words; chunk += sizeof(counts)) {
+            int64_t const chunk_words = std::min(int64_t(sizeof(counts)), num_words - chunk);
+            bitfield_.word_counts(chunk, chunk_words, counts);
+            for (int64_t first = 0; first < chunk_words; first += bucket_words) {
+                uint64_t relative = 0;
+                uint64_t word_counts = 0;
+                for (int64_t word = 0; word < bucket_words; ++word) {
+                    if (word > 0) word_counts |= relative << (9 * (word - 1));
+                    if (first + word < chunk_words) relative += counts[first + word];
+                }
+                int64_t const bucket = (chunk + first) / bucket_words;
+                index_[bucket * 2] = counter;
+                index_[bucket * 2 + 1] = word_counts;
+                counter += relative;
+            }
         }
     }
 
-    std::pair<uint64_t, uint64_t> lookup(uint64_t pos, uint64_t offset) const
+    // The number of set bits before bit, which is its index once the
+    // cleared bits are dropped
+    uint64_t rank(uint64_t const bit) const
     {
-        uint64_t const bucket = pos / kIndexBucket;
+        uint64_t const bucket = bit / kIndexBucket;
+        assert(bucket * 2 < index_.size());
+        int64_t const word = (bit / 64) % (kIndexBucket / 64);
+        uint64_t const relative =
+            word == 0 ? 0 : (index_[bucket * 2 + 1] >> (9 * (word - 1))) & 0x1ff;
+        uint64_t const aligned_bit = bit & ~uint64_t(63);
+        return index_[bucket * 2] + relative + bitfield_.count(aligned_bit, bit);
+    }
 
-        assert(bucket < index_.size());
+    std::pair<uint64_t, uint64_t> lookup(uint64_t pos, uint64_t offset) const
+    {
         assert(pos < uint64_t(bitfield_.size()));
         assert(pos + offset < uint64_t(bitfield_.size()));
         assert(bitfield_.get(pos) && bitfield_.get(pos + offset));
 
-        uint64_t const base = index_[bucket];
-
-        int64_t const aligned_pos = pos & ~uint64_t(63);
+        uint64_t const pos_rank = rank(pos);
+        uint64_t const offset_rank = rank(pos + offset);
 
-        uint64_t const aligned_pos_count = bitfield_.count(bucket * kIndexBucket, aligned_pos);
-        uint64_t const offset_count = aligned_pos_count + bitfield_.count(aligned_pos, pos + offset);
-        uint64_t const pos_count = aligned_pos_count + bitfield_.count(aligned_pos, pos);
+        assert(offset_rank >= pos_rank);
 
-        assert(offset_count >= pos_count);
-
-        return { base + pos_count, offset_count - pos_count };
+        return { pos_rank, offset_rank - pos_rank };
     }
 private:
     bitfield const& bitfield_;
     std::vector<uint64_t> index_;
 };
-
@@ -0,0 +1,212 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_BLAKE3_BATCH_HPP_
+#define SRC_CPP_BLAKE3_BATCH_HPP_
+
+#include <stdint.h>
+
+#include "blake3.h"
+#include "util.hpp"
+
+// Hashes many short inputs of the same length with BLAKE3. The inputs of the f
+// functions are at most 64 bytes, so each hash is the compression of a single
+// block with the CHUNK_START, CHUNK_END and ROOT flags. Where the CPU supports it,
+// 8 (AVX2) or 16 (AVX-512) inputs are compressed in parallel, one per vector lane.
+// blake3_hash_many() can't be used for this, since it only hashes whole 64 byte
+// blocks, and the block length is part of the hash.
+namespace Blake3Batch {
+
+    // Inputs are laid out with this stride, zero padded
+    const uint32_t kInputStride = 64;
+    const uint32_t kOutputSize = 32;
+
+    const uint32_t kIV[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+        0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+    const uint8_t kMsgSchedule[7][16] = {
+        {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+        {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+        {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+        {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+        {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+        {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+        {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+    };
+
+    // CHUNK_START | CHUNK_END | ROOT
+    const uint32_t kSingleBlockFlags = 1 | 2 | 8;
+
+#if defined(HAVE_X86_SIMD)
+
+#define BLAKE3_BATCH_G(ADD, XOR, ROTR, a, b, c, d, x, y) \
+    a = ADD(ADD(a, b), x);                               \
+    d = ROTR(XOR(d, a), 16);                             \
+    c = ADD(c, d);                                       \
+    b = ROTR(XOR(b, c), 12);                             \
+    a = ADD(ADD(a, b), y);                               \
+    d = ROTR(XOR(d, a), 8);                              \
+    c = ADD(c, d);                                       \
+    b = ROTR(XOR(b, c), 7)
+
+#define BLAKE3_BATCH_ROUNDS(ADD, XOR, ROTR, v, m)                                          \
+    for (int r = 0; r < 7; r++) {                                                          \
+        const uint8_t *s = kMsgSchedule[r];                                                \
+        BLAKE3_BATCH_G(ADD, XOR, ROTR, v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);         \
+        BLAKE3_BATCH_G(ADD, XOR, ROTR, v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);         \
+        BLAKE3_BATCH_G(ADD, XOR, ROTR, v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);        \
+        BLAKE3_BATCH_G(ADD, XOR, ROTR, v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);        \
+        BLAKE3_BATCH_G(ADD, XOR, ROTR, v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);        \
+        BLAKE3_BATCH_G(ADD, XOR, ROTR, v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);      \
+        BLAKE3_BATCH_G(ADD, XOR, ROTR, v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);       \
+        BLAKE3_BATCH_G(ADD, XOR, ROTR, v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);       \
+    }
+
+    // Hashes n_groups * 8 inputs
+    __attribute__((target("avx2"))) inline void HashAVX2(
+        const uint8_t *inputs,
+        uint32_t len,
+        uint64_t n_groups,
+        uint8_t *out)
+    {
+        const __m256i rot16 = _mm256_setr_epi8(
+            2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+            2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+        const __m256i rot8 = _mm256_setr_epi8(
+            1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+            1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+        const __m256i offsets = _mm256_setr_epi32(0, 64, 128, 192, 256, 320, 384, 448);
+        __m256i v[16], m[16];
+        alignas(32) uint32_t words[8][8];
+
+#define AVX2_ROTR(x, n)                                                      \
+    ((n) == 16 ? _mm256_shuffle_epi8(x, rot16)                               \
+     : (n) == 8 ? _mm256_shuffle_epi8(x, rot8)                               \
+                : _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n))))
+
+        for (uint64_t g = 0; g < n_groups; g++) {
+            for (int w = 0; w < 16; w++) {
+                m[w] = _mm256_i32gather_epi32(
+                    reinterpret_cast<const int *>(inputs + 4 * w), offsets, 1);
+            }
+            for (int w = 0; w < 8; w++) {
+                v[w] = _mm256_set1_epi32(kIV[w]);
+            }
+            for (int w = 0; w < 4; w++) {
+                v[8 + w] = _mm256_set1_epi32(kIV[w]);
+            }
+            v[12] = _mm256_setzero_si256();
+            v[13] = _mm256_setzero_si256();
+            v[14] = _mm256_set1_epi32(len);
+            v[15] = _mm256_set1_epi32(kSingleBlockFlags);
+
+            BLAKE3_BATCH_ROUNDS(_mm256_add_epi32, _mm256_xor_si256, AVX2_ROTR, v, m)
+
+            for (int w = 0; w < 8; w++) {
+                _mm256_store_si256(
+                    reinterpret_cast<__m256i *>(words[w]), _mm256_xor_si256(v[w], v[w + 8]));
+            }
+            for (int lane = 0; lane < 8; lane++) {
+                for (int w = 0; w < 8; w++) {
+                    // Output words are little endian
+                    memcpy(out + lane * kOutputSize + 4 * w, &words[w][lane], 4);
+                }
+            }
+
+            inputs += 8 * kInputStride;
+            out += 8 * kOutputSize;
+        }
+#undef AVX2_ROTR
+    }
+
+    // Hashes n_groups * 16 inputs
+    __attribute__((target("avx512f"))) inline void HashAVX512(
+        const uint8_t *inputs,
+        uint32_t len,
+        uint64_t n_groups,
+        uint8_t *out)
+    {
+        const __m512i in_offsets = _mm512_setr_epi32(
+            0, 64, 128, 192, 256, 320, 384, 448, 512, 576, 640, 704, 768, 832, 896, 960);
+        const __m512i out_offsets = _mm512_setr_epi32(
+            0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 480);
+        __m512i v[16], m[16];
+
+        // The masked forms of gather and ror are used, since the plain ones trip
+        // -Wmaybe-uninitialized in some GCC versions
+#define AVX512_ROTR(x, n) _mm512_maskz_ror_epi32(0xffff, x, n)
+
+        for (uint64_t g = 0; g < n_groups; g++) {
+            for (int w = 0; w < 16; w++) {
+                m[w] = _mm512_mask_i32gather_epi32(
+                    _mm512_setzero_si512(), 0xffff, in_offsets, inputs + 4 * w, 1);
+            }
+            for (int w = 0; w < 8; w++) {
+                v[w] = _mm512_set1_epi32(kIV[w]);
+            }
+            for (int w = 0; w < 4; w++) {
+                v[8 + w] = _mm512_set1_epi32(kIV[w]);
+            }
+            v[12] = _mm512_setzero_si512();
+            v[13] = _mm512_setzero_si512();
+            v[14] = _mm512_set1_epi32(len);
+            v[15] = _mm512_set1_epi32(kSingleBlockFlags);
+
+            BLAKE3_BATCH_ROUNDS(_mm512_add_epi32, _mm512_xor_si512, AVX512_ROTR, v, m)
+
+            for (int w = 0; w < 8; w++) {
+                _mm512_i32scatter_epi32(
+                    out + 4 * w, out_offsets, _mm512_xor_si512(v[w], v[w + 8]), 1);
+            }
+
+            inputs += 16 * kInputStride;
+            out += 16 * kOutputSize;
+        }
+#undef AVX512_ROTR
+    }
+
+#undef BLAKE3_BATCH_ROUNDS
+#undef BLAKE3_BATCH_G
+
+#endif  // HAVE_X86_SIMD
+
+    // Hashes n inputs of len bytes (len <= 64). Input i starts at inputs + i * kInputStride
+    // and must be zero padded to kInputStride bytes. Its 32 byte hash is written to
+    // out + i * kOutputSize.
+    inline void HashSingleBlocks(const uint8_t *inputs, uint32_t len, uint64_t n, uint8_t *out)
+    {
+        uint64_t i = 0;
+#if defined(HAVE_X86_SIMD)
+        static const bool have_avx512 = Util::HaveAVX512();
+        static const bool have_avx2 = Util::HaveAVX2();
+        if (have_avx512 && n >= 16) {
+            HashAVX512(inputs, len, n / 16, out);
+            i = n & ~15ULL;
+        }
+        if (have_avx2 && n - i >= 8) {
+            HashAVX2(inputs + i * kInputStride, len, (n - i) / 8, out + i * kOutputSize);
+            i = n & ~7ULL;
+        }
+#endif
+        for (; i < n; i++) {
+            blake3_hasher hasher;
+            blake3_hasher_init(&hasher);
+            blake3_hasher_update(&hasher, inputs + i * kInputStride, len);
+            blake3_hasher_finalize(&hasher, out + i * kOutputSize, kOutputSize);
+        }
+    }
+}
+
+#endif  // SRC_CPP_BLAKE3_BATCH_HPP_
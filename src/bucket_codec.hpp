@@ -0,0 +1,192 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_BUCKET_CODEC_HPP_
+#define SRC_CPP_BUCKET_CODEC_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include "disk.hpp"
+#include "exceptions.hpp"
+#include "radixsort.hpp"
+#include "util.hpp"
+
+// How the entries of sort buckets are stored in their files
+enum class bucket_codec_t : uint8_t
+{
+    // as they are
+    none,
+
+    // in blocks, which are sorted and then stored as the differences between
+    // consecutive entries. Entries of a bucket share their first bits, and
+    // sorted ones share more, so the differences take fewer bytes than the
+    // entries. This costs a sort of each block when writing the bucket.
+    delta,
+};
+
+namespace BucketCodec {
+
+    // A block is the number of entries in it (8 bytes), followed by one record
+    // per entry. A record is the number of bytes n of the difference to the
+    // previous entry, followed by the last n bytes of that difference. The
+    // first entry of a block is the difference to 0. Entries are subtracted
+    // as big endian numbers, which is the order memcmp() sorts them in.
+
+    // Entries are at most this long, the byte count of a record must fit a byte
+    inline uint32_t const kMaxEntryLen = 128;
+
+    // Records are written and read in chunks of this size
+    inline uint64_t const kChunkSize = 16 * 1024;
+
+    // Sorts the count entries of block, and writes their encoding to disk,
+    // starting at begin. Returns the number of bytes written.
+    template <typename Output>
+    inline uint64_t EncodeBlock(
+        Output &disk,
+        uint64_t const begin,
+        uint8_t *block,
+        uint64_t const count,
+        uint32_t const entry_len)
+    {
+        assert(entry_len <= kMaxEntryLen);
+        assert(count > 0);
+        RadixSort::Sort(block, entry_len, count, 0);
+
+        uint8_t out[kChunkSize];
+        uint8_t delta[kMaxEntryLen];
+        uint8_t const zero[kMaxEntryLen] = {};
+        uint64_t written = 0;
+        Util::IntToEightBytes(out, count);
+        uint64_t out_len = 8;
+
+        uint8_t const *prev = zero;
+        for (uint64_t i = 0; i < count; ++i) {
+            uint8_t const *cur = block + i * entry_len;
+            int borrow = 0;
+            for (int32_t j = entry_len - 1; j >= 0; --j) {
+                int const d = int(cur[j]) - prev[j] - borrow;
+                delta[j] = uint8_t(d);
+                borrow = d < 0;
+            }
+            uint32_t skip = 0;
+            while (skip < entry_len && delta[skip] == 0) ++skip;
+
+            if (out_len + 1 + entry_len > kChunkSize) {
+                disk.Write(begin + written, out, out_len);
+                written += out_len;
+                out_len = 0;
+            }
+            out[out_len++] = uint8_t(entry_len - skip);
+            memcpy(out + out_len, delta + skip, entry_len - skip);
+            out_len += entry_len - skip;
+            prev = cur;
+        }
+        disk.Write(begin + written, out, out_len);
+        return written + out_len;
+    }
+
+    // Reads the blocks written by EncodeBlock() to the first size bytes of a
+    // file, in order. It stands in for the file in UniformSort::SortToMemory(),
+    // so reads are at the offsets the entries would have unencoded.
+    class Decoder {
+    public:
+        Decoder(FileDisk &disk, uint64_t const size, uint32_t const entry_len)
+            : disk_(disk)
+            , size_(size)
+            , entry_len_(entry_len)
+            , buffer_size_(std::max(kChunkSize, disk.BufferSize()))
+            , buffer_(new uint8_t[buffer_size_])
+        {
+            assert(entry_len_ <= kMaxEntryLen);
+        }
+
+        uint64_t BufferSize() const { return buffer_size_; }
+
+        // Decodes the next length / entry_len entries into out
+        void Read(uint64_t const begin, uint8_t *out, uint64_t const length)
+        {
+            assert(begin == offset_);
+            assert(length % entry_len_ == 0);
+            for (uint64_t i = 0; i < length; i += entry_len_) {
+                // a block header and a whole record are in the buffer
+                if (buffer_end_ - buffer_pos_ < 9 + entry_len_) Refill();
+
+                if (block_left_ == 0) {
+                    if (buffer_end_ - buffer_pos_ < 8) {
+                        throw InvalidStateException("Read past the end of sort bucket");
+                    }
+                    block_left_ = Util::EightBytesToInt(buffer_.get() + buffer_pos_);
+                    buffer_pos_ += 8;
+                    memset(prev_, 0, entry_len_);
+                    // blocks are never empty
+                    if (buffer_end_ == buffer_pos_ || block_left_ == 0) {
+                        throw InvalidStateException("Corrupt sort bucket");
+                    }
+                }
+
+                uint32_t const n = buffer_[buffer_pos_++];
+                if (n > entry_len_ || buffer_pos_ + n > buffer_end_) {
+                    throw InvalidStateException("Corrupt sort bucket");
+                }
+                // the difference is right aligned with the entry
+                uint8_t const *delta = buffer_.get() + buffer_pos_;
+                uint32_t const skip = entry_len_ - n;
+                uint32_t carry = 0;
+                for (int32_t j = entry_len_ - 1; j >= 0; --j) {
+                    uint32_t const d = uint32_t(j) >= skip ? delta[j - skip] : 0;
+                    uint32_t const sum = prev_[j] + d + carry;
+                    prev_[j] = uint8_t(sum);
+                    carry = sum >> 8;
+                }
+                memcpy(out + i, prev_, entry_len_);
+                buffer_pos_ += n;
+                --block_left_;
+            }
+            offset_ += length;
+        }
+
+    private:
+        FileDisk &disk_;
+        uint64_t const size_;
+        uint32_t const entry_len_;
+        uint64_t const buffer_size_;
+        std::unique_ptr<uint8_t[]> buffer_;
+
+        // the part of the buffer not decoded yet
+        uint64_t buffer_pos_ = 0;
+        uint64_t buffer_end_ = 0;
+        // where in the file the buffer continues
+        uint64_t file_pos_ = 0;
+        // the offset of the next entry, unencoded
+        uint64_t offset_ = 0;
+        uint64_t block_left_ = 0;
+        uint8_t prev_[kMaxEntryLen] = {};
+
+        void Refill()
+        {
+            if (file_pos_ == size_) return;
+            uint64_t const left = buffer_end_ - buffer_pos_;
+            memmove(buffer_.get(), buffer_.get() + buffer_pos_, left);
+            uint64_t const amount = std::min(buffer_size_ - left, size_ - file_pos_);
+            disk_.Read(file_pos_, buffer_.get() + left, amount);
+            file_pos_ += amount;
+            buffer_pos_ = 0;
+            buffer_end_ = left + amount;
+        }
+    };
+}
+
+#endif  // SRC_CPP_BUCKET_CODEC_HPP_
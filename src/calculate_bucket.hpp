@@ -27,6 +27,7 @@
 #include <vector>
 
 #include "blake3.h"
+#include "blake3_batch.hpp"
 #include "bits.hpp"
 #include "chacha8.h"
 #include "pos_constants.hpp"
@@ -90,6 +91,10 @@ public:
 
         // Setup ChaCha8 context with zero-filled IV
         chacha8_keysetup(&this->enc_ctx_, enc_key, 256, NULL);
+
+#if defined(HAVE_X86_SIMD)
+        this->have_avx2_ = Util::HaveAVX2();
+#endif
     }
 
     inline ~F1Calculator()
@@ -176,7 +181,14 @@ public:
         assert(n <= (1U << kBatchSizes));
 
         chacha8_get_keystream(&this->enc_ctx_, start, num_blocks, buf_);
-        for (uint64_t x = first_x; x < first_x + n; x++) {
+        uint64_t done = 0;
+#if defined(HAVE_X86_SIMD)
+        if (have_avx2_) {
+            done = UnpackBucketsAVX2(first_x, n, start_bit, res);
+            start_bit += done * k_;
+        }
+#endif
+        for (uint64_t x = first_x + done; x < first_x + n; x++) {
             uint64_t y = Util::SliceInt64FromBytes(buf_, start_bit, k_);
 
             res[x - first_x] = (y << kExtraBits) | (x >> x_shift);
@@ -186,6 +198,47 @@ public:
     }
 
 private:
+#if defined(HAVE_X86_SIMD)
+    // Same as the scalar loop in CalculateBuckets(), four entries at a time.
+    // Each y is read as a big endian 64 bit word starting at the byte that
+    // holds its first bit, like SliceInt64FromBytes() does. Returns the number
+    // of entries written to res[].
+    __attribute__((target("avx2"))) uint64_t
+    UnpackBucketsAVX2(uint64_t first_x, uint64_t n, uint32_t start_bit, uint64_t *res) const
+    {
+        const __m256i bswap = _mm256_setr_epi8(
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+            7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        const __m128i y_shift = _mm_cvtsi32_si128(64 - k_);
+        const __m128i x_shift = _mm_cvtsi32_si128(k_ - kExtraBits);
+        const __m256i seven = _mm256_set1_epi64x(7);
+        const __m256i bits_step = _mm256_set1_epi64x(4 * k_);
+        const __m256i x_step = _mm256_set1_epi64x(4);
+
+        __m256i bits = _mm256_add_epi64(
+            _mm256_set1_epi64x(start_bit), _mm256_setr_epi64x(0, k_, 2 * k_, 3 * k_));
+        __m256i x = _mm256_add_epi64(_mm256_set1_epi64x(first_x), _mm256_setr_epi64x(0, 1, 2, 3));
+
+        uint64_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m256i y = _mm256_i64gather_epi64(
+                reinterpret_cast<const long long *>(buf_), _mm256_srli_epi64(bits, 3), 1);
+            y = _mm256_shuffle_epi8(y, bswap);
+            y = _mm256_sllv_epi64(y, _mm256_and_si256(bits, seven));
+            y = _mm256_srl_epi64(y, y_shift);
+            y = _mm256_or_si256(_mm256_slli_epi64(y, kExtraBits), _mm256_srl_epi64(x, x_shift));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(res + i), y);
+
+            bits = _mm256_add_epi64(bits, bits_step);
+            x = _mm256_add_epi64(x, x_step);
+        }
+        return i;
+    }
+
+    bool have_avx2_ = false;
+#endif
+
+
     // Size of the plot
     uint8_t k_{};
 
@@ -195,6 +248,52 @@ private:
     uint8_t *buf_{};
 };
 
+// A bucket of entries, with the fields of PlotEntry stored as a structure of arrays. The
+// arrays keep their capacity when the bucket is cleared, so a bucket that is reused stops
+// allocating once it has grown to the largest bucket size.
+struct PlotEntryBucket {
+    std::vector<uint64_t> y;
+    std::vector<uint64_t> pos;
+    std::vector<uint64_t> read_posoffset;
+    std::vector<uint128_t> left_metadata;
+    std::vector<uint128_t> right_metadata;
+    std::vector<uint8_t> used;
+
+    size_t size() const { return y.size(); }
+
+    bool empty() const { return y.empty(); }
+
+    void reserve(size_t n)
+    {
+        y.reserve(n);
+        pos.reserve(n);
+        read_posoffset.reserve(n);
+        left_metadata.reserve(n);
+        right_metadata.reserve(n);
+        used.reserve(n);
+    }
+
+    void clear()
+    {
+        y.clear();
+        pos.clear();
+        read_posoffset.clear();
+        left_metadata.clear();
+        right_metadata.clear();
+        used.clear();
+    }
+
+    void push_back(const PlotEntry& entry)
+    {
+        y.push_back(entry.y);
+        pos.push_back(entry.pos);
+        read_posoffset.push_back(entry.read_posoffset);
+        left_metadata.push_back(entry.left_metadata);
+        right_metadata.push_back(entry.right_metadata);
+        used.push_back(entry.used);
+    }
+};
+
 struct rmap_item {
     uint16_t count : 4;
     uint16_t pos : 12;
@@ -211,6 +310,7 @@ public:
         this->table_index_ = table_index;
 
         this->rmap.resize(kBC);
+        this->rmap_bits.resize(cdiv(kBC, 32), 0);
         {
             std::lock_guard<std::mutex> guard(tableMutex);
             if (!initialized) {
@@ -218,6 +318,16 @@ public:
                 initialized = true;
             }
         }
+
+        for (uint16_t parity = 0; parity < 2; parity++) {
+            for (uint16_t m = 0; m < kExtraBitsPow; m++) {
+                target_squares_[parity][m] = ((2 * m + parity) * (2 * m + parity)) % kC;
+            }
+        }
+#if defined(HAVE_X86_SIMD)
+        this->have_avx512_ = Util::HaveAVX512();
+        this->have_avx2_ = Util::HaveAVX2();
+#endif
     }
 
     inline ~FxCalculator() = default;
@@ -257,8 +367,8 @@ public:
         } else if (table_index_ < 7) {
             uint8_t len = kVectorLens[table_index_ + 1];
             uint8_t start_byte = (k_ + kExtraBits) / 8;
-            uint8_t end_bit = k_ + kExtraBits + k_ * len;
-            uint8_t end_byte = cdiv(end_bit, 8);
+            uint16_t end_bit = k_ + kExtraBits + k_ * len;
+            uint16_t end_byte = cdiv(end_bit, 8);
 
             // TODO: proper support for partial bytes in Bits ctor
             c = Bits(hash_bytes + start_byte, end_byte - start_byte, (end_byte - start_byte) * 8);
@@ -269,6 +379,80 @@ public:
         return std::make_pair(Bits(f, k_ + kExtraBits), c);
     }
 
+    // Evaluates f for the n matches (bucket_L[idx_L[i]], bucket_R[idx_R[i]]) at once, with the
+    // same results as CalculateBucket(). The output y goes to f_out[i], and the new metadata to
+    // meta_out_left[i] and meta_out_right[i], split like PlotEntry: the first 128 bits go in
+    // left, and the remaining bits, if any, in right. Metadata of the input entries is read
+    // the same way.
+    //
+    // With kK != 0, k and the table index are taken to be kK and kTable, which must match the
+    // ones this FxCalculator was created with, so that all sizes and shifts are constants.
+    template <uint8_t kK = 0, uint8_t kTable = 0>
+    void CalculateBuckets(
+        const PlotEntryBucket& bucket_L,
+        const PlotEntryBucket& bucket_R,
+        const uint16_t *idx_L,
+        const uint16_t *idx_R,
+        int32_t n,
+        uint64_t *f_out,
+        uint128_t *meta_out_left,
+        uint128_t *meta_out_right)
+    {
+        uint8_t const k = kK ? kK : k_;
+        uint8_t const table_index = kK ? kTable : table_index_;
+        uint32_t const y_size = k + kExtraBits;
+        uint32_t const meta_size = kVectorLens[table_index] * k;
+        uint32_t const out_meta_size = table_index < 7 ? kVectorLens[table_index + 1] * k : 0;
+        uint32_t const input_len = cdiv(y_size + 2 * meta_size, 8);
+
+        // 8 bytes of head-room for OrBitsIntoBytes() and SliceInt64FromBytes()
+        if (batch_input_.size() < n * Blake3Batch::kInputStride + 8) {
+            batch_input_.resize(n * Blake3Batch::kInputStride + 8);
+            batch_hash_.resize(n * Blake3Batch::kOutputSize + 8);
+        }
+        memset(batch_input_.data(), 0, n * Blake3Batch::kInputStride);
+
+        for (int32_t i = 0; i < n; i++) {
+            uint8_t *input = batch_input_.data() + i * Blake3Batch::kInputStride;
+            Util::OrBitsIntoBytes(input, 0, bucket_L.y[idx_L[i]], y_size);
+            AppendMetadata(input, y_size, bucket_L, idx_L[i], meta_size);
+            AppendMetadata(input, y_size + meta_size, bucket_R, idx_R[i], meta_size);
+        }
+
+        Blake3Batch::HashSingleBlocks(batch_input_.data(), input_len, n, batch_hash_.data());
+
+        for (int32_t i = 0; i < n; i++) {
+            const uint8_t *hash = batch_hash_.data() + i * Blake3Batch::kOutputSize;
+            f_out[i] = Util::EightBytesToInt(hash) >> (64 - y_size);
+
+            if (out_meta_size == 0) {
+                // Table 7 has no metadata
+                meta_out_left[i] = 0;
+                meta_out_right[i] = 0;
+            } else if (table_index < 4) {
+                // The metadata is L + R, which is at most 4k bits. For table_index < 4
+                // the input metadata is at most 2k bits, so it's always in left_metadata.
+                uint128_t const L_meta = bucket_L.left_metadata[idx_L[i]];
+                uint128_t const R_meta = bucket_R.left_metadata[idx_R[i]];
+                if (out_meta_size <= 128) {
+                    meta_out_left[i] = (L_meta << meta_size) | R_meta;
+                    meta_out_right[i] = 0;
+                } else {
+                    uint32_t const right_size = out_meta_size - 128;
+                    meta_out_left[i] = (L_meta << (128 - meta_size)) | (R_meta >> right_size);
+                    meta_out_right[i] = R_meta & (((uint128_t)1 << right_size) - 1);
+                }
+            } else if (out_meta_size <= 128) {
+                meta_out_left[i] = Util::SliceInt128FromBytes(hash, y_size, out_meta_size);
+                meta_out_right[i] = 0;
+            } else {
+                meta_out_left[i] = Util::SliceInt128FromBytes(hash, y_size, 128);
+                meta_out_right[i] =
+                    Util::SliceInt128FromBytes(hash, y_size + 128, out_meta_size - 128);
+            }
+        }
+    }
+
     // Given two buckets with entries (y values), computes which y values match, and returns a list
     // of the pairs of indices into bucket_L and bucket_R. Indices l and r match iff:
     //   let  yl = bucket_L[l].y,  yr = bucket_R[r].y
@@ -279,39 +463,89 @@ public:
     //   (yr % kBC) % kC - (yl % kBC) % kC = (2m + (yl/kBC) % 2)^2   (mod kC)
     //
     // Instead of doing the naive algorithm, which is an O(kExtraBitsPow * N^2) comparisons on
-    // bucket length, we can store all the R values and lookup each of our 32 candidates to see if
-    // any R value matches. This function can be further optimized by removing the inner loop, and
-    // being more careful with memory allocation.
+    // bucket length, we can store all the R values and lookup each of our 64 candidates to see if
+    // any R value matches. The R values are marked in an occupancy bitmap, and where the CPU
+    // supports it, the candidates are computed and looked up 8 or 16 at a time. Matches are
+    // returned ordered by l, then m, then r.
     inline int32_t FindMatches(
         const std::vector<PlotEntry>& bucket_L,
         const std::vector<PlotEntry>& bucket_R,
         uint16_t *idx_L,
         uint16_t *idx_R)
     {
-        int32_t idx_count = 0;
-        uint16_t parity = (bucket_L[0].y / kBC) % 2;
+        return FindMatches(
+            bucket_L.size(),
+            [&](size_t i) { return bucket_L[i].y; },
+            bucket_R.size(),
+            [&](size_t i) { return bucket_R[i].y; },
+            idx_L,
+            idx_R);
+    }
 
-        for (size_t yl : rmap_clean) {
-            this->rmap[yl].count = 0;
-        }
-        rmap_clean.clear();
+    inline int32_t FindMatches(
+        const PlotEntryBucket& bucket_L,
+        const PlotEntryBucket& bucket_R,
+        uint16_t *idx_L,
+        uint16_t *idx_R)
+    {
+        return FindMatches(
+            bucket_L.size(),
+            [&](size_t i) { return bucket_L.y[i]; },
+            bucket_R.size(),
+            [&](size_t i) { return bucket_R.y[i]; },
+            idx_L,
+            idx_R);
+    }
+
+private:
+    template <typename YL, typename YR>
+    inline int32_t FindMatches(
+        size_t size_L,
+        YL y_L,
+        size_t size_R,
+        YR y_R,
+        uint16_t *idx_L,
+        uint16_t *idx_R)
+    {
+        int32_t idx_count = 0;
+        uint16_t parity = (y_L(0) / kBC) % 2;
 
-        uint64_t remove = (bucket_R[0].y / kBC) * kBC;
-        for (size_t pos_R = 0; pos_R < bucket_R.size(); pos_R++) {
-            uint64_t r_y = bucket_R[pos_R].y - remove;
+        // rmap[y] is only valid where bit y of rmap_bits is set, so it's written when an R
+        // value is first seen, and never needs to be cleared.
+        uint64_t remove = (y_R(0) / kBC) * kBC;
+        for (size_t pos_R = 0; pos_R < size_R; pos_R++) {
+            uint64_t r_y = y_R(pos_R) - remove;
+            uint32_t const bit = 1U << (r_y % 32);
 
-            if (!rmap[r_y].count) {
+            if (!(rmap_bits[r_y / 32] & bit)) {
+                rmap_bits[r_y / 32] |= bit;
                 rmap[r_y].pos = pos_R;
+                rmap[r_y].count = 1;
+            } else {
+                rmap[r_y].count++;
             }
-            rmap[r_y].count++;
-            rmap_clean.push_back(r_y);
         }
 
         uint64_t remove_y = remove - kBC;
-        for (size_t pos_L = 0; pos_L < bucket_L.size(); pos_L++) {
-            uint64_t r = bucket_L[pos_L].y - remove_y;
-            for (uint8_t i = 0; i < kExtraBitsPow; i++) {
-                uint16_t r_target = L_targets[parity][r][i];
+        uint32_t targets[kExtraBitsPow];
+        for (size_t pos_L = 0; pos_L < size_L; pos_L++) {
+            uint64_t r = y_L(pos_L) - remove_y;
+            uint64_t hits;
+#if defined(HAVE_X86_SIMD)
+            if (have_avx512_) {
+                hits = TargetHitsAVX512(parity, r, targets);
+            } else if (have_avx2_) {
+                hits = TargetHitsAVX2(parity, r, targets);
+            } else
+#endif
+            {
+                hits = TargetHits(parity, r, targets);
+            }
+
+            // Bit m of hits is set if target m is occupied
+            while (hits != 0) {
+                uint32_t const r_target = targets[Util::CountTrailingZeros(hits)];
+                hits &= hits - 1;
                 for (size_t j = 0; j < rmap[r_target].count; j++) {
                     if(idx_L != nullptr) {
                         idx_L[idx_count]=pos_L;
@@ -321,14 +555,135 @@ public:
                 }
             }
         }
+
+        // Leaves the bitmap empty for the next call
+        for (size_t pos_R = 0; pos_R < size_R; pos_R++) {
+            rmap_bits[(y_R(pos_R) - remove) / 32] = 0;
+        }
         return idx_count;
     }
 
-private:
+    // Writes the 64 match targets of a left entry at r (y % kBC of the left bucket) to
+    // targets[], and returns a mask of the targets that are set in rmap_bits.
+    uint64_t TargetHits(uint16_t parity, uint64_t r, uint32_t *targets) const
+    {
+        uint64_t hits = 0;
+        for (uint8_t m = 0; m < kExtraBitsPow; m++) {
+            uint16_t const r_target = L_targets[parity][r][m];
+            targets[m] = r_target;
+            hits |= (uint64_t)((rmap_bits[r_target / 32] >> (r_target % 32)) & 1) << m;
+        }
+        return hits;
+    }
+
+#if defined(HAVE_X86_SIMD)
+    // Same as TargetHits(), without the L_targets table: target m is
+    // ((r / kC + m) % kB) * kC + ((2m + parity)^2 + r % kC) % kC. Both sums are less than
+    // twice the modulus, so the modulo is min(x, x - modulus), unsigned.
+    __attribute__((target("avx2"))) uint64_t
+    TargetHitsAVX2(uint16_t parity, uint64_t r, uint32_t *targets) const
+    {
+        const __m256i b_mod = _mm256_set1_epi32(kB);
+        const __m256i c_mod = _mm256_set1_epi32(kC);
+        const __m256i indJ = _mm256_set1_epi32(r / kC);
+        const __m256i r_c = _mm256_set1_epi32(r % kC);
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i thirty_one = _mm256_set1_epi32(31);
+        const int *bits = reinterpret_cast<const int *>(rmap_bits.data());
+
+        uint64_t hits = 0;
+        __m256i m = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        for (uint32_t g = 0; g < kExtraBitsPow; g += 8) {
+            __m256i a = _mm256_add_epi32(indJ, m);
+            a = _mm256_min_epu32(a, _mm256_sub_epi32(a, b_mod));
+            __m256i b = _mm256_add_epi32(
+                r_c,
+                _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(&target_squares_[parity][g])));
+            b = _mm256_min_epu32(b, _mm256_sub_epi32(b, c_mod));
+            __m256i const t = _mm256_add_epi32(_mm256_mullo_epi32(a, c_mod), b);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(targets + g), t);
+
+            __m256i const words = _mm256_i32gather_epi32(bits, _mm256_srli_epi32(t, 5), 4);
+            __m256i const hit = _mm256_and_si256(
+                words, _mm256_sllv_epi32(one, _mm256_and_si256(t, thirty_one)));
+            uint32_t const empty = _mm256_movemask_ps(
+                _mm256_castsi256_ps(_mm256_cmpeq_epi32(hit, _mm256_setzero_si256())));
+            hits |= (uint64_t)(~empty & 0xff) << g;
+
+            m = _mm256_add_epi32(m, _mm256_set1_epi32(8));
+        }
+        return hits;
+    }
+
+    __attribute__((target("avx512f"))) uint64_t
+    TargetHitsAVX512(uint16_t parity, uint64_t r, uint32_t *targets) const
+    {
+        const __m512i b_mod = _mm512_set1_epi32(kB);
+        const __m512i c_mod = _mm512_set1_epi32(kC);
+        const __m512i indJ = _mm512_set1_epi32(r / kC);
+        const __m512i r_c = _mm512_set1_epi32(r % kC);
+        const __m512i one = _mm512_set1_epi32(1);
+        const __m512i thirty_one = _mm512_set1_epi32(31);
+
+        uint64_t hits = 0;
+        __m512i m = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        // The masked forms are used, since the plain ones trip -Wmaybe-uninitialized
+        // in some GCC versions
+        for (uint32_t g = 0; g < kExtraBitsPow; g += 16) {
+            __m512i a = _mm512_add_epi32(indJ, m);
+            a = _mm512_maskz_min_epu32(0xffff, a, _mm512_sub_epi32(a, b_mod));
+            __m512i b = _mm512_add_epi32(r_c, _mm512_loadu_si512(&target_squares_[parity][g]));
+            b = _mm512_maskz_min_epu32(0xffff, b, _mm512_sub_epi32(b, c_mod));
+            __m512i const t = _mm512_add_epi32(_mm512_mullo_epi32(a, c_mod), b);
+            _mm512_storeu_si512(targets + g, t);
+
+            __m512i const words = _mm512_mask_i32gather_epi32(
+                _mm512_setzero_si512(),
+                0xffff,
+                _mm512_maskz_srli_epi32(0xffff, t, 5),
+                rmap_bits.data(),
+                4);
+            __mmask16 const hit = _mm512_test_epi32_mask(
+                words,
+                _mm512_maskz_sllv_epi32(0xffff, one, _mm512_and_si512(t, thirty_one)));
+            hits |= (uint64_t)hit << g;
+
+            m = _mm512_add_epi32(m, _mm512_set1_epi32(16));
+        }
+        return hits;
+    }
+#endif
+
+    static void AppendMetadata(
+        uint8_t *input,
+        uint32_t start_bit,
+        const PlotEntryBucket& bucket,
+        size_t i,
+        uint32_t meta_size)
+    {
+        if (meta_size > 128) {
+            Util::OrBits128IntoBytes(input, start_bit, bucket.left_metadata[i], 128);
+            Util::OrBits128IntoBytes(
+                input, start_bit + 128, bucket.right_metadata[i], meta_size - 128);
+        } else {
+            Util::OrBits128IntoBytes(input, start_bit, bucket.left_metadata[i], meta_size);
+        }
+    }
+
     uint8_t k_{};
     uint8_t table_index_{};
     std::vector<struct rmap_item> rmap;
-    std::vector<uint16_t> rmap_clean;
+    // Bit y is set if rmap[y] is valid
+    std::vector<uint32_t> rmap_bits;
+    // (2m + parity)^2 % kC
+    uint32_t target_squares_[2][kExtraBitsPow];
+#if defined(HAVE_X86_SIMD)
+    bool have_avx512_ = false;
+    bool have_avx2_ = false;
+#endif
+    std::vector<uint8_t> batch_input_;
+    std::vector<uint8_t> batch_hash_;
 };
 
 #endif  // SRC_CPP_CALCULATE_BUCKET_HPP_
@@ -1,5 +1,17 @@
 #include "chacha8.h"
 
+/*
+ * On x86-64 with GCC or clang, several blocks are computed in parallel, one
+ * block per vector lane: 4 with SSE2, 8 with AVX2 and 16 with AVX-512. The
+ * kernels are compiled with target attributes and picked at runtime, so the
+ * build does not need any -m flags. Other platforms use the scalar code.
+ */
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CHACHA8_X86_SIMD 1
+#include <immintrin.h>
+#include <stdatomic.h>
+#endif
+
 #define U32TO32_LITTLE(v) (v)
 #define U8TO32_LITTLE(p) (*(const uint32_t *)(p))
 #define U32TO8_LITTLE(p, v) (((uint32_t *)(p))[0] = U32TO32_LITTLE(v))
@@ -54,7 +66,11 @@ void chacha8_keysetup(struct chacha8_ctx *x, const uint8_t *k, uint32_t kbits, c
     }
 }
 
-void chacha8_get_keystream(const struct chacha8_ctx *x, uint64_t pos, uint32_t n_blocks, uint8_t *c)
+static void chacha8_get_keystream_scalar(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_blocks,
+    uint8_t *c)
 {
     uint32_t x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
     uint32_t j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14, j15;
@@ -147,3 +163,265 @@ void chacha8_get_keystream(const struct chacha8_ctx *x, uint64_t pos, uint32_t n
         c += 64;
     }
 }
+
+#if defined(CHACHA8_X86_SIMD)
+
+/*
+ * The SIMD kernels keep word i of every block in vector v[i]. After the rounds,
+ * groups of four vectors are transposed within 128-bit lanes, so that 128-bit
+ * lane L of u[4 * g + j] holds words 4g..4g+3 of block 4L+j. These lanes are
+ * then stored (or recombined) to produce whole 64 byte blocks.
+ */
+
+#define SIMD_QUARTERROUND(ADD, XOR, ROTL, a, b, c, d) \
+    a = ADD(a, b);                                    \
+    d = ROTL(XOR(d, a), 16);                          \
+    c = ADD(c, d);                                    \
+    b = ROTL(XOR(b, c), 12);                          \
+    a = ADD(a, b);                                    \
+    d = ROTL(XOR(d, a), 8);                           \
+    c = ADD(c, d);                                    \
+    b = ROTL(XOR(b, c), 7)
+
+#define SIMD_ROUNDS(ADD, XOR, ROTL, v)                                   \
+    for (i = 8; i > 0; i -= 2) {                                         \
+        SIMD_QUARTERROUND(ADD, XOR, ROTL, v[0], v[4], v[8], v[12]);      \
+        SIMD_QUARTERROUND(ADD, XOR, ROTL, v[1], v[5], v[9], v[13]);      \
+        SIMD_QUARTERROUND(ADD, XOR, ROTL, v[2], v[6], v[10], v[14]);     \
+        SIMD_QUARTERROUND(ADD, XOR, ROTL, v[3], v[7], v[11], v[15]);     \
+        SIMD_QUARTERROUND(ADD, XOR, ROTL, v[0], v[5], v[10], v[15]);     \
+        SIMD_QUARTERROUND(ADD, XOR, ROTL, v[1], v[6], v[11], v[12]);     \
+        SIMD_QUARTERROUND(ADD, XOR, ROTL, v[2], v[7], v[8], v[13]);      \
+        SIMD_QUARTERROUND(ADD, XOR, ROTL, v[3], v[4], v[9], v[14]);      \
+    }
+
+/* Transposes each group of four vectors, within 128-bit lanes */
+#define SIMD_TRANSPOSE4(UNPACKLO32, UNPACKHI32, UNPACKLO64, UNPACKHI64, v, u) \
+    for (i = 0; i < 16; i += 4) {                                            \
+        t0 = UNPACKLO32(v[i], v[i + 1]);                                     \
+        t1 = UNPACKHI32(v[i], v[i + 1]);                                     \
+        t2 = UNPACKLO32(v[i + 2], v[i + 3]);                                 \
+        t3 = UNPACKHI32(v[i + 2], v[i + 3]);                                 \
+        u[i] = UNPACKLO64(t0, t2);                                           \
+        u[i + 1] = UNPACKHI64(t0, t2);                                       \
+        u[i + 2] = UNPACKLO64(t1, t3);                                       \
+        u[i + 3] = UNPACKHI64(t1, t3);                                       \
+    }
+
+#define SSE2_ROTL(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+/* Computes n_groups * 4 blocks */
+static void chacha8_get_keystream_sse2(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_groups,
+    uint8_t *c)
+{
+    __m128i j[16], v[16], u[16], t0, t1, t2, t3;
+    const __m128i sign = _mm_set1_epi32((int)0x80000000);
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        j[i] = _mm_set1_epi32((int)x->input[i]);
+    }
+
+    while (n_groups--) {
+        /* 64-bit block counters pos..pos+3, split into low and high words */
+        const __m128i lo_base = _mm_set1_epi32((int)(uint32_t)pos);
+        j[12] = _mm_add_epi32(lo_base, _mm_setr_epi32(0, 1, 2, 3));
+        /* carry where the low word wrapped around, unsigned compare through the sign bit */
+        j[13] = _mm_sub_epi32(
+            _mm_set1_epi32((int)(uint32_t)(pos >> 32)),
+            _mm_cmpgt_epi32(_mm_xor_si128(lo_base, sign), _mm_xor_si128(j[12], sign)));
+
+        for (i = 0; i < 16; i++) {
+            v[i] = j[i];
+        }
+        SIMD_ROUNDS(_mm_add_epi32, _mm_xor_si128, SSE2_ROTL, v)
+        for (i = 0; i < 16; i++) {
+            v[i] = _mm_add_epi32(v[i], j[i]);
+        }
+
+        SIMD_TRANSPOSE4(
+            _mm_unpacklo_epi32, _mm_unpackhi_epi32, _mm_unpacklo_epi64, _mm_unpackhi_epi64, v, u)
+        for (i = 0; i < 16; i++) {
+            /* u[4 * g + b] is words 4g..4g+3 of block b */
+            _mm_storeu_si128((__m128i *)(c + (i % 4) * 64 + (i / 4) * 16), u[i]);
+        }
+
+        pos += 4;
+        c += 4 * 64;
+    }
+}
+
+#define AVX2_ROTL(v, n)                                                        \
+    ((n) == 16 ? _mm256_shuffle_epi8(v, rot16)                                 \
+     : (n) == 8 ? _mm256_shuffle_epi8(v, rot8)                                 \
+                : _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n))))
+
+/* Computes n_groups * 8 blocks */
+__attribute__((target("avx2"))) static void chacha8_get_keystream_avx2(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_groups,
+    uint8_t *c)
+{
+    __m256i j[16], v[16], u[16], t0, t1, t2, t3;
+    const __m256i sign = _mm256_set1_epi32((int)0x80000000);
+    const __m256i rot16 = _mm256_setr_epi8(
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(
+        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        j[i] = _mm256_set1_epi32((int)x->input[i]);
+    }
+
+    while (n_groups--) {
+        const __m256i lo_base = _mm256_set1_epi32((int)(uint32_t)pos);
+        j[12] = _mm256_add_epi32(lo_base, _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        j[13] = _mm256_sub_epi32(
+            _mm256_set1_epi32((int)(uint32_t)(pos >> 32)),
+            _mm256_cmpgt_epi32(
+                _mm256_xor_si256(lo_base, sign), _mm256_xor_si256(j[12], sign)));
+
+        for (i = 0; i < 16; i++) {
+            v[i] = j[i];
+        }
+        SIMD_ROUNDS(_mm256_add_epi32, _mm256_xor_si256, AVX2_ROTL, v)
+        for (i = 0; i < 16; i++) {
+            v[i] = _mm256_add_epi32(v[i], j[i]);
+        }
+
+        SIMD_TRANSPOSE4(
+            _mm256_unpacklo_epi32,
+            _mm256_unpackhi_epi32,
+            _mm256_unpacklo_epi64,
+            _mm256_unpackhi_epi64,
+            v,
+            u)
+        for (i = 0; i < 4; i++) {
+            /* block i from the low lanes, block 4 + i from the high lanes */
+            _mm256_storeu_si256(
+                (__m256i *)(c + i * 64), _mm256_permute2x128_si256(u[i], u[4 + i], 0x20));
+            _mm256_storeu_si256(
+                (__m256i *)(c + i * 64 + 32), _mm256_permute2x128_si256(u[8 + i], u[12 + i], 0x20));
+            _mm256_storeu_si256(
+                (__m256i *)(c + (4 + i) * 64), _mm256_permute2x128_si256(u[i], u[4 + i], 0x31));
+            _mm256_storeu_si256(
+                (__m256i *)(c + (4 + i) * 64 + 32),
+                _mm256_permute2x128_si256(u[8 + i], u[12 + i], 0x31));
+        }
+
+        pos += 8;
+        c += 8 * 64;
+    }
+}
+
+/* Computes n_groups * 16 blocks */
+__attribute__((target("avx512f"))) static void chacha8_get_keystream_avx512(
+    const struct chacha8_ctx *x,
+    uint64_t pos,
+    uint32_t n_groups,
+    uint8_t *c)
+{
+    __m512i j[16], v[16], u[16], t0, t1, t2, t3, s0, s1, s2, s3;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        j[i] = _mm512_set1_epi32((int)x->input[i]);
+    }
+
+    while (n_groups--) {
+        const __m512i lo_base = _mm512_set1_epi32((int)(uint32_t)pos);
+        const __m512i hi_base = _mm512_set1_epi32((int)(uint32_t)(pos >> 32));
+        j[12] = _mm512_add_epi32(
+            lo_base, _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+        j[13] = _mm512_mask_add_epi32(
+            hi_base, _mm512_cmplt_epu32_mask(j[12], lo_base), hi_base, _mm512_set1_epi32(1));
+
+        for (i = 0; i < 16; i++) {
+            v[i] = j[i];
+        }
+        SIMD_ROUNDS(_mm512_add_epi32, _mm512_xor_si512, _mm512_rol_epi32, v)
+        for (i = 0; i < 16; i++) {
+            v[i] = _mm512_add_epi32(v[i], j[i]);
+        }
+
+        SIMD_TRANSPOSE4(
+            _mm512_unpacklo_epi32,
+            _mm512_unpackhi_epi32,
+            _mm512_unpacklo_epi64,
+            _mm512_unpackhi_epi64,
+            v,
+            u)
+        for (i = 0; i < 4; i++) {
+            /* 4x4 transpose of the 128-bit lanes of u[i], u[4 + i], u[8 + i], u[12 + i] */
+            s0 = _mm512_shuffle_i32x4(u[i], u[4 + i], 0x44);
+            s1 = _mm512_shuffle_i32x4(u[i], u[4 + i], 0xee);
+            s2 = _mm512_shuffle_i32x4(u[8 + i], u[12 + i], 0x44);
+            s3 = _mm512_shuffle_i32x4(u[8 + i], u[12 + i], 0xee);
+            _mm512_storeu_si512(c + i * 64, _mm512_shuffle_i32x4(s0, s2, 0x88));
+            _mm512_storeu_si512(c + (4 + i) * 64, _mm512_shuffle_i32x4(s0, s2, 0xdd));
+            _mm512_storeu_si512(c + (8 + i) * 64, _mm512_shuffle_i32x4(s1, s3, 0x88));
+            _mm512_storeu_si512(c + (12 + i) * 64, _mm512_shuffle_i32x4(s1, s3, 0xdd));
+        }
+
+        pos += 16;
+        c += 16 * 64;
+    }
+}
+
+/*
+ * 0: not checked yet, 1: SSE2 only, 2: AVX2, 3: AVX-512. Threads that race
+ * to check it first all detect and store the same level.
+ */
+static atomic_int chacha8_simd_level = 0;
+
+static int chacha8_get_simd_level(void)
+{
+    int level = atomic_load_explicit(&chacha8_simd_level, memory_order_relaxed);
+    if (level == 0) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            level = 3;
+        } else if (__builtin_cpu_supports("avx2")) {
+            level = 2;
+        } else {
+            level = 1;
+        }
+        atomic_store_explicit(&chacha8_simd_level, level, memory_order_relaxed);
+    }
+    return level;
+}
+
+#endif /* CHACHA8_X86_SIMD */
+
+void chacha8_get_keystream(const struct chacha8_ctx *x, uint64_t pos, uint32_t n_blocks, uint8_t *c)
+{
+#if defined(CHACHA8_X86_SIMD)
+    int const level = chacha8_get_simd_level();
+    if (level >= 3 && n_blocks >= 16) {
+        chacha8_get_keystream_avx512(x, pos, n_blocks / 16, c);
+        pos += n_blocks & ~15U;
+        c += (uint64_t)(n_blocks & ~15U) * 64;
+        n_blocks &= 15;
+    }
+    if (level >= 2 && n_blocks >= 8) {
+        chacha8_get_keystream_avx2(x, pos, n_blocks / 8, c);
+        pos += n_blocks & ~7U;
+        c += (uint64_t)(n_blocks & ~7U) * 64;
+        n_blocks &= 7;
+    }
+    if (n_blocks >= 4) {
+        chacha8_get_keystream_sse2(x, pos, n_blocks / 4, c);
+        pos += n_blocks & ~3U;
+        c += (uint64_t)(n_blocks & ~3U) * 64;
+        n_blocks &= 3;
+    }
+#endif
+    chacha8_get_keystream_scalar(x, pos, n_blocks, c);
+}
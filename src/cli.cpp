@@ -86,6 +86,8 @@ int main(int argc, char *argv[]) try {
     uint8_t num_threads = 0;
     string filename = "plot.dat";
     string tempdir = ".";
+    vector<string> more_tempdirs;
+    bool balance_tempdirs = false;
     string tempdir2 = ".";
     string finaldir = ".";
     string operation = "help";
@@ -94,6 +96,13 @@ int main(int argc, char *argv[]) try {
     bool nobitfield = false;
     bool show_progress = false;
     bool parallel_read = true;
+    bool tmp_in_memory = false;
+    bool direct_io = false;
+    bool compress_tmp = false;
+    bool huge_pages = false;
+    bool spill_bitfields = false;
+    int numa_node = -1;
+    string cpus;
     uint32_t buffmegabytes = 0;
 
     options.allow_unrecognised_options().add_options()(
@@ -102,6 +111,10 @@ int main(int argc, char *argv[]) try {
                 "u, buckets", "Number of buckets", cxxopts::value<uint32_t>(num_buckets))(
             "s, stripes", "Size of stripes", cxxopts::value<uint32_t>(num_stripes))(
             "t, tempdir", "Temporary directory", cxxopts::value<string>(tempdir))(
+        "tempdirs", "More temporary directories, temp files are spread over these and tempdir",
+        cxxopts::value<vector<string>>(more_tempdirs))(
+        "balance_tempdirs", "Place more temp files in the temporary directories with more throughput",
+        cxxopts::value<bool>(balance_tempdirs))(
         "2, tempdir2", "Second Temporary directory", cxxopts::value<string>(tempdir2))(
         "d, finaldir", "Final directory", cxxopts::value<string>(finaldir))(
         "f, file", "Filename", cxxopts::value<string>(filename))(
@@ -115,6 +128,20 @@ int main(int argc, char *argv[]) try {
         cxxopts::value<bool>(show_progress))(
         "parallel_read", "Set to false to use sequential reads",
         cxxopts::value<bool>(parallel_read)->default_value("true"))(
+        "tmp_in_memory", "Keep temp files in RAM instead of the temp directories",
+        cxxopts::value<bool>(tmp_in_memory))(
+        "direct_io", "Bypass the page cache for temp files and the plot",
+        cxxopts::value<bool>(direct_io))(
+        "compress_tmp", "Encode sort buckets to write less to the temp directories",
+        cxxopts::value<bool>(compress_tmp))(
+        "huge_pages", "Use reserved huge pages for the sort memory",
+        cxxopts::value<bool>(huge_pages))(
+        "spill_bitfields", "Keep the phase 2 bitfields in the temporary directories instead of RAM",
+        cxxopts::value<bool>(spill_bitfields))(
+        "numa_node", "NUMA node to allocate the sort memory on",
+        cxxopts::value<int>(numa_node))(
+        "cpus", "CPUs to pin the plotting threads to, like 0-3,8 (default: those of numa_node)",
+        cxxopts::value<string>(cpus))(
         "help", "Print help");
 
     auto result = options.parse(argc, argv);
@@ -147,7 +174,7 @@ int main(int argc, char *argv[]) try {
         HexToBytes(memo, memo_bytes.data());
         HexToBytes(id, id_bytes.data());
 
-        DiskPlotter plotter = DiskPlotter();
+        DiskPlotter plotter = DiskPlotter(numa_node, ParseCpuList(cpus));
         uint8_t phases_flags = 0;
         if (!nobitfield) {
             phases_flags = ENABLE_BITFIELD;
@@ -155,8 +182,29 @@ int main(int argc, char *argv[]) try {
         if (show_progress) {
             phases_flags = phases_flags | SHOW_PROGRESS;
         }
+        if (tmp_in_memory) {
+            phases_flags = phases_flags | TMP_IN_MEMORY;
+        }
+        if (direct_io) {
+            phases_flags = phases_flags | DIRECT_IO;
+        }
+        if (compress_tmp) {
+            phases_flags = phases_flags | COMPRESS_TMP;
+        }
+        if (huge_pages) {
+            phases_flags = phases_flags | HUGE_PAGES;
+        }
+        if (spill_bitfields) {
+            phases_flags = phases_flags | SPILL_BITFIELDS;
+        }
+        vector<string> tempdirs{tempdir};
+        tempdirs.insert(tempdirs.end(), more_tempdirs.begin(), more_tempdirs.end());
+        TempDirs tmp_dirs(tempdirs);
+        if (balance_tempdirs) {
+            tmp_dirs.MeasureThroughput();
+        }
         plotter.CreatePlotDisk(
-                tempdir,
+                tmp_dirs,
                 tempdir2,
                 finaldir,
                 filename,
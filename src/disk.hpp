@@ -18,11 +18,27 @@
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <string>
 #include <vector>
 #include <thread>
 #include <chrono>
+#include <utility>
 #include <filesystem>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // enables disk I/O logging to disk.log
 // use tools/disk.gnuplot to generate a plot
 #define ENABLE_LOGGING 0
@@ -30,13 +46,32 @@
 using namespace std::chrono_literals; // for operator""min;
 namespace fs = std::filesystem;
 
+#include "./async_io.hpp"
 #include "./bits.hpp"
 #include "./util.hpp"
 #include "bitfield.hpp"
 
-constexpr uint64_t write_cache = 1024 * 1024;
 constexpr uint64_t read_ahead = 1024 * 1024;
 
+// Direct I/O needs buffers, file offsets and lengths aligned to the logical
+// block size of the device. This covers both 512 byte and 4 KiB sectors.
+constexpr uint64_t kDirectAlignment = 4096;
+
+struct AlignedDelete {
+    void operator()(uint8_t *p) const
+    {
+        ::operator delete[](p, std::align_val_t(kDirectAlignment));
+    }
+};
+
+// A buffer that can be used for direct I/O
+using aligned_buffer = std::unique_ptr<uint8_t[], AlignedDelete>;
+
+inline aligned_buffer AllocAligned(uint64_t const size)
+{
+    return aligned_buffer(new (std::align_val_t(kDirectAlignment)) uint8_t[size]);
+}
+
 struct Disk {
     virtual uint8_t const* Read(uint64_t begin, uint64_t length) = 0;
     virtual void Write(uint64_t begin, const uint8_t *memcache, uint64_t length) = 0;
@@ -96,17 +131,208 @@ void disk_log(fs::path const& filename, op_t const op, uint64_t offset, uint64_t
 }
 #endif
 
+// Where the contents of a FileDisk are kept
+enum class disk_mode_t : uint8_t
+{
+    // In a file, accessed through stdio
+    file,
+    // In anonymous memory, for temp files when there is enough RAM to hold them
+    memory,
+    // In a file, accessed with O_DIRECT so it doesn't go through the page cache. Where the
+    // platform or the filesystem doesn't support that, it's the same as file.
+    direct,
+};
+
+// Growable anonymous memory that stands in for a file in disk_mode_t::memory. Bytes that were
+// never written read as zero, like the holes of a sparse file. On Linux, it's mapped with
+// mmap() and grown with mremap(), so growing doesn't copy, and huge pages are requested for it.
+struct MemoryFile {
+    MemoryFile() = default;
+
+    MemoryFile(MemoryFile &&other) noexcept
+        : data_(other.data_), size_(other.size_), capacity_(other.capacity_)
+    {
+        other.data_ = nullptr;
+        other.size_ = 0;
+        other.capacity_ = 0;
+    }
+
+    MemoryFile(const MemoryFile &) = delete;
+    MemoryFile &operator=(const MemoryFile &) = delete;
+
+    ~MemoryFile() { Free(); }
+
+    void Read(uint64_t begin, uint8_t *memcache, uint64_t length) const
+    {
+        if (begin + length > size_) {
+            throw InvalidStateException(
+                "Read of " + std::to_string(length) + " bytes at offset " + std::to_string(begin) +
+                " past the end of memory file of " + std::to_string(size_) + " bytes");
+        }
+        ::memcpy(memcache, data_ + begin, length);
+    }
+
+    void Write(uint64_t begin, const uint8_t *memcache, uint64_t length)
+    {
+        Resize(std::max(size_, begin + length));
+        ::memcpy(data_ + begin, memcache, length);
+    }
+
+    // Shrinks or grows the file, growing with zeros
+    void Resize(uint64_t new_size)
+    {
+        if (new_size < size_) {
+            if (new_size == 0) {
+                Free();
+                return;
+            }
+            if (RoundCapacity(new_size) < capacity_) {
+                Reallocate(RoundCapacity(new_size));
+            }
+            // Bytes past the end have to read as zero if the file grows again.
+            // Those past the capacity are gone already, and come back as zeros.
+            ::memset(data_ + new_size, 0, std::min(size_, capacity_) - new_size);
+        } else if (new_size > capacity_) {
+            Reallocate(RoundCapacity(std::max(new_size, capacity_ + capacity_ / 2)));
+        }
+        size_ = new_size;
+    }
+
+    uint64_t Size() const { return size_; }
+
+    // Frees the memory of the whole pages in [begin, end), which read as
+    // zero from then on. Elsewhere than on Linux, it's kept.
+    void Discard(uint64_t const begin, uint64_t end)
+    {
+#ifdef __linux__
+        uint64_t const page = 4096;
+        end = std::min(end, size_);
+        uint64_t const first = (begin + page - 1) / page * page;
+        uint64_t const last = end / page * page;
+        if (data_ == nullptr || last <= first) return;
+        ::madvise(data_ + first, last - first, MADV_DONTNEED);
+#endif
+    }
+
+    void Free()
+    {
+        if (data_ == nullptr) return;
+#ifdef __linux__
+        ::munmap(data_, capacity_);
+#else
+        ::free(data_);
+#endif
+        data_ = nullptr;
+        size_ = 0;
+        capacity_ = 0;
+    }
+
+private:
+    // Capacities are multiples of the huge page size
+    static uint64_t RoundCapacity(uint64_t size)
+    {
+        uint64_t const granularity = 2 * 1024 * 1024;
+        return (size + granularity - 1) / granularity * granularity;
+    }
+
+    // Moves the contents to a block of new_capacity bytes, the part past size_ being zero
+    void Reallocate(uint64_t new_capacity)
+    {
+        void *p;
+#ifdef __linux__
+        if (data_ == nullptr) {
+            p = ::mmap(
+                nullptr, new_capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        } else {
+            p = ::mremap(data_, capacity_, new_capacity, MREMAP_MAYMOVE);
+        }
+        if (p == MAP_FAILED) p = nullptr;
+#ifdef MADV_HUGEPAGE
+        if (p != nullptr) ::madvise(p, new_capacity, MADV_HUGEPAGE);
+#endif
+#else
+        p = ::realloc(data_, new_capacity);
+        if (p != nullptr && new_capacity > capacity_) {
+            ::memset(static_cast<uint8_t *>(p) + capacity_, 0, new_capacity - capacity_);
+        }
+#endif
+        if (p == nullptr) {
+            throw InsufficientMemoryException(
+                "Could not allocate " + std::to_string(new_capacity) +
+                " bytes of memory for temp file");
+        }
+        data_ = static_cast<uint8_t *>(p);
+        capacity_ = new_capacity;
+    }
+
+    uint8_t *data_ = nullptr;
+    uint64_t size_ = 0;
+    uint64_t capacity_ = 0;
+};
+
+constexpr uint64_t kMaxBufferSize = 64 * 1024 * 1024;
+
+// The size of BufferedDisk buffers for files in directory. It's read_ahead,
+// except on RAID arrays, where a buffer holds several full stripes. The
+// device is looked up in sysfs on Linux.
+inline uint64_t DeviceBufferSize(fs::path const &directory)
+{
+#ifdef __linux__
+    struct stat st;
+    if (::stat(directory.empty() ? "." : directory.c_str(), &st) != 0) return read_ahead;
+
+    static std::mutex m;
+    static std::map<dev_t, uint64_t> sizes;
+    std::lock_guard<std::mutex> l(m);
+    auto const it = sizes.find(st.st_dev);
+    if (it != sizes.end()) return it->second;
+
+    // This is the whole device, or a partition of the one in ".."
+    fs::path const device = fs::path("/sys/dev/block") /
+        (std::to_string(major(st.st_dev)) + ":" + std::to_string(minor(st.st_dev)));
+    auto const queue_value = [&](char const *name) -> uint64_t {
+        for (auto const &queue : {device / "queue", device / ".." / "queue"}) {
+            std::ifstream f(queue / name);
+            uint64_t value;
+            if (f >> value) return value;
+        }
+        return 0;
+    };
+
+    uint64_t size = read_ahead;
+    uint64_t const optimal_io_size = queue_value("optimal_io_size");
+    size = std::max(size, std::min(4 * optimal_io_size, kMaxBufferSize));
+    size = (size + kDirectAlignment - 1) / kDirectAlignment * kDirectAlignment;
+    sizes.emplace(st.st_dev, size);
+    return size;
+#else
+    return read_ahead;
+#endif
+}
+
 struct FileDisk {
-    explicit FileDisk(const fs::path &filename)
+    explicit FileDisk(const fs::path &filename, disk_mode_t mode = disk_mode_t::file)
     {
         filename_ = filename;
-        Open(writeFlag);
+        mode_ = mode;
+#ifdef _WIN32
+        if (mode_ == disk_mode_t::direct) mode_ = disk_mode_t::file;
+#endif
+        if (mode_ != disk_mode_t::memory) {
+            Open(writeFlag);
+        }
     }
 
     void Open(uint8_t flags = 0)
     {
         // if the file is already open, don't do anything
-        if (f_) return;
+        if (f_ || mode_ == disk_mode_t::memory) return;
+#ifndef _WIN32
+        if (mode_ == disk_mode_t::direct) {
+            OpenDirect(flags);
+            return;
+        }
+#endif
 
         // Opens the file for reading and writing
         do {
@@ -114,6 +340,11 @@ struct FileDisk {
             f_ = ::_wfopen(filename_.c_str(), (flags & writeFlag) ? L"w+b" : L"r+b");
 #else
             f_ = ::fopen(filename_.c_str(), (flags & writeFlag) ? "w+b" : "r+b");
+#endif
+#ifndef _WIN32
+            // Background reads and writes go straight to the file
+            // descriptor, so stdio must not keep a copy of the file around
+            if (f_ != nullptr && async_) ::setvbuf(f_, nullptr, _IONBF, 0);
 #endif
             if (f_ == nullptr) {
                 std::string error_message =
@@ -129,8 +360,19 @@ struct FileDisk {
     }
 
     FileDisk(FileDisk &&fd)
+        : memory_(std::move(fd.memory_))
+        , pending_(std::move(fd.pending_))
+        , fd_(std::exchange(fd.fd_, -1))
+        , direct_buffer_(std::move(fd.direct_buffer_))
+        , direct_buffer_start_(fd.direct_buffer_start_)
+        , direct_buffer_size_(std::exchange(fd.direct_buffer_size_, 0))
+        , direct_file_size_(fd.direct_file_size_)
+        , bounce_buffer_(std::move(fd.bounce_buffer_))
+        , buffer_size_(fd.buffer_size_)
     {
         filename_ = std::move(fd.filename_);
+        mode_ = fd.mode_;
+        async_ = fd.async_;
         f_ = fd.f_;
         fd.f_ = nullptr;
     }
@@ -140,7 +382,24 @@ struct FileDisk {
 
     void Close()
     {
+#ifndef _WIN32
+        if (fd_ != -1) {
+            WaitForAll();
+            FlushDirect();
+            // Whole blocks are written, drop what was written past the end
+            if (::ftruncate(fd_, direct_file_size_) != 0) {
+                std::cout << "Could not truncate " << filename_ << ": " << ::strerror(errno)
+                          << std::endl;
+            }
+            ::close(fd_);
+            fd_ = -1;
+            direct_buffer_.reset();
+            bounce_buffer_.reset();
+            return;
+        }
+#endif
         if (f_ == nullptr) return;
+        WaitForAll();
         ::fclose(f_);
         f_ = nullptr;
         readPos = 0;
@@ -149,11 +408,41 @@ struct FileDisk {
 
     ~FileDisk() { Close(); }
 
+    // Closes and deletes the file, or frees its memory
+    void Remove()
+    {
+        Close();
+        memory_.Free();
+        fs::remove(filename_);
+    }
+
     void Read(uint64_t begin, uint8_t *memcache, uint64_t length)
     {
+        if (mode_ == disk_mode_t::memory) {
+            memory_.Read(begin, memcache, length);
+            return;
+        }
         Open(retryOpenFlag);
+        WaitForAll();
+#ifndef _WIN32
+        if (async_ && length >= 2 * kAsyncChunk) {
+            // Large reads are split up, to keep several requests in flight
+            for (uint64_t offset = 0; offset < length; offset += kAsyncChunk) {
+                ReadAsync(
+                    begin + offset, memcache + offset, std::min(kAsyncChunk, length - offset));
+            }
+            WaitForAll();
+            return;
+        }
+#endif
 #if ENABLE_LOGGING
         disk_log(filename_, op_t::read, begin, length);
+#endif
+#ifndef _WIN32
+        if (mode_ == disk_mode_t::direct) {
+            ReadDirect(begin, memcache, length);
+            return;
+        }
 #endif
         // Seek, read, and replace into memcache
         uint64_t amtread;
@@ -186,9 +475,21 @@ struct FileDisk {
 
     void Write(uint64_t begin, const uint8_t *memcache, uint64_t length)
     {
+        if (mode_ == disk_mode_t::memory) {
+            memory_.Write(begin, memcache, length);
+            writeMax = std::max(writeMax, begin + length);
+            return;
+        }
         Open(writeFlag | retryOpenFlag);
+        WaitForAll();
 #if ENABLE_LOGGING
         disk_log(filename_, op_t::write, begin, length);
+#endif
+#ifndef _WIN32
+        if (mode_ == disk_mode_t::direct) {
+            WriteDirect(begin, memcache, length);
+            return;
+        }
 #endif
         // Seek and write from memcache
         uint64_t amtwritten;
@@ -232,18 +533,353 @@ struct FileDisk {
         } while (amtwritten != length);
     }
 
+    // Starts reading into memcache in the background. It must not be touched
+    // until WaitFor() returns for the returned ticket. Any Read(), Write()
+    // or Close() waits for all of them first.
+    uint64_t ReadAsync(uint64_t begin, uint8_t *memcache, uint64_t length)
+    {
+#ifndef _WIN32
+        if (mode_ == disk_mode_t::direct) Open(retryOpenFlag);
+        if (mode_ == disk_mode_t::direct) {
+            uint64_t const aligned_length = length / kDirectAlignment * kDirectAlignment;
+            if (!DirectAligned(begin, memcache) || aligned_length == 0) {
+                Read(begin, memcache, length);
+                return 0;
+            }
+            // The end of the last block is read right away
+            if (aligned_length < length) {
+                Read(begin + aligned_length, memcache + aligned_length, length - aligned_length);
+            }
+            FlushDirect();
+#if ENABLE_LOGGING
+            disk_log(filename_, op_t::read, begin, aligned_length);
+#endif
+            uint64_t const ticket = AsyncIO::Instance().Read(fd_, begin, memcache, aligned_length);
+            pending_.push_back({ticket, false, begin, memcache, aligned_length});
+            return ticket;
+        }
+        if (mode_ == disk_mode_t::file) {
+            NeedAsync(retryOpenFlag);
+#if ENABLE_LOGGING
+            disk_log(filename_, op_t::read, begin, length);
+#endif
+            uint64_t const ticket = AsyncIO::Instance().Read(::fileno(f_), begin, memcache, length);
+            pending_.push_back({ticket, false, begin, memcache, length});
+            return ticket;
+        }
+#endif
+        Read(begin, memcache, length);
+        return 0;
+    }
+
+    // Starts writing memcache in the background. It must stay valid, and
+    // unchanged, until WaitFor() returns for the returned ticket
+    uint64_t WriteAsync(uint64_t begin, const uint8_t *memcache, uint64_t length)
+    {
+#ifndef _WIN32
+        if (mode_ == disk_mode_t::direct) Open(writeFlag | retryOpenFlag);
+        if (mode_ == disk_mode_t::direct) {
+            uint64_t const aligned_length = length / kDirectAlignment * kDirectAlignment;
+            if (!DirectAligned(begin, memcache) || aligned_length == 0) {
+                Write(begin, memcache, length);
+                return 0;
+            }
+            // The end of the last block goes to the direct buffer
+            if (aligned_length < length) {
+                Write(begin + aligned_length, memcache + aligned_length, length - aligned_length);
+            }
+            FlushDirect();
+#if ENABLE_LOGGING
+            disk_log(filename_, op_t::write, begin, aligned_length);
+#endif
+            uint64_t const ticket =
+                AsyncIO::Instance().Write(fd_, begin, memcache, aligned_length);
+            pending_.push_back(
+                {ticket, true, begin, const_cast<uint8_t *>(memcache), aligned_length});
+            writeMax = std::max(writeMax, begin + length);
+            direct_file_size_ = std::max(direct_file_size_, begin + length);
+            return ticket;
+        }
+        if (mode_ == disk_mode_t::file) {
+            NeedAsync(writeFlag | retryOpenFlag);
+#if ENABLE_LOGGING
+            disk_log(filename_, op_t::write, begin, length);
+#endif
+            uint64_t const ticket =
+                AsyncIO::Instance().Write(::fileno(f_), begin, memcache, length);
+            pending_.push_back({ticket, true, begin, const_cast<uint8_t *>(memcache), length});
+            writeMax = std::max(writeMax, begin + length);
+            return ticket;
+        }
+#endif
+        Write(begin, memcache, length);
+        return 0;
+    }
+
+    // Waits for a ReadAsync() or WriteAsync() to complete. A request that
+    // failed is redone synchronously, retrying like Read() and Write() do.
+    void WaitFor(uint64_t ticket)
+    {
+#ifndef _WIN32
+        auto const it = std::find_if(pending_.begin(), pending_.end(),
+            [ticket](pending_t const& p) { return p.ticket == ticket; });
+        // The request may have been waited for by WaitForAll() already
+        if (it == pending_.end()) return;
+        pending_t const p = *it;
+        pending_.erase(it);
+
+        int const error = AsyncIO::Instance().Wait(ticket);
+        if (error == 0) return;
+        std::cout << "Background " << (p.write ? "write" : "read") << " of " << p.length
+                  << " bytes at offset " << p.begin << (p.write ? " to " : " from ") << filename_
+                  << " failed: " << ::strerror(error) << ". Retrying." << std::endl;
+        if (p.write) {
+            Write(p.begin, p.memcache, p.length);
+        } else {
+            Read(p.begin, p.memcache, p.length);
+        }
+#endif
+    }
+
+    void WaitForAll()
+    {
+        while (!pending_.empty()) WaitFor(pending_.front().ticket);
+    }
+
     std::string GetFileName() { return filename_.string(); }
 
     uint64_t GetWriteMax() const noexcept { return writeMax; }
 
     void Truncate(uint64_t new_size)
     {
+        if (mode_ == disk_mode_t::memory) {
+            memory_.Resize(new_size);
+            return;
+        }
         Close();
         fs::resize_file(filename_, new_size);
     }
 
+    // Frees the space of [begin, end) of the file, which isn't read again.
+    // It reads as zeros from then on, and the size of the file stays the
+    // same. Requests in the background must not use that range. Only Linux
+    // supports this for files, elsewhere the space is kept until Truncate().
+    void Discard(uint64_t const begin, uint64_t const end)
+    {
+        if (end <= begin) return;
+        if (mode_ == disk_mode_t::memory) {
+            memory_.Discard(begin, end);
+            return;
+        }
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+        Open(retryOpenFlag);
+        int fd;
+        if (mode_ == disk_mode_t::direct) {
+            FlushDirect();
+            fd = fd_;
+        } else {
+            ::fflush(f_);
+            fd = ::fileno(f_);
+        }
+        // Filesystems that can't punch holes keep the space until Truncate()
+        ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin, end - begin);
+#endif
+    }
+
+    disk_mode_t Mode() const { return mode_; }
+
+    // The size of buffers for this file, see DeviceBufferSize()
+    uint64_t BufferSize()
+    {
+        if (mode_ == disk_mode_t::memory) return read_ahead;
+        if (buffer_size_ == 0) buffer_size_ = DeviceBufferSize(filename_.parent_path());
+        return buffer_size_;
+    }
+
 private:
 
+    // Files are accessed through buffered stdio until they are first used
+    // in the background. From then on stdio is unbuffered, so it doesn't go
+    // stale, which costs a syscall for every small Read() and Write().
+    void NeedAsync(uint8_t flags)
+    {
+        if (!async_) {
+            async_ = true;
+            if (f_ != nullptr) {
+                // reopen without truncating it
+                Close();
+                Open(retryOpenFlag);
+            }
+        }
+        Open(flags);
+    }
+
+#ifndef _WIN32
+    static bool DirectAligned(uint64_t const offset, const uint8_t *memory)
+    {
+        return offset % kDirectAlignment == 0 &&
+               reinterpret_cast<uintptr_t>(memory) % kDirectAlignment == 0;
+    }
+
+    static uint64_t RoundUpToBlock(uint64_t const size)
+    {
+        return (size + kDirectAlignment - 1) / kDirectAlignment * kDirectAlignment;
+    }
+
+    void OpenDirect(uint8_t const flags)
+    {
+        if (fd_ != -1) return;
+        int open_flags = O_RDWR | O_CREAT | ((flags & writeFlag) ? O_TRUNC : 0);
+#ifdef O_DIRECT
+        open_flags |= O_DIRECT;
+#endif
+        do {
+            fd_ = ::open(filename_.c_str(), open_flags, 0644);
+            if (fd_ == -1 && errno == EINVAL) {
+                // The filesystem doesn't support direct I/O, tmpfs for example
+                std::cout << "Direct I/O is not supported for " << filename_
+                          << ", using buffered I/O" << std::endl;
+                mode_ = disk_mode_t::file;
+                Open(flags);
+                return;
+            }
+            if (fd_ == -1) {
+                std::string error_message =
+                    "Could not open " + filename_.string() + ": " + ::strerror(errno) + ".";
+                if (flags & retryOpenFlag) {
+                    std::cout << error_message << " Retrying in five minutes." << std::endl;
+                    std::this_thread::sleep_for(5min);
+                } else {
+                    throw InvalidValueException(error_message);
+                }
+            }
+        } while (fd_ == -1);
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+        // macOS has no O_DIRECT, but it can keep the file out of the cache
+        ::fcntl(fd_, F_NOCACHE, 1);
+#endif
+        struct stat st;
+        direct_file_size_ = (::fstat(fd_, &st) == 0) ? st.st_size : 0;
+    }
+
+    // pread()s or pwrite()s length bytes. A read may end at the end of the
+    // file once required bytes are read, the rest of the buffer is zeroed.
+    void TransferDirect(
+        bool const write,
+        uint64_t const offset,
+        uint8_t *buffer,
+        uint64_t const length,
+        uint64_t const required)
+    {
+        uint64_t done = 0;
+        while (done < length) {
+            ssize_t const n = write ? ::pwrite(fd_, buffer + done, length - done, offset + done)
+                                    : ::pread(fd_, buffer + done, length - done, offset + done);
+            if (n > 0) {
+                done += n;
+                continue;
+            }
+            if (n == 0 && done >= required) {
+                ::memset(buffer + done, 0, length - done);
+                return;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            std::cout << "Only " << (write ? "wrote " : "read ") << done << " of " << length
+                      << " bytes at offset " << offset << (write ? " to " : " from ")
+                      << filename_ << " with length " << direct_file_size_ << ". Error "
+                      << (n < 0 ? ::strerror(errno) : "end of file")
+                      << ". Retrying in five minutes." << std::endl;
+            std::this_thread::sleep_for(5min);
+        }
+    }
+
+    // Parts that aren't aligned for direct I/O are read through the bounce
+    // buffer, a block at a time
+    void ReadDirect(uint64_t begin, uint8_t *memcache, uint64_t length)
+    {
+        FlushDirect();
+        while (length > 0) {
+            uint64_t n;
+            if (DirectAligned(begin, memcache) && length >= kDirectAlignment) {
+                n = length / kDirectAlignment * kDirectAlignment;
+                TransferDirect(false, begin, memcache, n, n);
+            } else {
+                if (!bounce_buffer_) bounce_buffer_ = AllocAligned(kDirectBufferSize);
+                uint64_t const start = begin / kDirectAlignment * kDirectAlignment;
+                uint64_t const end =
+                    std::min(RoundUpToBlock(begin + length), start + kDirectBufferSize);
+                n = std::min(length, end - begin);
+                TransferDirect(false, start, bounce_buffer_.get(), end - start, begin + n - start);
+                ::memcpy(memcache, bounce_buffer_.get() + (begin - start), n);
+            }
+            begin += n;
+            memcache += n;
+            length -= n;
+        }
+    }
+
+    // Writes that aren't aligned for direct I/O are collected in the direct
+    // buffer, which is written once it's full or the file is used otherwise.
+    // Sequential small writes only write whole blocks this way.
+    void WriteDirect(uint64_t begin, const uint8_t *memcache, uint64_t length)
+    {
+        writeMax = std::max(writeMax, begin + length);
+        direct_file_size_ = std::max(direct_file_size_, begin + length);
+        while (length > 0) {
+            if (direct_buffer_size_ == 0 || begin != direct_buffer_start_ + direct_buffer_size_) {
+                FlushDirect();
+                if (DirectAligned(begin, memcache) && length >= kDirectAlignment) {
+                    uint64_t const n = length / kDirectAlignment * kDirectAlignment;
+                    TransferDirect(true, begin, const_cast<uint8_t *>(memcache), n, n);
+                    begin += n;
+                    memcache += n;
+                    length -= n;
+                    continue;
+                }
+                if (!direct_buffer_) direct_buffer_ = AllocAligned(kDirectBufferSize);
+                // The buffer starts at a block boundary, with what the file
+                // has before begin
+                direct_buffer_start_ = begin / kDirectAlignment * kDirectAlignment;
+                direct_buffer_size_ = begin - direct_buffer_start_;
+                if (direct_buffer_size_ > 0) {
+                    TransferDirect(
+                        false, direct_buffer_start_, direct_buffer_.get(), kDirectAlignment, 0);
+                }
+            }
+            uint64_t const n = std::min(length, kDirectBufferSize - direct_buffer_size_);
+            ::memcpy(direct_buffer_.get() + direct_buffer_size_, memcache, n);
+            direct_buffer_size_ += n;
+            begin += n;
+            memcache += n;
+            length -= n;
+            if (direct_buffer_size_ == kDirectBufferSize) FlushDirect();
+        }
+    }
+
+    void FlushDirect()
+    {
+        if (direct_buffer_size_ == 0) return;
+        WaitForAll();
+        uint64_t const size = RoundUpToBlock(direct_buffer_size_);
+        uint64_t const last_block = size - kDirectAlignment;
+        if (size > direct_buffer_size_) {
+            // The rest of the last block keeps what the file has there
+            if (direct_buffer_start_ + direct_buffer_size_ < direct_file_size_) {
+                if (!bounce_buffer_) bounce_buffer_ = AllocAligned(kDirectBufferSize);
+                TransferDirect(false, direct_buffer_start_ + last_block, bounce_buffer_.get(),
+                    kDirectAlignment, 0);
+                ::memcpy(direct_buffer_.get() + direct_buffer_size_,
+                    bounce_buffer_.get() + (direct_buffer_size_ - last_block),
+                    size - direct_buffer_size_);
+            } else {
+                ::memset(direct_buffer_.get() + direct_buffer_size_, 0, size - direct_buffer_size_);
+            }
+        }
+        TransferDirect(true, direct_buffer_start_, direct_buffer_.get(), size, size);
+        direct_buffer_size_ = 0;
+    }
+#endif
+
     uint64_t readPos = 0;
     uint64_t writePos = 0;
     uint64_t writeMax = 0;
@@ -251,24 +887,108 @@ private:
 
     fs::path filename_;
     FILE *f_ = nullptr;
+    disk_mode_t mode_ = disk_mode_t::file;
+    // The contents in disk_mode_t::memory
+    MemoryFile memory_;
+
+    struct pending_t {
+        uint64_t ticket;
+        bool write;
+        uint64_t begin;
+        uint8_t *memcache;
+        uint64_t length;
+    };
+    // Requests started with ReadAsync() and WriteAsync(), in order
+    std::vector<pending_t> pending_;
+    bool async_ = false;
+
+    // The file descriptor in disk_mode_t::direct, which doesn't use f_
+    int fd_ = -1;
+    // Unaligned writes are collected here, [direct_buffer_start_,
+    // direct_buffer_start_ + direct_buffer_size_) of the file, starting at a
+    // block boundary
+    aligned_buffer direct_buffer_;
+    uint64_t direct_buffer_start_ = 0;
+    uint64_t direct_buffer_size_ = 0;
+    // The size of the file, which may be less than what's on disk, since
+    // whole blocks are written
+    uint64_t direct_file_size_ = 0;
+    // For reads that aren't aligned
+    aligned_buffer bounce_buffer_;
+    // Set by BufferSize() the first time
+    uint64_t buffer_size_ = 0;
+
+    // Size of the requests large reads are split into
+    static constexpr uint64_t kAsyncChunk = 4 * 1024 * 1024;
+
+    // Size of the direct and bounce buffers
+    static constexpr uint64_t kDirectBufferSize = 1024 * 1024;
 
     static const uint8_t writeFlag = 0b01;
     static const uint8_t retryOpenFlag = 0b10;
 };
 
+// Reads and writes a FileDisk through a read-ahead and a write-behind buffer,
+// optimized for forward sequential access. While one read buffer is consumed,
+// the window following it is read in the background, and full write buffers
+// are written in the background while the next one is being filled. The
+// buffers, and the file ranges they are read from and written to, start on
+// block boundaries, as disk_mode_t::direct needs.
+//
+// Read windows are buffer_size bytes, and write buffers half of that, so
+// the two buffers of write-behind use as much memory as a window. With a
+// buffer_size of 0, it's FileDisk::BufferSize() of the file.
 struct BufferedDisk : Disk
 {
-    BufferedDisk(FileDisk* disk, uint64_t file_size) : disk_(disk), file_size_(file_size) {}
+    BufferedDisk(FileDisk* disk, uint64_t file_size, uint64_t buffer_size = 0)
+        : disk_(disk)
+        , file_size_(file_size)
+        , read_ahead_(buffer_size ? buffer_size : disk->BufferSize())
+        , write_buffer_capacity_(read_ahead_ / 2)
+    {
+    }
+
+    BufferedDisk(BufferedDisk&& other)
+        : disk_(other.disk_)
+        , file_size_(other.file_size_)
+        , read_ahead_(other.read_ahead_)
+        , write_buffer_capacity_(other.write_buffer_capacity_)
+        , discard_(other.discard_)
+        , discarded_(other.discarded_)
+        , read_buffer_start_(other.read_buffer_start_)
+        , read_buffer_(std::move(other.read_buffer_))
+        , read_buffer_size_(other.read_buffer_size_)
+        , prefetch_buffer_(std::move(other.prefetch_buffer_))
+        , prefetch_start_(other.prefetch_start_)
+        , prefetch_size_(other.prefetch_size_)
+        , prefetch_ticket_(other.prefetch_ticket_)
+        , prefetching_(std::exchange(other.prefetching_, false))
+        , write_buffer_start_(other.write_buffer_start_)
+        , write_buffer_(std::move(other.write_buffer_))
+        , write_buffer_size_(other.write_buffer_size_)
+        , flush_buffer_(std::move(other.flush_buffer_))
+        , write_ticket_(other.write_ticket_)
+        , flushing_(std::exchange(other.flushing_, false))
+    {
+        other.write_buffer_size_ = 0;
+    }
+
+    ~BufferedDisk()
+    {
+        // The buffers must outlive the requests using them
+        WaitForPrefetch();
+        WaitForWriteBehind();
+    }
 
     uint8_t const* Read(uint64_t begin, uint64_t length) override
     {
-        assert(length < read_ahead);
+        assert(length < read_ahead_);
         NeedReadCache();
         // all allocations need 7 bytes head-room, since
         // SliceInt64FromBytes() may overrun by 7 bytes
         if (read_buffer_start_ <= begin
             && read_buffer_start_ + read_buffer_size_ >= begin + length
-            && read_buffer_start_ + read_ahead >= begin + length + 7)
+            && read_buffer_start_ + read_ahead_ >= begin + length + 7)
         {
             // if the read is entirely inside the buffer, just return it
             return read_buffer_.get() + (begin - read_buffer_start_);
@@ -283,11 +1003,29 @@ struct BufferedDisk : Disk
             // begin == 0 won't reliably detect that case, sinec we may have
             // discarded the first entry and start at some low offset but still
             // greater than 0
-            read_buffer_start_ = begin;
-            uint64_t const amount_to_read = std::min(file_size_ - read_buffer_start_, read_ahead);
-            disk_->Read(begin, read_buffer_.get(), amount_to_read);
+            if (prefetching_) {
+                WaitForPrefetch();
+                if (prefetch_start_ <= begin
+                    && prefetch_start_ + prefetch_size_ >= begin + length
+                    && prefetch_start_ + read_ahead_ >= begin + length + 7)
+                {
+                    // the common case, the read continues into the window
+                    // we've been reading in the background
+                    std::swap(read_buffer_, prefetch_buffer_);
+                    read_buffer_start_ = prefetch_start_;
+                    read_buffer_size_ = prefetch_size_;
+                    DiscardRead();
+                    Prefetch();
+                    return read_buffer_.get() + (begin - read_buffer_start_);
+                }
+            }
+            read_buffer_start_ = begin / kDirectAlignment * kDirectAlignment;
+            uint64_t const amount_to_read = std::min(file_size_ - read_buffer_start_, read_ahead_);
+            disk_->Read(read_buffer_start_, read_buffer_.get(), amount_to_read);
             read_buffer_size_ = amount_to_read;
-            return read_buffer_.get();
+            DiscardRead();
+            Prefetch();
+            return read_buffer_.get() + (begin - read_buffer_start_);
         }
         else {
             // ideally this won't happen
@@ -310,19 +1048,40 @@ struct BufferedDisk : Disk
         }
     }
 
+    // Copies length bytes to memcache, which may be more than fit the read
+    // buffer. The reads are short enough to always be served by the window
+    // read in the background.
+    void Read(uint64_t begin, uint8_t *memcache, uint64_t length)
+    {
+        uint64_t const chunk = kReadAheadOverlap - 7;
+        while (length > 0) {
+            uint64_t const n = std::min(length, chunk);
+            ::memcpy(memcache, Read(begin, n), n);
+            begin += n;
+            memcache += n;
+            length -= n;
+        }
+    }
+
     void Write(uint64_t const begin, const uint8_t *memcache, uint64_t const length) override
     {
         NeedWriteCache();
         if (begin == write_buffer_start_ + write_buffer_size_) {
-            if (write_buffer_size_ + length <= write_cache) {
+            if (write_buffer_size_ + length > write_buffer_capacity_) {
+                WriteBehind();
+            }
+            if (write_buffer_size_ + length > write_buffer_capacity_) {
+                // the part of a block kept by WriteBehind() didn't leave room
+                WriteBehind(true);
+            }
+            if (write_buffer_size_ + length <= write_buffer_capacity_) {
                 ::memcpy(write_buffer_.get() + write_buffer_size_, memcache, length);
                 write_buffer_size_ += length;
                 return;
             }
-            FlushCache();
         }
 
-        if (write_buffer_size_ == 0 && write_cache >= length) {
+        if (write_buffer_size_ == 0 && write_buffer_capacity_ >= length) {
             write_buffer_start_ = begin;
             ::memcpy(write_buffer_.get() + write_buffer_size_, memcache, length);
             write_buffer_size_ = length;
@@ -335,6 +1094,7 @@ struct BufferedDisk : Disk
     void Truncate(uint64_t const new_size) override
     {
         FlushCache();
+        WaitForPrefetch();
         disk_->Truncate(new_size);
         file_size_ = new_size;
         FreeMemory();
@@ -345,27 +1105,46 @@ struct BufferedDisk : Disk
     void FreeMemory() override
     {
         FlushCache();
+        WaitForPrefetch();
 
         read_buffer_.reset();
+        prefetch_buffer_.reset();
         write_buffer_.reset();
+        flush_buffer_.reset();
         read_buffer_size_ = 0;
         write_buffer_size_ = 0;
     }
 
-    void FlushCache()
+    // For the last pass over the file, which must only read forward. From
+    // now on, the space of the file before the read buffer is freed as the
+    // reads move on, see FileDisk::Discard().
+    void DiscardBehind()
     {
-        if (write_buffer_size_ == 0) return;
+        discard_ = true;
+        discarded_ = 0;
+    }
 
-        disk_->Write(write_buffer_start_, write_buffer_.get(), write_buffer_size_);
-        write_buffer_size_ = 0;
+    // Writes the write buffer back, and waits until it's on the disk
+    void FlushCache()
+    {
+        WriteBehind(true);
+        WaitForWriteBehind();
     }
 
 private:
 
+    // The space behind the reads is freed in chunks of this size
+    static constexpr uint64_t kDiscardChunk = 16 * 1024 * 1024;
+
+    // The window read in the background starts this many bytes before the
+    // end of the read buffer, so a read straddling the end of the buffer
+    // is served by the next one
+    static constexpr uint64_t kReadAheadOverlap = 4096;
+
     void NeedReadCache()
     {
         if (read_buffer_) return;
-        read_buffer_.reset(new uint8_t[read_ahead]);
+        read_buffer_ = AllocAligned(read_ahead_);
         read_buffer_start_ = -1;
         read_buffer_size_ = 0;
     }
@@ -373,25 +1152,252 @@ private:
     void NeedWriteCache()
     {
         if (write_buffer_) return;
-        write_buffer_.reset(new uint8_t[write_cache]);
+        write_buffer_ = AllocAligned(write_buffer_capacity_);
         write_buffer_start_ = -1;
         write_buffer_size_ = 0;
     }
 
+    // Starts reading the window following the read buffer in the background
+    void Prefetch()
+    {
+        if (read_buffer_size_ <= kReadAheadOverlap) return;
+        uint64_t const start = read_buffer_start_ + read_buffer_size_ - kReadAheadOverlap;
+        if (start + kReadAheadOverlap >= file_size_) return;
+
+        if (!prefetch_buffer_) prefetch_buffer_ = AllocAligned(read_ahead_);
+        prefetch_start_ = start;
+        prefetch_size_ = std::min(file_size_ - start, read_ahead_);
+        prefetch_ticket_ = disk_->ReadAsync(start, prefetch_buffer_.get(), prefetch_size_);
+        prefetching_ = true;
+    }
+
+    void DiscardRead()
+    {
+        if (!discard_) return;
+        uint64_t const end = read_buffer_start_ / kDiscardChunk * kDiscardChunk;
+        if (end <= discarded_) return;
+        disk_->Discard(discarded_, end);
+        discarded_ = end;
+    }
+
+    void WaitForPrefetch()
+    {
+        if (!prefetching_) return;
+        disk_->WaitFor(prefetch_ticket_);
+        prefetching_ = false;
+    }
+
+    // Starts writing the write buffer back in the background, and continues
+    // with the other buffer once its previous write has completed. Unless
+    // all is set, the write ends at a block boundary and the rest of the
+    // last block stays in the buffer, so the next write starts on one too.
+    void WriteBehind(bool const all = false)
+    {
+        if (write_buffer_size_ == 0) return;
+        uint64_t const end = write_buffer_start_ + write_buffer_size_;
+        uint64_t const write_end = all ? end : end / kDirectAlignment * kDirectAlignment;
+        if (write_end <= write_buffer_start_) return;
+        uint64_t const write_size = write_end - write_buffer_start_;
+
+        WaitForWriteBehind();
+        if (!flush_buffer_) flush_buffer_ = AllocAligned(write_buffer_capacity_);
+        std::swap(write_buffer_, flush_buffer_);
+        ::memcpy(write_buffer_.get(), flush_buffer_.get() + write_size, end - write_end);
+        write_ticket_ = disk_->WriteAsync(write_buffer_start_, flush_buffer_.get(), write_size);
+        flushing_ = true;
+        write_buffer_start_ = write_end;
+        write_buffer_size_ = end - write_end;
+    }
+
+    void WaitForWriteBehind()
+    {
+        if (!flushing_) return;
+        disk_->WaitFor(write_ticket_);
+        flushing_ = false;
+    }
+
     FileDisk* disk_;
 
     uint64_t file_size_;
 
+    // the size of the read buffer, and of the window read in the background
+    uint64_t const read_ahead_;
+    // the size of each of the two write buffers
+    uint64_t const write_buffer_capacity_;
+
+    // set by DiscardBehind(), the file is freed up to discarded_
+    bool discard_ = false;
+    uint64_t discarded_ = 0;
+
     // the file offset the read buffer was read from
     uint64_t read_buffer_start_ = -1;
-    std::unique_ptr<uint8_t[]> read_buffer_;
+    aligned_buffer read_buffer_;
     uint64_t read_buffer_size_ = 0;
 
+    // the window being read in the background, once it's complete it
+    // becomes the read buffer
+    aligned_buffer prefetch_buffer_;
+    uint64_t prefetch_start_ = 0;
+    uint64_t prefetch_size_ = 0;
+    uint64_t prefetch_ticket_ = 0;
+    bool prefetching_ = false;
+
     // the file offset the write buffer should be written back to
     // the write buffer is *only* for contiguous and sequential writes
     uint64_t write_buffer_start_ = -1;
-    std::unique_ptr<uint8_t[]> write_buffer_;
+    aligned_buffer write_buffer_;
     uint64_t write_buffer_size_ = 0;
+
+    // the previous write buffer, while it's written in the background
+    aligned_buffer flush_buffer_;
+    uint64_t write_ticket_ = 0;
+    bool flushing_ = false;
+};
+
+// Writes a bitfield to a file, as the 64-bit words bitfield stores. Bits are
+// set in increasing order, so only a window of the words is in memory.
+struct BitfieldWriter
+{
+    BitfieldWriter(FileDisk* disk, int64_t const size)
+        : disk_(disk)
+        , num_words_((size + 63) / 64)
+        , buffer_(new uint64_t[kWindowWords]())
+    {
+    }
+
+    void set(int64_t const bit)
+    {
+        int64_t const word = bit / 64;
+        assert(word >= start_ && word < num_words_);
+        while (word >= start_ + kWindowWords) Flush();
+        uint64_t const mask = uint64_t(1) << (bit % 64);
+        uint64_t& w = buffer_[word - start_];
+        count_ += (w & mask) == 0;
+        w |= mask;
+    }
+
+    // Writes the rest of the bitfield, returns the number of bits set
+    int64_t Finish()
+    {
+        while (start_ < num_words_) Flush();
+        return count_;
+    }
+
+private:
+    static constexpr int64_t kWindowWords = 128 * 1024;
+
+    void Flush()
+    {
+        int64_t const n = std::min(kWindowWords, num_words_ - start_);
+        disk_->Write(start_ * 8, reinterpret_cast<uint8_t const*>(buffer_.get()), n * 8);
+        memset(buffer_.get(), 0, n * 8);
+        start_ += kWindowWords;
+    }
+
+    FileDisk* disk_;
+    int64_t const num_words_;
+    std::unique_ptr<uint64_t[]> buffer_;
+    // the index of the first word of the window
+    int64_t start_ = 0;
+    int64_t count_ = 0;
+};
+
+// Reads a bitfield written by BitfieldWriter, a window of words at a time.
+// Lookups are meant to move forward, a few words back are still in the
+// window. Several readers can share a file, it's removed with the last one.
+struct BitfieldReader
+{
+    BitfieldReader(std::shared_ptr<FileDisk> disk, int64_t const size)
+        : disk_(std::move(disk))
+        , num_words_((size + 63) / 64)
+        , buffer_(new uint64_t[kWindowWords])
+    {
+    }
+
+    int64_t size() const { return num_words_ * 64; }
+
+    bool get(int64_t const bit) { return (word(bit / 64) >> (bit % 64)) & 1; }
+
+    // Copies the n words starting with word first to out
+    void read_words(int64_t const first, int64_t const n, uint64_t* out)
+    {
+        for (int64_t i = 0; i < n; ++i) out[i] = word(first + i);
+    }
+
+    // The number of set bits in [start_bit, end_bit)
+    int64_t count(int64_t const start_bit, int64_t const end_bit)
+    {
+        int64_t ret = 0;
+        for (int64_t w = start_bit / 64; w * 64 < end_bit; ++w) {
+            uint64_t bits = word(w);
+            if (w == start_bit / 64) bits &= ~uint64_t(0) << (start_bit % 64);
+            if (end_bit < (w + 1) * 64) bits &= (uint64_t(1) << (end_bit % 64)) - 1;
+            ret += Util::PopCount(bits);
+        }
+        return ret;
+    }
+
+    // The number of set bits before bit. The bits looked up must not
+    // decrease.
+    int64_t rank(int64_t const bit)
+    {
+        int64_t const w = bit / 64;
+        assert(w >= rank_word_);
+        for (; rank_word_ < w; ++rank_word_) rank_count_ += Util::PopCount(word(rank_word_));
+        uint64_t const mask = (uint64_t(1) << (bit % 64)) - 1;
+        return rank_count_ + Util::PopCount(word(w) & mask);
+    }
+
+    // Like bitfield_index::lookup(), for positions in increasing order
+    std::pair<uint64_t, uint64_t> lookup(uint64_t const pos, uint64_t const offset)
+    {
+        assert(get(pos) && get(pos + offset));
+        uint64_t const pos_rank = rank(pos);
+        return {pos_rank, count(pos, pos + offset)};
+    }
+
+    // Like bitfield::find_set()
+    int64_t find_set(int64_t const start_bit, int64_t n = 0)
+    {
+        int64_t w = start_bit / 64;
+        if (w >= num_words_) return size();
+        uint64_t bits = word(w) & (~uint64_t(0) << (start_bit % 64));
+        for (;;) {
+            int64_t const set = Util::PopCount(bits);
+            if (n < set) break;
+            n -= set;
+            if (++w == num_words_) return size();
+            bits = word(w);
+        }
+        while (n-- > 0) bits &= bits - 1;
+        return w * 64 + Util::CountTrailingZeros(bits);
+    }
+
+private:
+    static constexpr int64_t kWindowWords = 128 * 1024;
+    // words before the one a window is read for, which stay available
+    static constexpr int64_t kBackWords = 64;
+
+    uint64_t word(int64_t const w)
+    {
+        assert(w < num_words_);
+        if (w < start_ || w >= start_ + window_size_) {
+            start_ = std::max(int64_t(0), w - kBackWords);
+            window_size_ = std::min(kWindowWords, num_words_ - start_);
+            disk_->Read(start_ * 8, reinterpret_cast<uint8_t*>(buffer_.get()), window_size_ * 8);
+        }
+        return buffer_[w - start_];
+    }
+
+    std::shared_ptr<FileDisk> disk_;
+    int64_t const num_words_;
+    std::unique_ptr<uint64_t[]> buffer_;
+    int64_t start_ = 0;
+    int64_t window_size_ = 0;
+
+    // rank() counts the set bits of the words before rank_word_ once
+    int64_t rank_word_ = 0;
+    int64_t rank_count_ = 0;
 };
 
 struct FilteredDisk : Disk
@@ -402,46 +1408,45 @@ struct FilteredDisk : Disk
         , entry_size_(entry_size)
     {
         assert(entry_size_ > 0);
-        while (!filter_.get(last_idx_)) {
-            last_physical_ += entry_size_;
-            ++last_idx_;
-        }
-        assert(filter_.get(last_idx_));
+        last_idx_ = FindSet(0, 0);
+        last_physical_ = last_idx_ * entry_size_;
+        assert(IsSet(last_idx_));
         assert(last_physical_ == last_idx_ * entry_size_);
     }
 
+    // The filter is read from a file as the entries are read, instead of
+    // kept in memory
+    FilteredDisk(BufferedDisk underlying, std::unique_ptr<BitfieldReader> filter, int entry_size)
+        : filter_(0)
+        , file_filter_(std::move(filter))
+        , underlying_(std::move(underlying))
+        , entry_size_(entry_size)
+    {
+        assert(entry_size_ > 0);
+        last_idx_ = FindSet(0, 0);
+        last_physical_ = last_idx_ * entry_size_;
+        assert(IsSet(last_idx_));
+    }
+
     uint8_t const* Read(uint64_t begin, uint64_t length) override
     {
         // we only support a single read-pass with no going backwards
         assert(begin >= last_logical_);
         assert((begin % entry_size_) == 0);
-        assert(filter_.get(last_idx_));
+        assert(IsSet(last_idx_));
         assert(last_physical_ == last_idx_ * entry_size_);
 
         if (begin > last_logical_) {
             // last_idx_ et.al. always points to an entry we have (i.e. the bit
-            // is set). So when we advance from there, we always take at least
-            // one step on all counters.
-            last_logical_ += entry_size_;
-            last_physical_ += entry_size_;
-            ++last_idx_;
-
-            while (begin > last_logical_)
-            {
-                if (filter_.get(last_idx_)) {
-                    last_logical_ += entry_size_;
-                }
-                last_physical_ += entry_size_;
-                ++last_idx_;
-            }
-
-            while (!filter_.get(last_idx_)) {
-                last_physical_ += entry_size_;
-                ++last_idx_;
-            }
+            // is set). Advancing n entries means finding the n-th set bit
+            // after it, which skips the dropped entries a word at a time.
+            uint64_t const steps = (begin - last_logical_) / entry_size_;
+            last_idx_ = FindSet(last_idx_ + 1, steps - 1);
+            last_physical_ = last_idx_ * entry_size_;
+            last_logical_ = begin;
         }
 
-        assert(filter_.get(last_idx_));
+        assert(IsSet(last_idx_));
         assert(last_physical_ == last_idx_ * entry_size_);
         assert(begin == last_logical_);
         return underlying_.Read(last_physical_, length);
@@ -455,19 +1460,34 @@ struct FilteredDisk : Disk
     void Truncate(uint64_t new_size) override
     {
         underlying_.Truncate(new_size);
-        if (new_size == 0) filter_.free_memory();
+        if (new_size == 0) {
+            filter_.free_memory();
+            file_filter_.reset();
+        }
     }
     std::string GetFileName() override { return underlying_.GetFileName(); }
     void FreeMemory() override
     {
         filter_.free_memory();
+        file_filter_.reset();
         underlying_.FreeMemory();
     }
 
 private:
 
-    // only entries whose bit is set should be read
+    int64_t FindSet(int64_t const start_bit, int64_t const n)
+    {
+        return file_filter_ ? file_filter_->find_set(start_bit, n) : filter_.find_set(start_bit, n);
+    }
+
+    bool IsSet(int64_t const bit)
+    {
+        return file_filter_ ? file_filter_->get(bit) : filter_.get(bit);
+    }
+
+    // only entries whose bit is set should be read, one of these is used
     bitfield filter_;
+    std::unique_ptr<BitfieldReader> file_filter_;
     BufferedDisk underlying_;
     int entry_size_;
 
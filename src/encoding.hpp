@@ -58,10 +58,11 @@ public:
         return (DT_MEMO.find(R) != DT_MEMO.end());
     }   
 
+    // Another thread may have built the table first, then ct is freed
     void CTAssign(double R, FSE_CTable *ct)
     {
         std::lock_guard<std::mutex> l(memoMutex);
-        CT_MEMO[R] = ct;
+        if (!CT_MEMO.emplace(R, ct).second) FSE_freeCTable(ct);
     }
 
     void DTAssign(double R, FSE_DTable *dt)
@@ -178,7 +179,7 @@ public:
         return ans;
     }
 
-    static size_t ANSEncodeDeltas(std::vector<unsigned char> deltas, double R, uint8_t *out)
+    static size_t ANSEncodeDeltas(std::vector<unsigned char> const &deltas, double R, uint8_t *out)
     {
         if (!tmCache.CTExists(R)) {
             std::vector<short> nCount = Encoding::CreateNormalizedCount(R);
@@ -197,7 +198,7 @@ public:
 
         FSE_CTable *ct = tmCache.CTGet(R);
         return FSE_compress_usingCTable(
-            out, deltas.size() * 8, static_cast<void *>(deltas.data()), deltas.size(), ct);
+            out, deltas.size() * 8, static_cast<void const *>(deltas.data()), deltas.size(), ct);
     }
 
     static void ANSFree(double R)
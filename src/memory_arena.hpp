@@ -0,0 +1,253 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_MEMORY_ARENA_HPP_
+#define SRC_CPP_MEMORY_ARENA_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "disk.hpp"
+#include "exceptions.hpp"
+
+// The large buffers of the plotter, like the memory SortManager sorts
+// buckets in, come from here. They are mapped with huge pages, since the
+// sorts access them randomly, and optionally bound to a NUMA node. Freed
+// buffers are kept for the next allocation of the same size, so the phases
+// reuse the memory instead of mapping and faulting it in again.
+class MemoryArena {
+public:
+    struct Release {
+        // mapped is the size of the mapping, size what it was allocated for
+        uint64_t mapped = 0;
+        uint64_t size = 0;
+        void operator()(uint8_t *p) const { MemoryArena::Instance().Free(region{p, mapped, size}); }
+    };
+
+    // Aligned for direct I/O, like aligned_buffer
+    using buffer = std::unique_ptr<uint8_t[], Release>;
+
+    // The arena is never destroyed, so buffers held by static objects can
+    // still be freed into it at exit
+    static MemoryArena &Instance()
+    {
+        static MemoryArena *arena = new MemoryArena();
+        return *arena;
+    }
+
+    // With explicit_huge_pages, buffers use the reserved 1 GiB or 2 MiB huge
+    // pages (see /proc/sys/vm/nr_hugepages), otherwise transparent huge pages.
+    // numa_node is the node to allocate on, or -1 for the default policy. Up
+    // to cache_limit bytes of freed buffers are kept for reuse.
+    void Configure(bool const explicit_huge_pages, int const numa_node, uint64_t const cache_limit)
+    {
+        if (numa_node >= kMaxNumaNodes) {
+            throw InvalidValueException("Invalid NUMA node " + std::to_string(numa_node));
+        }
+        std::lock_guard<std::mutex> l(mutex_);
+        // Kept buffers were mapped with the old settings
+        TrimLocked();
+        explicit_huge_pages_ = explicit_huge_pages;
+        numa_node_ = numa_node;
+        cache_limit_ = cache_limit;
+    }
+
+    // Back to the defaults, and unmaps all kept buffers
+    void Reset() { Configure(false, -1, 0); }
+
+    // Configures the arena until it's destroyed, which resets it, also when
+    // an exception is thrown
+    class Scope {
+    public:
+        Scope(bool const explicit_huge_pages, int const numa_node, uint64_t const cache_limit)
+        {
+            MemoryArena::Instance().Configure(explicit_huge_pages, numa_node, cache_limit);
+        }
+
+        ~Scope() { MemoryArena::Instance().Reset(); }
+
+        Scope(Scope const &) = delete;
+        Scope &operator=(Scope const &) = delete;
+    };
+
+    // The contents of the buffer are undefined, it may have been used before
+    buffer Alloc(uint64_t size)
+    {
+        size = (std::max(size, uint64_t(1)) + kDirectAlignment - 1) / kDirectAlignment *
+               kDirectAlignment;
+        std::lock_guard<std::mutex> l(mutex_);
+
+        // The smallest kept buffer that isn't much larger. Buffers are compared
+        // by the size they were allocated for, since mappings are rounded up
+        // to the page size.
+        auto best = cache_.end();
+        for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+            if (it->size >= size && it->size - size <= size / 8 &&
+                (best == cache_.end() || it->size < best->size)) {
+                best = it;
+            }
+        }
+        if (best != cache_.end()) {
+            region const r = *best;
+            cache_.erase(best);
+            cached_bytes_ -= r.mapped;
+            return buffer(r.memory, Release{r.mapped, r.size});
+        }
+
+        // Give back what's kept before mapping more, so the arena doesn't
+        // hold on to more memory than it was allowed
+        TrimLocked();
+        region const r = Map(size);
+        return buffer(r.memory, Release{r.mapped, r.size});
+    }
+
+    uint64_t CachedBytes()
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        return cached_bytes_;
+    }
+
+private:
+    static constexpr int kMaxNumaNodes = 1024;
+
+    struct region {
+        uint8_t *memory;
+        uint64_t mapped;
+        uint64_t size;
+    };
+
+    std::mutex mutex_;
+    bool explicit_huge_pages_ = false;
+    int numa_node_ = -1;
+    uint64_t cache_limit_ = 0;
+    // Freed buffers, the oldest first
+    std::vector<region> cache_;
+    uint64_t cached_bytes_ = 0;
+    bool warned_ = false;
+
+    void Free(region const r)
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        cache_.push_back(r);
+        cached_bytes_ += r.mapped;
+        while (cached_bytes_ > cache_limit_) {
+            Unmap(cache_.front());
+            cached_bytes_ -= cache_.front().mapped;
+            cache_.erase(cache_.begin());
+        }
+    }
+
+    void TrimLocked()
+    {
+        for (auto const &r : cache_) Unmap(r);
+        cache_.clear();
+        cached_bytes_ = 0;
+    }
+
+    void Warn(std::string const &message)
+    {
+        if (warned_) return;
+        std::cout << message << std::endl;
+        warned_ = true;
+    }
+
+#ifdef __linux__
+    static constexpr uint64_t kHugePageSize = 2 * 1024 * 1024;
+    static constexpr uint64_t kGiantPageSize = 1024 * 1024 * 1024;
+
+    region Map(uint64_t const size)
+    {
+        if (explicit_huge_pages_) {
+            // 1 GiB pages only for buffers that fill most of one
+            for (int const page_shift : {30, 21}) {
+                uint64_t const page = uint64_t(1) << page_shift;
+                if (page == kGiantPageSize && size < kGiantPageSize / 2) continue;
+                uint64_t const mapped = (size + page - 1) / page * page;
+                void *const p = ::mmap(
+                    nullptr,
+                    mapped,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_shift << MAP_HUGE_SHIFT),
+                    -1,
+                    0);
+                if (p != MAP_FAILED) return Bind(region{static_cast<uint8_t *>(p), mapped, size});
+            }
+            Warn("No reserved huge pages available, using transparent huge pages");
+        }
+
+        // Map an extra huge page to align the buffer to one, so it can be
+        // backed by huge pages from start to end
+        uint64_t const mapped = (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+        void *const p = ::mmap(
+            nullptr,
+            mapped + kHugePageSize,
+            PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS,
+            -1,
+            0);
+        if (p == MAP_FAILED) throw std::bad_alloc();
+        uintptr_t const start = reinterpret_cast<uintptr_t>(p);
+        uintptr_t const aligned = (start + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+        if (aligned > start) ::munmap(p, aligned - start);
+        ::munmap(
+            reinterpret_cast<void *>(aligned + mapped), start + kHugePageSize - aligned);
+        uint8_t *const memory = reinterpret_cast<uint8_t *>(aligned);
+        ::madvise(memory, mapped, MADV_HUGEPAGE);
+        return Bind(region{memory, mapped, size});
+    }
+
+    // Must happen before the memory is touched, pages stay where they were
+    // first allocated
+    region Bind(region const r)
+    {
+        if (numa_node_ < 0) return r;
+        unsigned long mask[kMaxNumaNodes / (8 * sizeof(unsigned long))] = {};
+        mask[numa_node_ / (8 * sizeof(unsigned long))] |=
+            1UL << (numa_node_ % (8 * sizeof(unsigned long)));
+        if (::syscall(SYS_mbind, r.memory, r.mapped, MPOL_BIND, mask, kMaxNumaNodes + 1, 0) != 0) {
+            Warn("Could not bind memory to NUMA node " + std::to_string(numa_node_));
+        }
+        return r;
+    }
+
+    static void Unmap(region const &r) { ::munmap(r.memory, r.mapped); }
+#else
+    region Map(uint64_t const size)
+    {
+        if (explicit_huge_pages_) Warn("Huge pages are only supported on Linux");
+        if (numa_node_ >= 0) Warn("NUMA binding is only supported on Linux");
+        return region{new (std::align_val_t(kDirectAlignment)) uint8_t[size], size, size};
+    }
+
+    static void Unmap(region const &r)
+    {
+        ::operator delete[](r.memory, std::align_val_t(kDirectAlignment));
+    }
+#endif
+};
+
+#endif  // SRC_CPP_MEMORY_ARENA_HPP_
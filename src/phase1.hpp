@@ -16,7 +16,6 @@
 #define SRC_CPP_PHASE1_HPP_
 
 #ifndef _WIN32
-#include <semaphore.h>
 #include <unistd.h>
 #endif
 
@@ -40,6 +39,7 @@
 #include "calculate_bucket.hpp"
 #include "entry_sizes.hpp"
 #include "exceptions.hpp"
+#include "phases.hpp"
 #include "pos_constants.hpp"
 #include "sort_manager.hpp"
 #include "threading.hpp"
@@ -48,10 +48,21 @@
 
 namespace fs = std::filesystem;
 
+// Output of one stripe of the left table, waiting to be committed in stripe order: the kept
+// left entries, the new right entries (with positions relative to the stripe), and how many
+// left entries the earlier stripes have to account for.
+struct StripeOutput {
+    std::unique_ptr<uint8_t[]> left_writer_buf;
+    std::unique_ptr<uint8_t[]> right_writer_buf;
+    uint64_t left_writer_count;
+    uint64_t right_writer_count;
+    uint64_t stripe_start_correction;
+    uint64_t matches;
+};
+
 struct THREADDATA {
     int index;
-    Sem::type* mine;
-    Sem::type* theirs;
+    StripeScheduler<StripeOutput>* scheduler;
     uint64_t right_entry_size_bytes;
     uint8_t k;
     uint8_t table_index;
@@ -60,7 +71,6 @@ struct THREADDATA {
     uint8_t pos_size;
     uint64_t prevtableentries;
     uint32_t compressed_entry_size_bytes;
-    std::vector<FileDisk>* ptmp_1_disks;
 };
 
 struct GlobalData {
@@ -78,13 +88,55 @@ struct GlobalData {
 
 GlobalData globals;
 
+// Matches of one pair of buckets that are waiting to be written to the right table, as a
+// structure of arrays: the positions of the L and R entries in the left table, and the
+// output of f. Like PlotEntryBucket, it keeps its capacity when cleared.
+struct PendingMatches {
+    std::vector<uint64_t> L_pos;
+    std::vector<uint64_t> R_pos;
+    std::vector<uint64_t> y;
+    std::vector<uint128_t> left_metadata;
+    std::vector<uint128_t> right_metadata;
+
+    size_t size() const { return y.size(); }
+
+    void reserve(size_t n)
+    {
+        L_pos.reserve(n);
+        R_pos.reserve(n);
+        y.reserve(n);
+        left_metadata.reserve(n);
+        right_metadata.reserve(n);
+    }
+
+    void resize(size_t n)
+    {
+        L_pos.resize(n);
+        R_pos.resize(n);
+        y.resize(n);
+        left_metadata.resize(n);
+        right_metadata.resize(n);
+    }
+
+    void clear() { resize(0); }
+};
+
+// Phase 1 is compiled for the production plot sizes with k and the index of the left table as
+// the template parameters kK and kTable, so that entry widths, shifts and masks are
+// compile-time constants. kK = 0 is the generic version, which uses the run-time values.
+template <uint8_t kK = 0, uint8_t kTable = 0>
 PlotEntry GetLeftEntry(
-    uint8_t const table_index,
+    uint8_t const runtime_table_index,
     uint8_t const* const left_buf,
-    uint8_t const k,
-    uint8_t const metadata_size,
-    uint8_t const pos_size)
+    uint8_t const runtime_k,
+    uint8_t const runtime_metadata_size,
+    uint8_t const runtime_pos_size)
 {
+    uint8_t const k = kK ? kK : runtime_k;
+    uint8_t const table_index = kK ? kTable : runtime_table_index;
+    uint8_t const metadata_size = kK ? kVectorLens[kTable + 1] * kK : runtime_metadata_size;
+    uint8_t const pos_size = kK ? kK : runtime_pos_size;
+
     PlotEntry left_entry;
     left_entry.y = 0;
     left_entry.read_posoffset = 0;
@@ -119,28 +171,111 @@ PlotEntry GetLeftEntry(
     return left_entry;
 }
 
+// Number of entries that the output buffers of a stripe can hold
+inline uint64_t StripeBufEntries(uint64_t const stripe_size)
+{
+    return 5000 + (uint64_t)((1.1) * (stripe_size));
+}
+
+// Commits the output of a stripe, once all the stripes before it have been committed. The
+// positions of its right entries are corrected by the number of left entries that the earlier
+// stripes kept, and both tables are appended to.
+void CommitStripe(
+    StripeOutput& out,
+    uint8_t const k,
+    uint8_t const table_index,
+    uint8_t const pos_size,
+    uint64_t const right_entry_size_bytes,
+    uint32_t const compressed_entry_size_bytes,
+    std::vector<FileDisk>* ptmp_1_disks)
+{
+    uint32_t const ysize = (table_index + 1 == 7) ? k : k + kExtraBits;
+    uint32_t const startbyte = ysize / 8;
+    uint32_t const endbyte = (ysize + pos_size + 7) / 8 - 1;
+    uint64_t const shiftamt = (8 - ((ysize + pos_size) % 8)) % 8;
+    uint64_t const correction = (globals.left_writer_count - out.stripe_start_correction) << shiftamt;
+
+    // Correct positions
+    for (uint32_t i = 0; i < out.right_writer_count; i++) {
+        uint64_t posaccum = 0;
+        uint8_t* entrybuf = out.right_writer_buf.get() + i * right_entry_size_bytes;
+
+        for (uint32_t j = startbyte; j <= endbyte; j++) {
+            posaccum = (posaccum << 8) | (entrybuf[j]);
+        }
+        posaccum += correction;
+        for (uint32_t j = endbyte; j >= startbyte; --j) {
+            entrybuf[j] = posaccum & 0xff;
+            posaccum = posaccum >> 8;
+        }
+    }
+    if (table_index < 6) {
+        globals.R_sort_manager->AddToCache(out.right_writer_buf.get(), out.right_writer_count);
+    } else {
+        // Writes out the right table for table 7
+        (*ptmp_1_disks)[table_index + 1].Write(
+            globals.right_writer,
+            out.right_writer_buf.get(),
+            out.right_writer_count * right_entry_size_bytes);
+    }
+    globals.right_writer += out.right_writer_count * right_entry_size_bytes;
+    globals.right_writer_count += out.right_writer_count;
+
+    (*ptmp_1_disks)[table_index].Write(
+        globals.left_writer,
+        out.left_writer_buf.get(),
+        out.left_writer_count * compressed_entry_size_bytes);
+    globals.left_writer += out.left_writer_count * compressed_entry_size_bytes;
+    globals.left_writer_count += out.left_writer_count;
+
+    globals.matches += out.matches;
+}
+
+template <uint8_t kK, uint8_t kTable>
 void* phase1_thread(THREADDATA* ptd)
 {
     uint64_t const right_entry_size_bytes = ptd->right_entry_size_bytes;
-    uint8_t const k = ptd->k;
-    uint8_t const table_index = ptd->table_index;
-    uint8_t const metadata_size = ptd->metadata_size;
-    uint32_t const entry_size_bytes = ptd->entry_size_bytes;
-    uint8_t const pos_size = ptd->pos_size;
+    uint8_t const k = kK ? kK : ptd->k;
+    uint8_t const table_index = kK ? kTable : ptd->table_index;
+    uint8_t const metadata_size = kK ? kVectorLens[kTable + 1] * kK : ptd->metadata_size;
+    uint32_t const entry_size_bytes =
+        kK ? EntrySizes::GetMaxEntrySize(kK, kTable, true) : ptd->entry_size_bytes;
+    // Positions in phase 1 are k bits
+    uint8_t const pos_size = kK ? kK : ptd->pos_size;
     uint64_t const prevtableentries = ptd->prevtableentries;
     uint32_t const compressed_entry_size_bytes = ptd->compressed_entry_size_bytes;
-    std::vector<FileDisk>* ptmp_1_disks = ptd->ptmp_1_disks;
 
-    // Streams to read and right to tables. We will have handles to two tables. We will
-    // read through the left table, compute matches, and evaluate f for matching entries,
-    // writing results to the right table.
-    uint64_t left_buf_entries = 5000 + (uint64_t)((1.1) * (globals.stripe_size));
-    uint64_t right_buf_entries = 5000 + (uint64_t)((1.1) * (globals.stripe_size));
-    std::unique_ptr<uint8_t[]> right_writer_buf(new uint8_t[right_buf_entries * right_entry_size_bytes + 7]);
-    std::unique_ptr<uint8_t[]> left_writer_buf(new uint8_t[left_buf_entries * compressed_entry_size_bytes + 7]);
+    // We will read through the left table, compute matches, and evaluate f for matching
+    // entries, writing results to the stripe's output buffers, which come from the scheduler.
+    uint64_t const left_buf_entries = StripeBufEntries(globals.stripe_size);
+    uint64_t const right_buf_entries = StripeBufEntries(globals.stripe_size);
 
     FxCalculator f(k, table_index + 1);
 
+    // We only need k instead of k + kExtraBits bits for the last table
+    uint32_t const new_y_size = table_index + 1 == 7 ? k : k + kExtraBits;
+    // Size of the metadata that the new entries carry
+    uint32_t const new_metadata_size = table_index + 1 < 7 ? kVectorLens[table_index + 2] * k : 0;
+
+    // This is a sliding window of entries, since things in bucket i can match with things in
+    // bucket i + 1. At the end of each bucket, we find matches between the two previous
+    // buckets. The buckets and pending matches are reused for all stripes, so once they have
+    // grown to the largest bucket, the loop below doesn't allocate.
+    PlotEntryBucket bucket_L;
+    PlotEntryBucket bucket_R;
+    bucket_L.reserve(kPhase1BucketCapacity);
+    bucket_R.reserve(kPhase1BucketCapacity);
+
+    // Two sets of matches to keep track of things from previous iteration and from this
+    // iteration.
+    PendingMatches current_entries_to_write;
+    PendingMatches future_entries_to_write;
+    current_entries_to_write.reserve(kPhase1BucketCapacity);
+    future_entries_to_write.reserve(kPhase1BucketCapacity);
+
+    uint16_t idx_L[10000];
+    uint16_t idx_R[10000];
+
     // Stores map of old positions to new positions (positions after dropping entries from L
     // table that did not match) Map ke
     uint16_t position_map_size = 2000;
@@ -149,13 +284,24 @@ void* phase1_thread(THREADDATA* ptd)
     std::unique_ptr<uint16_t[]> L_position_map(new uint16_t[position_map_size]);
     std::unique_ptr<uint16_t[]> R_position_map(new uint16_t[position_map_size]);
 
+    // Claims are made in stripe order. Once a stripe gets close to the end of the sort bucket
+    // in memory, the next bucket is loaded, but only after the stripes before it are done
+    // reading the current one.
+    auto start_stripe = [&](uint64_t stripe) {
+        uint64_t const left_reader = stripe * globals.stripe_size * entry_size_bytes;
+        if (globals.L_sort_manager->CloseToNewBucket(left_reader)) {
+            ptd->scheduler->WaitForStripesBefore(stripe);
+            globals.L_sort_manager->TriggerNewBucket(left_reader);
+        }
+    };
+
     // Start at left table pos = 0 and iterate through the whole table. Note that the left table
     // will already be sorted by y
-    uint64_t totalstripes = (prevtableentries + globals.stripe_size - 1) / globals.stripe_size;
-    uint64_t threadstripes = (totalstripes + globals.num_threads - 1) / globals.num_threads;
-
-    for (uint64_t stripe = 0; stripe < threadstripes; stripe++) {
-        uint64_t pos = (stripe * globals.num_threads + ptd->index) * globals.stripe_size;
+    uint64_t stripe = 0;
+    // A stripe that fails never finishes, so the other threads mustn't wait for it
+    StripeScheduler<StripeOutput>::AbortOnException const abort_on_exception(*ptd->scheduler);
+    while (std::unique_ptr<StripeOutput> out = ptd->scheduler->Claim(stripe, start_stripe)) {
+        uint64_t pos = stripe * globals.stripe_size;
         uint64_t const endpos = pos + globals.stripe_size + 1;  // one y value overlap
         uint64_t left_reader = pos * entry_size_bytes;
         uint64_t left_writer_count = 0;
@@ -164,11 +310,10 @@ void* phase1_thread(THREADDATA* ptd)
         uint64_t right_writer_count = 0;
         uint64_t matches = 0;  // Total matches
 
-        // This is a sliding window of entries, since things in bucket i can match with things in
-        // bucket
-        // i + 1. At the end of each bucket, we find matches between the two previous buckets.
-        std::vector<PlotEntry> bucket_L;
-        std::vector<PlotEntry> bucket_R;
+        bucket_L.clear();
+        bucket_R.clear();
+        current_entries_to_write.clear();
+        future_entries_to_write.clear();
 
         uint64_t bucket = 0;
         bool end_of_table = false;  // We finished all entries in the left table
@@ -181,19 +326,87 @@ void* phase1_thread(THREADDATA* ptd)
 
         bool bStripePregamePair = false;
         bool bStripeStartPair = false;
-        bool need_new_bucket = false;
-        bool first_thread = ptd->index % globals.num_threads == 0;
-        bool last_thread = ptd->index % globals.num_threads == globals.num_threads - 1;
 
         uint64_t L_position_base = 0;
         uint64_t R_position_base = 0;
         uint64_t newlpos = 0;
         uint64_t newrpos = 0;
-        std::vector<std::tuple<PlotEntry, PlotEntry, std::pair<Bits, Bits>>>
-            current_entries_to_write;
-        std::vector<std::tuple<PlotEntry, PlotEntry, std::pair<Bits, Bits>>>
-            future_entries_to_write;
-        std::vector<PlotEntry*> not_dropped;  // Pointers are stored to avoid copying entries
+
+        // Records the new position of an entry of the left table that is kept, and rewrites
+        // it with just pos and offset, to reduce working space
+        auto keep_entry = [&](const PlotEntryBucket& b, size_t i) {
+            // The new position for this entry = the total amount of thing written
+            // to L so far. Since we only write entries that are used, about 14% of
+            // entries are dropped.
+            R_position_map[b.pos[i] % position_map_size] =
+                stripe_left_writer_count - R_position_base;
+
+            if (bStripeStartPair) {
+                if (stripe_start_correction == 0xffffffffffffffff) {
+                    stripe_start_correction = stripe_left_writer_count;
+                }
+
+                if (left_writer_count >= left_buf_entries) {
+                    throw InvalidStateException("Left writer count overrun");
+                }
+                uint8_t* tmp_buf =
+                    out->left_writer_buf.get() + left_writer_count * compressed_entry_size_bytes;
+
+                left_writer_count++;
+
+                uint64_t new_left_entry;
+                if (table_index == 1)
+                    new_left_entry = b.left_metadata[i];
+                else
+                    new_left_entry = b.read_posoffset[i];
+                new_left_entry <<= 64 - (table_index == 1 ? k : pos_size + kOffsetSize);
+                Util::IntToEightBytes(tmp_buf, new_left_entry);
+            }
+            stripe_left_writer_count++;
+        };
+
+        // Maps the positions of match i, and packs the new entry into the right table
+        // buffer: y, position in the previous table, offset of the matching entry, and
+        // the new metadata which will be used to compute the next f.
+        auto write_match = [&](const PendingMatches& m,
+                               size_t i,
+                               const uint16_t* l_position_map,
+                               uint64_t l_position_base) {
+            newlpos = l_position_map[m.L_pos[i] % position_map_size] + l_position_base;
+            newrpos = R_position_map[m.R_pos[i] % position_map_size] + R_position_base;
+
+            // Offset for matching entry
+            if (newrpos - newlpos > (1U << kOffsetSize) * 97 / 100) {
+                throw InvalidStateException(
+                    "Offset too large: " + std::to_string(newrpos - newlpos));
+            }
+
+            if (right_writer_count >= right_buf_entries) {
+                throw InvalidStateException("Left writer count overrun");
+            }
+
+            if (bStripeStartPair) {
+                uint8_t* right_buf =
+                    out->right_writer_buf.get() + right_writer_count * right_entry_size_bytes;
+                memset(right_buf, 0, right_entry_size_bytes);
+                uint64_t bit = 0;
+                Util::OrBitsIntoBytes(right_buf, bit, m.y[i] >> (k + kExtraBits - new_y_size), new_y_size);
+                bit += new_y_size;
+                Util::OrBitsIntoBytes(right_buf, bit, newlpos, pos_size);
+                bit += pos_size;
+                Util::OrBitsIntoBytes(right_buf, bit, newrpos - newlpos, kOffsetSize);
+                bit += kOffsetSize;
+                if (new_metadata_size > 128) {
+                    Util::OrBits128IntoBytes(right_buf, bit, m.left_metadata[i], 128);
+                    Util::OrBits128IntoBytes(
+                        right_buf, bit + 128, m.right_metadata[i], new_metadata_size - 128);
+                } else {
+                    Util::OrBits128IntoBytes(
+                        right_buf, bit, m.left_metadata[i], new_metadata_size);
+                }
+                right_writer_count++;
+            }
+        };
 
         if (pos == 0) {
             bMatch = true;
@@ -203,20 +416,6 @@ void* phase1_thread(THREADDATA* ptd)
             stripe_start_correction = 0;
         }
 
-        Sem::Wait(ptd->theirs);
-        need_new_bucket = globals.L_sort_manager->CloseToNewBucket(left_reader);
-        if (need_new_bucket) {
-            if (!first_thread) {
-                Sem::Wait(ptd->theirs);
-            }
-            globals.L_sort_manager->TriggerNewBucket(left_reader);
-        }
-        if (!last_thread) {
-            // Do not post if we are the last thread, because first thread has already
-            // waited for us to finish when it starts
-            Sem::Post(ptd->mine);
-        }
-
         while (pos < prevtableentries + 1) {
             PlotEntry left_entry = PlotEntry();
             if (pos >= prevtableentries) {
@@ -230,7 +429,7 @@ void* phase1_thread(THREADDATA* ptd)
                 uint8_t* left_buf = globals.L_sort_manager->ReadEntry(left_reader);
                 left_reader += entry_size_bytes;
 
-                left_entry = GetLeftEntry(table_index, left_buf, k, metadata_size, pos_size);
+                left_entry = GetLeftEntry<kK, kTable>(table_index, left_buf, k, metadata_size, pos_size);
             }
 
             // This is not the pos that was read from disk,but the position of the entry we read,
@@ -258,22 +457,18 @@ void* phase1_thread(THREADDATA* ptd)
 
             // Keep reading left entries into bucket_L and R, until we run out of things
             if (y_bucket == bucket) {
-                bucket_L.emplace_back(left_entry);
+                bucket_L.push_back(left_entry);
             } else if (y_bucket == bucket + 1) {
-                bucket_R.emplace_back(left_entry);
+                bucket_R.push_back(left_entry);
             } else {
                 // cout << "matching! " << bucket << " and " << bucket + 1 << endl;
                 // This is reached when we have finished adding stuff to bucket_R and bucket_L,
                 // so now we can compare entries in both buckets to find matches. If two entries
                 // match, match, the result is written to the right table. However the writing
                 // happens in the next iteration of the loop, since we need to remap positions.
-                uint16_t idx_L[10000];
-                uint16_t idx_R[10000];
                 int32_t idx_count=0;
 
                 if (!bucket_L.empty()) {
-                    not_dropped.clear();
-
                     if (!bucket_R.empty()) {
                         // Compute all matches between the two buckets and save indeces.
                         idx_count = f.FindMatches(bucket_L, bucket_R, idx_L, idx_R);
@@ -283,35 +478,13 @@ void* phase1_thread(THREADDATA* ptd)
                         }
                         // We mark entries as used if they took part in a match.
                         for (int32_t i=0; i < idx_count; i++) {
-                            bucket_L[idx_L[i]].used = true;
+                            bucket_L.used[idx_L[i]] = true;
                             if (end_of_table) {
-                                bucket_R[idx_R[i]].used = true;
+                                bucket_R.used[idx_R[i]] = true;
                             }
                         }
                     }
 
-                    // Adds L_bucket entries that are used to not_dropped. They are used if they
-                    // either matched with something to the left (in the previous iteration), or
-                    // matched with something in bucket_R (in this iteration).
-                    for (size_t bucket_index = 0; bucket_index < bucket_L.size(); bucket_index++) {
-                        PlotEntry& L_entry = bucket_L[bucket_index];
-                        if (L_entry.used) {
-                            not_dropped.emplace_back(&bucket_L[bucket_index]);
-                        }
-                    }
-                    if (end_of_table) {
-                        // In the last two buckets, we will not get a chance to enter the next
-                        // iteration due to breaking from loop. Therefore to write the final
-                        // bucket in this iteration, we have to add the R entries to the
-                        // not_dropped list.
-                        for (size_t bucket_index = 0; bucket_index < bucket_R.size();
-                             bucket_index++) {
-                            PlotEntry& R_entry = bucket_R[bucket_index];
-                            if (R_entry.used) {
-                                not_dropped.emplace_back(&R_entry);
-                            }
-                        }
-                    }
                     // We keep maps from old positions to new positions. We only need two maps,
                     // one for L bucket and one for R bucket, and we cycle through them. Map
                     // keys are stored as positions % 2^10 for efficiency. Map values are stored
@@ -320,124 +493,62 @@ void* phase1_thread(THREADDATA* ptd)
                     L_position_base = R_position_base;
                     R_position_base = stripe_left_writer_count;
 
-                    for (PlotEntry*& entry : not_dropped) {
-                        // The new position for this entry = the total amount of thing written
-                        // to L so far. Since we only write entries in not_dropped, about 14% of
-                        // entries are dropped.
-                        R_position_map[entry->pos % position_map_size] =
-                            stripe_left_writer_count - R_position_base;
-
-                        if (bStripeStartPair) {
-                            if (stripe_start_correction == 0xffffffffffffffff) {
-                                stripe_start_correction = stripe_left_writer_count;
-                            }
-
-                            if (left_writer_count >= left_buf_entries) {
-                                throw InvalidStateException("Left writer count overrun");
+                    // Keeps the L_bucket entries that are used. They are used if they either
+                    // matched with something to the left (in the previous iteration), or
+                    // matched with something in bucket_R (in this iteration).
+                    for (size_t i = 0; i < bucket_L.size(); i++) {
+                        if (bucket_L.used[i]) {
+                            keep_entry(bucket_L, i);
+                        }
+                    }
+                    if (end_of_table) {
+                        // In the last two buckets, we will not get a chance to enter the next
+                        // iteration due to breaking from loop. Therefore to write the final
+                        // bucket in this iteration, we have to keep the used R entries too.
+                        for (size_t i = 0; i < bucket_R.size(); i++) {
+                            if (bucket_R.used[i]) {
+                                keep_entry(bucket_R, i);
                             }
-                            uint8_t* tmp_buf =
-                                left_writer_buf.get() + left_writer_count * compressed_entry_size_bytes;
-
-                            left_writer_count++;
-                            // memset(tmp_buf, 0xff, compressed_entry_size_bytes);
-
-                            // Rewrite left entry with just pos and offset, to reduce working space
-                            uint64_t new_left_entry;
-                            if (table_index == 1)
-                                new_left_entry = entry->left_metadata;
-                            else
-                                new_left_entry = entry->read_posoffset;
-                            new_left_entry <<= 64 - (table_index == 1 ? k : pos_size + kOffsetSize);
-                            Util::IntToEightBytes(tmp_buf, new_left_entry);
                         }
-                        stripe_left_writer_count++;
                     }
 
-                    // Two vectors to keep track of things from previous iteration and from this
-                    // iteration.
-                    current_entries_to_write = std::move(future_entries_to_write);
-                    future_entries_to_write.clear();
+                    std::swap(current_entries_to_write, future_entries_to_write);
+                    future_entries_to_write.resize(idx_count);
 
-                    for (int32_t i=0; i < idx_count; i++) {
-                        PlotEntry& L_entry = bucket_L[idx_L[i]];
-                        PlotEntry& R_entry = bucket_R[idx_R[i]];
+                    // Computes the output pairs (fx, new_metadata) for all matches at once
+                    f.CalculateBuckets<kK, kTable + 1>(
+                        bucket_L,
+                        bucket_R,
+                        idx_L,
+                        idx_R,
+                        idx_count,
+                        future_entries_to_write.y.data(),
+                        future_entries_to_write.left_metadata.data(),
+                        future_entries_to_write.right_metadata.data());
 
+                    for (int32_t i=0; i < idx_count; i++) {
                         if (bStripeStartPair)
                             matches++;
 
                         // Sets the R entry to used so that we don't drop in next iteration
-                        R_entry.used = true;
-                        // Computes the output pair (fx, new_metadata)
-                        if (metadata_size <= 128) {
-                            const std::pair<Bits, Bits>& f_output = f.CalculateBucket(
-                                Bits(L_entry.y, k + kExtraBits),
-                                Bits(L_entry.left_metadata, metadata_size),
-                                Bits(R_entry.left_metadata, metadata_size));
-                            future_entries_to_write.emplace_back(L_entry, R_entry, f_output);
-                        } else {
-                            // Metadata does not fit into 128 bits
-                            const std::pair<Bits, Bits>& f_output = f.CalculateBucket(
-                                Bits(L_entry.y, k + kExtraBits),
-                                Bits(L_entry.left_metadata, 128) +
-                                    Bits(L_entry.right_metadata, metadata_size - 128),
-                                Bits(R_entry.left_metadata, 128) +
-                                    Bits(R_entry.right_metadata, metadata_size - 128));
-                            future_entries_to_write.emplace_back(L_entry, R_entry, f_output);
-                        }
+                        bucket_R.used[idx_R[i]] = true;
+                        future_entries_to_write.L_pos[i] = bucket_L.pos[idx_L[i]];
+                        future_entries_to_write.R_pos[i] = bucket_R.pos[idx_R[i]];
                     }
 
                     // At this point, future_entries_to_write contains the matches of buckets L
                     // and R, and current_entries_to_write contains the matches of L and the
                     // bucket left of L. These are the ones that we will write.
-                    uint16_t final_current_entry_size = current_entries_to_write.size();
+                    for (size_t i = 0; i < current_entries_to_write.size(); i++) {
+                        write_match(
+                            current_entries_to_write, i, L_position_map.get(), L_position_base);
+                    }
                     if (end_of_table) {
                         // For the final bucket, write the future entries now as well, since we
-                        // will break from loop
-                        current_entries_to_write.insert(
-                            current_entries_to_write.end(),
-                            future_entries_to_write.begin(),
-                            future_entries_to_write.end());
-                    }
-                    for (size_t i = 0; i < current_entries_to_write.size(); i++) {
-                        const auto& [L_entry, R_entry, f_output] = current_entries_to_write[i];
-
-                        // We only need k instead of k + kExtraBits bits for the last table
-                        Bits new_entry = table_index + 1 == 7 ? std::get<0>(f_output).Slice(0, k)
-                                                              : std::get<0>(f_output);
-
-                        // Maps the new positions. If we hit end of pos, we must write things in
-                        // both final_entries to write and current_entries_to_write, which are
-                        // in both position maps.
-                        if (!end_of_table || i < final_current_entry_size) {
-                            newlpos =
-                                L_position_map[L_entry.pos % position_map_size] + L_position_base;
-                        } else {
-                            newlpos =
-                                R_position_map[L_entry.pos % position_map_size] + R_position_base;
-                        }
-                        newrpos = R_position_map[R_entry.pos % position_map_size] + R_position_base;
-                        // Position in the previous table
-                        new_entry.AppendValue(newlpos, pos_size);
-
-                        // Offset for matching entry
-                        if (newrpos - newlpos > (1U << kOffsetSize) * 97 / 100) {
-                            throw InvalidStateException(
-                                "Offset too large: " + std::to_string(newrpos - newlpos));
-                        }
-
-                        new_entry.AppendValue(newrpos - newlpos, kOffsetSize);
-                        // New metadata which will be used to compute the next f
-                        new_entry += std::get<1>(f_output);
-
-                        if (right_writer_count >= right_buf_entries) {
-                            throw InvalidStateException("Left writer count overrun");
-                        }
-
-                        if (bStripeStartPair) {
-                            uint8_t* right_buf =
-                                right_writer_buf.get() + right_writer_count * right_entry_size_bytes;
-                            new_entry.ToBytes(right_buf);
-                            right_writer_count++;
+                        // will break from loop. Their L entries are in the R position map.
+                        for (size_t i = 0; i < future_entries_to_write.size(); i++) {
+                            write_match(
+                                future_entries_to_write, i, R_position_map.get(), R_position_base);
                         }
                     }
                 }
@@ -462,16 +573,16 @@ void* phase1_thread(THREADDATA* ptd)
                 if (y_bucket == bucket + 2) {
                     // We saw a bucket that is 2 more than the current, so we just set L = R, and R
                     // = [entry]
-                    bucket_L = std::move(bucket_R);
+                    std::swap(bucket_L, bucket_R);
                     bucket_R.clear();
-                    bucket_R.emplace_back(std::move(left_entry));
+                    bucket_R.push_back(left_entry);
                     ++bucket;
                 } else {
                     // We saw a bucket that >2 more than the current, so we just set L = [entry],
                     // and R = []
                     bucket = y_bucket;
                     bucket_L.clear();
-                    bucket_L.emplace_back(std::move(left_entry));
+                    bucket_L.push_back(left_entry);
                     bucket_R.clear();
                 }
             }
@@ -479,78 +590,64 @@ void* phase1_thread(THREADDATA* ptd)
             ++pos;
         }
 
-        // If we needed new bucket, we already waited
-        // Do not wait if we are the first thread, since we are guaranteed that everything is written
-        if (!need_new_bucket && !first_thread) {
-            Sem::Wait(ptd->theirs);
-        }
-
-        uint32_t const ysize = (table_index + 1 == 7) ? k : k + kExtraBits;
-        uint32_t const startbyte = ysize / 8;
-        uint32_t const endbyte = (ysize + pos_size + 7) / 8 - 1;
-        uint64_t const shiftamt = (8 - ((ysize + pos_size) % 8)) % 8;
-        uint64_t const correction = (globals.left_writer_count - stripe_start_correction) << shiftamt;
+        out->left_writer_count = left_writer_count;
+        out->right_writer_count = right_writer_count;
+        out->stripe_start_correction = stripe_start_correction;
+        out->matches = matches;
+        ptd->scheduler->Finish(stripe, std::move(out));
+    }
 
-        // Correct positions
-        for (uint32_t i = 0; i < right_writer_count; i++) {
-            uint64_t posaccum = 0;
-            uint8_t* entrybuf = right_writer_buf.get() + i * right_entry_size_bytes;
+    return 0;
+}
 
-            for (uint32_t j = startbyte; j <= endbyte; j++) {
-                posaccum = (posaccum << 8) | (entrybuf[j]);
-            }
-            posaccum += correction;
-            for (uint32_t j = endbyte; j >= startbyte; --j) {
-                entrybuf[j] = posaccum & 0xff;
-                posaccum = posaccum >> 8;
-            }
-        }
-        if (table_index < 6) {
-            for (uint64_t i = 0; i < right_writer_count; i++) {
-                globals.R_sort_manager->AddToCache(right_writer_buf.get() + i * right_entry_size_bytes);
-            }
-        } else {
-            // Writes out the right table for table 7
-            (*ptmp_1_disks)[table_index + 1].Write(
-                globals.right_writer,
-                right_writer_buf.get(),
-                right_writer_count * right_entry_size_bytes);
+// Picks the version of phase1_thread for the left table table_index
+template <uint8_t kK>
+auto Phase1ThreadFunction(uint8_t const table_index) -> void* (*)(THREADDATA*)
+{
+    if constexpr (kK == 0) {
+        return phase1_thread<0, 0>;
+    } else {
+        switch (table_index) {
+            case 1:
+                return phase1_thread<kK, 1>;
+            case 2:
+                return phase1_thread<kK, 2>;
+            case 3:
+                return phase1_thread<kK, 3>;
+            case 4:
+                return phase1_thread<kK, 4>;
+            case 5:
+                return phase1_thread<kK, 5>;
+            default:
+                return phase1_thread<kK, 6>;
         }
-        globals.right_writer += right_writer_count * right_entry_size_bytes;
-        globals.right_writer_count += right_writer_count;
-
-        (*ptmp_1_disks)[table_index].Write(
-            globals.left_writer, left_writer_buf.get(), left_writer_count * compressed_entry_size_bytes);
-        globals.left_writer += left_writer_count * compressed_entry_size_bytes;
-        globals.left_writer_count += left_writer_count;
-
-        globals.matches += matches;
-        Sem::Post(ptd->mine);
     }
-
-    return 0;
 }
 
-void* F1thread(int const index, uint8_t const k, const uint8_t* id, std::mutex* smm)
+void* F1thread(
+    int const index,
+    uint8_t const k,
+    const uint8_t* id,
+    SortManager* sort_manager,
+    uint8_t const num_threads)
 {
-    uint32_t const entry_size_bytes = 16;
     uint64_t const max_value = ((uint64_t)1 << (k));
-    uint64_t const right_buf_entries = 1 << (kBatchSizes);
 
     std::unique_ptr<uint64_t[]> f1_entries(new uint64_t[(1U << kBatchSizes)]);
 
     F1Calculator f1(k, id);
 
-    std::unique_ptr<uint8_t[]> right_writer_buf(new uint8_t[right_buf_entries * entry_size_bytes]);
+    // Every thread stages its output per bucket, and appends whole runs to the
+    // bucket files. This way threads only contend when flushing to the same
+    // bucket, instead of on every entry.
+    BucketWriter writer(*sort_manager, kF1StagingBytes);
+    uint8_t entry_buf[16];
 
     // Instead of computing f1(1), f1(2), etc, for each x, we compute them in batches
     // to increase CPU efficency.
-    for (uint64_t lp = index; lp <= (((uint64_t)1) << (k - kBatchSizes));
-         lp = lp + globals.num_threads)
-    {
+    for (uint64_t lp = index; lp <= (((uint64_t)1) << (k - kBatchSizes)); lp = lp + num_threads) {
         // For each pair x, y in the batch
 
-        uint64_t right_writer_count = 0;
         uint64_t x = lp * (1 << (kBatchSizes));
 
         uint64_t const loopcount = std::min(max_value - x, (uint64_t)1 << (kBatchSizes));
@@ -563,41 +660,54 @@ void* F1thread(int const index, uint8_t const k, const uint8_t* id, std::mutex*
 
             entry = (uint128_t)f1_entries[i] << (128 - kExtraBits - k);
             entry |= (uint128_t)x << (128 - kExtraBits - 2 * k);
-            Util::IntTo16Bytes(&right_writer_buf[i * entry_size_bytes], entry);
-            right_writer_count++;
-            x++;
-        }
-
-        std::lock_guard<std::mutex> l(*smm);
+            Util::IntTo16Bytes(entry_buf, entry);
 
-        // Write it out
-        for (uint32_t i = 0; i < right_writer_count; i++) {
-            globals.L_sort_manager->AddToCache(&(right_writer_buf[i * entry_size_bytes]));
+            writer.Add(entry_buf);
+            x++;
         }
     }
 
+    writer.Flush();
+
     return 0;
 }
 
+// Computes F1 for all 2^k x values, on all threads of pool, and adds the
+// entries to sort_manager.
+void RunF1(SortManager* sort_manager, uint8_t const k, const uint8_t* id, ThreadPool& pool)
+{
+    uint8_t const num_threads = pool.size();
+    pool.Run(num_threads, [&](uint32_t const i) {
+        F1thread(i, k, id, sort_manager, num_threads);
+    });
+}
+
 // This is Phase 1, or forward propagation. During this phase, all of the 7 tables,
 // and f functions, are evaluated. The result is an intermediate plot file, that is
 // several times larger than what the final file will be, but that has all of the
 // proofs of space in it. First, F1 is computed, which is special since it uses
 // ChaCha8, and each encryption provides multiple output values. Then, the rest of the
-// f functions are computed, and a sort on disk happens for each table.
+// f functions are computed, and a sort on disk happens for each table. kK is the plot size
+// that the matching passes are specialized for, or 0 for the generic version.
+template <uint8_t kK = 0>
 std::vector<uint64_t> RunPhase1(
     std::vector<FileDisk>& tmp_1_disks,
     uint8_t const k,
     const uint8_t* const id,
-    std::string const tmp_dirname,
+    TempDirs const& tmp_dirs,
     std::string const filename,
     uint64_t const memory_size,
     uint32_t const num_buckets,
     uint32_t const log_num_buckets,
     uint32_t const stripe_size,
-    uint8_t const num_threads,
+    ThreadPool& pool,
     uint8_t const flags)
 {
+    uint8_t const num_threads = pool.size();
+    if (kK != 0 && k != kK) {
+        throw InvalidValueException(
+            "Phase 1 for k=" + std::to_string(kK) + " can't plot k=" + std::to_string(k));
+    }
     std::cout << "Computing table 1" << std::endl;
     std::cout << "Progress update: 0.01" << std::endl;
     globals.stripe_size = stripe_size;
@@ -612,28 +722,21 @@ std::vector<uint64_t> RunPhase1(
         num_buckets,
         log_num_buckets,
         t1_entry_size_bytes,
-        tmp_dirname,
+        tmp_dirs,
         filename + ".p1.t1",
         0,
-        globals.stripe_size);
+        globals.stripe_size,
+        strategy_t::uniform,
+        TmpDiskMode(flags),
+        num_threads,
+        TmpBucketCodec(flags),
+        &pool);
 
     // These are used for sorting on disk. The sort on disk code needs to know how
     // many elements are in each bucket.
     std::vector<uint64_t> table_sizes = std::vector<uint64_t>(8, 0);
-    std::mutex sort_manager_mutex;
 
-    {
-        // Start of parallel execution
-        std::vector<std::thread> threads;
-        for (int i = 0; i < num_threads; i++) {
-            threads.emplace_back(F1thread, i, k, id, &sort_manager_mutex);
-        }
-
-        for (auto& t : threads) {
-            t.join();
-        }
-        // end of parallel execution
-    }
+    RunF1(globals.L_sort_manager.get(), k, id, pool);
 
     uint64_t prevtableentries = 1ULL << k;
     f1_start_time.PrintElapsed("F1 complete, time:");
@@ -683,28 +786,53 @@ std::vector<uint64_t> RunPhase1(
             num_buckets,
             log_num_buckets,
             right_entry_size_bytes,
-            tmp_dirname,
+            tmp_dirs,
             filename + ".p1.t" + std::to_string(table_index + 1),
             0,
-            globals.stripe_size);
+            globals.stripe_size,
+            strategy_t::uniform,
+            TmpDiskMode(flags),
+            num_threads,
+            TmpBucketCodec(flags),
+            &pool);
 
         globals.L_sort_manager->TriggerNewBucket(0);
 
         Timer computation_pass_timer;
 
-        auto td = std::make_unique<THREADDATA[]>(num_threads);
-        auto mutex = std::make_unique<Sem::type[]>(num_threads);
-
-        std::vector<std::thread> threads;
+        // Stripes are handed out to the threads as they become free, and their output is
+        // committed in order. Each thread can be working on one stripe, while its previous
+        // ones wait in the pool of output buffers for the stripes before them.
+        uint64_t const num_stripes = (prevtableentries + globals.stripe_size - 1) / globals.stripe_size;
+        uint64_t const stripe_buf_entries = StripeBufEntries(globals.stripe_size);
+        StripeScheduler<StripeOutput> scheduler(
+            num_stripes,
+            num_threads * kPhase1StripeBuffersPerThread,
+            [&]() {
+                auto out = std::make_unique<StripeOutput>();
+                out->left_writer_buf.reset(
+                    new uint8_t[stripe_buf_entries * compressed_entry_size_bytes + 7]);
+                out->right_writer_buf.reset(
+                    new uint8_t[stripe_buf_entries * right_entry_size_bytes + 7]);
+                return out;
+            },
+            [&](StripeOutput& out) {
+                CommitStripe(
+                    out,
+                    k,
+                    table_index,
+                    pos_size,
+                    right_entry_size_bytes,
+                    compressed_entry_size_bytes,
+                    &tmp_1_disks);
+            });
 
-        for (int i = 0; i < num_threads; i++) {
-            mutex[i] = Sem::Create();
-        }
+        auto td = std::make_unique<THREADDATA[]>(num_threads);
+        auto const thread_function = Phase1ThreadFunction<kK>(table_index);
 
         for (int i = 0; i < num_threads; i++) {
             td[i].index = i;
-            td[i].mine = &mutex[i];
-            td[i].theirs = &mutex[(num_threads + i - 1) % num_threads];
+            td[i].scheduler = &scheduler;
 
             td[i].prevtableentries = prevtableentries;
             td[i].right_entry_size_bytes = right_entry_size_bytes;
@@ -714,19 +842,9 @@ std::vector<uint64_t> RunPhase1(
             td[i].entry_size_bytes = entry_size_bytes;
             td[i].pos_size = pos_size;
             td[i].compressed_entry_size_bytes = compressed_entry_size_bytes;
-            td[i].ptmp_1_disks = &tmp_1_disks;
-
-            threads.emplace_back(phase1_thread, &td[i]);
         }
-        Sem::Post(&mutex[num_threads - 1]);
 
-        for (auto& t : threads) {
-            t.join();
-        }
-
-        for (int i = 0; i < num_threads; i++) {
-            Sem::Destroy(mutex[i]);
-        }
+        pool.Run(num_threads, [&](uint32_t const i) { thread_function(&td[i]); });
 
         // end of parallel execution
 
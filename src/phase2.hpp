@@ -20,6 +20,7 @@
 #include "sort_manager.hpp"
 #include "bitfield.hpp"
 #include "bitfield_index.hpp"
+#include "phases.hpp"
 #include "progress.hpp"
 
 struct Phase2Results
@@ -34,8 +35,295 @@ struct Phase2Results
     BufferedDisk table7;
     std::vector<std::unique_ptr<SortManager>> output_files;
     std::vector<uint64_t> table_sizes;
+    // When the bitfields were spilled to disk, the positions of tables 2-6
+    // are still those before tables 1-5 were compacted. Entry i maps the
+    // positions into table i, in increasing order, for phase 3.
+    std::vector<std::unique_ptr<BitfieldReader>> position_maps;
 };
 
+// RunPhase2() with the bitfields stored in temp files instead of memory. Each
+// table is scanned once, in order, reading its bitfield alongside it. The
+// entries it references aren't marked in the next bitfield right away, which
+// would be random writes, but sorted, so the next bitfield can be written in
+// order. Positions can only be remapped in order as well, the sort by
+// position of phase 3 does it for tables 2-6. Table 7 is already sorted by
+// position, it's read a second time to remap it here.
+Phase2Results RunPhase2Spilled(
+    std::vector<FileDisk> &tmp_1_disks,
+    std::vector<uint64_t> table_sizes,
+    uint8_t const k,
+    TempDirs const &tmp_dirs,
+    const std::string &filename,
+    uint64_t memory_size,
+    uint32_t const num_buckets,
+    uint32_t const log_num_buckets,
+    ThreadPool &pool,
+    uint8_t const flags)
+{
+    uint8_t const pos_size = k;
+    uint8_t const pos_offset_size = pos_size + kOffsetSize;
+    uint8_t const write_counter_shift = 128 - k;
+    uint8_t const pos_offset_shift = write_counter_shift - pos_offset_size;
+    uint8_t const f7_shift = 128 - k;
+    uint8_t const t7_pos_offset_shift = f7_shift - pos_offset_size;
+    uint8_t const new_entry_size = EntrySizes::GetKeyPosOffsetSize(k);
+    // A mark is the position of a referenced entry, in the first k bits
+    uint8_t const mark_size = cdiv(int(k), 8);
+
+    std::vector<uint64_t> new_table_sizes(8, 0);
+    new_table_sizes[7] = table_sizes[7];
+
+    // The bitfield of each table, the file is removed when the last reader
+    // of it is gone
+    std::vector<std::shared_ptr<FileDisk>> bitfield_files(8);
+
+    std::vector<std::unique_ptr<SortManager>> output_files(7 - 2);
+
+    double progress_percent[] = {0.43, 0.48, 0.51, 0.55, 0.58, 0.61};
+    for (int table_index = 7; table_index > 1; --table_index) {
+
+        std::cout << "Backpropagating on table " << table_index << std::endl;
+        std::cout << "Progress update: " << progress_percent[7 - table_index] << std::endl;
+        Timer scan_timer;
+
+        int64_t const table_size = table_sizes[table_index];
+        int16_t const entry_size = cdiv(k + kOffsetSize + (table_index == 7 ? k : 0), 8);
+
+        BufferedDisk disk(&tmp_1_disks[table_index], table_size * entry_size);
+        // This is the only pass over tables 2-6, free them as they're read
+        if (table_index != 7) {
+            disk.DiscardBehind();
+        }
+
+        // Everything is referenced from table 7
+        std::unique_ptr<BitfieldReader> current_bitfield;
+        if (table_index != 7) {
+            current_bitfield = std::make_unique<BitfieldReader>(
+                bitfield_files[table_index], table_size);
+        }
+
+        // Batches and tasks as in RunPhase2(). Batches start at a word of the
+        // bitfield, since kPhase2TaskEntries is a multiple of 64.
+        int64_t const batch_entries = int64_t(kPhase2TaskEntries) * pool.size();
+        std::unique_ptr<uint8_t[]> batch(new uint8_t[batch_entries * entry_size + 7]);
+        std::unique_ptr<uint64_t[]> batch_bits(new uint64_t[batch_entries / 64]);
+        // The sorts read the bucket of an entry with SliceInt64FromBytes() as well
+        std::unique_ptr<uint8_t[]> new_entries(new uint8_t[batch_entries * new_entry_size + 7]);
+        std::unique_ptr<uint8_t[]> marks(new uint8_t[batch_entries * 2 * mark_size + 7]);
+        std::vector<int64_t> task_counters(cdiv(batch_entries, int64_t(kPhase2TaskEntries)) + 1);
+
+        // The marks are sorted with the half of the memory the other sort
+        // doesn't use, in buckets of at most half of that
+        uint32_t log_mark_buckets = log_num_buckets;
+        while ((uint64_t(table_size) * 2 * mark_size >> log_mark_buckets) > memory_size / 4) {
+            ++log_mark_buckets;
+        }
+        SortManager mark_sort(
+            memory_size / 2,
+            uint32_t(1) << log_mark_buckets,
+            log_mark_buckets,
+            mark_size,
+            tmp_dirs,
+            filename + ".p2.marks" + std::to_string(table_index),
+            0,
+            0,
+            strategy_t::radix,
+            TmpDiskMode(flags),
+            pool.size(),
+            TmpBucketCodec(flags),
+            &pool);
+
+        std::unique_ptr<SortManager> sort_manager;
+        if (table_index != 7) {
+            sort_manager = std::make_unique<SortManager>(
+                table_index == 2 ? memory_size : memory_size / 2,
+                num_buckets,
+                log_num_buckets,
+                new_entry_size,
+                tmp_dirs,
+                filename + ".p2.t" + std::to_string(table_index),
+                uint32_t(k),
+                0,
+                strategy_t::radix,
+                TmpDiskMode(flags),
+                pool.size(),
+                TmpBucketCodec(flags),
+                &pool);
+        }
+
+        int64_t write_counter = 0;
+        for (int64_t batch_index = 0; batch_index < table_size; batch_index += batch_entries) {
+            int64_t const batch_size = std::min(batch_entries, table_size - batch_index);
+            disk.Read(batch_index * entry_size, batch.get(), batch_size * entry_size);
+            if (current_bitfield) {
+                current_bitfield->read_words(
+                    batch_index / 64, cdiv(batch_size, int64_t(64)), batch_bits.get());
+            }
+
+            uint32_t const num_tasks = cdiv(batch_size, int64_t(kPhase2TaskEntries));
+            task_counters[0] = write_counter;
+            for (uint32_t task = 0; task < num_tasks; ++task) {
+                int64_t const begin = int64_t(task) * kPhase2TaskEntries;
+                int64_t const end = std::min(begin + kPhase2TaskEntries, batch_size);
+                // bits past the end of the table are never set
+                task_counters[task + 1] = task_counters[task] +
+                    (current_bitfield ? BitCount::Count(batch_bits.get() + begin / 64,
+                                                        cdiv(end - begin, int64_t(64)))
+                                      : end - begin);
+            }
+
+            pool.Run(num_tasks, [&](uint32_t const task) {
+                int64_t const begin = int64_t(task) * kPhase2TaskEntries;
+                int64_t const end = std::min(begin + kPhase2TaskEntries, batch_size);
+                int64_t counter = task_counters[task];
+                for (int64_t i = begin; i < end; ++i) {
+                    if (current_bitfield && !((batch_bits[i / 64] >> (i % 64)) & 1)) continue;
+                    uint8_t const* entry = batch.get() + i * entry_size;
+
+                    uint64_t const entry_pos_offset = Util::SliceInt64FromBytes(
+                        entry, table_index == 7 ? k : 0, pos_offset_size);
+                    uint64_t const entry_pos = entry_pos_offset >> kOffsetSize;
+                    uint64_t const entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
+
+                    uint8_t bytes[16];
+                    uint8_t* mark = marks.get() + (counter - write_counter) * 2 * mark_size;
+                    Util::IntToEightBytes(bytes, entry_pos << (64 - k));
+                    memcpy(mark, bytes, mark_size);
+                    Util::IntToEightBytes(bytes, (entry_pos + entry_offset) << (64 - k));
+                    memcpy(mark + mark_size, bytes, mark_size);
+
+                    if (table_index != 7) {
+                        // As in RunPhase2(), with the old position and offset
+                        uint128_t new_entry = (uint128_t)counter << write_counter_shift;
+                        new_entry |= (uint128_t)entry_pos_offset << pos_offset_shift;
+                        Util::IntTo16Bytes(bytes, new_entry);
+                        memcpy(
+                            new_entries.get() + (counter - write_counter) * new_entry_size,
+                            bytes,
+                            new_entry_size);
+                    }
+                    ++counter;
+                }
+            });
+
+            int64_t const batch_kept = task_counters[num_tasks] - write_counter;
+            mark_sort.AddToCache(marks.get(), batch_kept * 2);
+            if (sort_manager) {
+                sort_manager->AddToCache(new_entries.get(), batch_kept);
+            }
+            write_counter = task_counters[num_tasks];
+        }
+        current_bitfield.reset();
+        // the other bitfields map the positions of the next table in phase 3
+        if (table_index == 6) {
+            bitfield_files[table_index].reset();
+        }
+
+        std::cout << "scanned table " << table_index << std::endl;
+        scan_timer.PrintElapsed("scanned time = ");
+
+        if (sort_manager) {
+            sort_manager->FlushCache();
+            sort_manager->FreeMemory();
+            output_files[table_index - 2] = std::move(sort_manager);
+            new_table_sizes[table_index] = write_counter;
+            disk.FreeMemory();
+            tmp_1_disks[table_index].Truncate(0);
+        }
+
+        // The sorted marks are the next bitfield, in order
+        std::cout << "writing bitfield of table " << table_index - 1 << std::endl;
+        Timer bitfield_timer;
+        mark_sort.FlushCache();
+        fs::path const bitfield_filename =
+            tmp_dirs.Dir(table_index - 1) /
+            fs::path(filename + ".p2.bitfield" + std::to_string(table_index - 1) + ".tmp");
+        fs::remove(bitfield_filename);
+        bitfield_files[table_index - 1] = std::shared_ptr<FileDisk>(
+            new FileDisk(bitfield_filename, TmpDiskMode(flags)), [](FileDisk* f) {
+                f->Remove();
+                delete f;
+            });
+        BitfieldWriter next_bitfield(
+            bitfield_files[table_index - 1].get(), table_sizes[table_index - 1]);
+        for (int64_t i = 0; i < write_counter * 2; ++i) {
+            uint8_t bytes[8] = {};
+            memcpy(bytes, mark_sort.ReadEntry(i * mark_size), mark_size);
+            next_bitfield.set(Util::EightBytesToInt(bytes) >> (64 - k));
+        }
+        int64_t const next_size = next_bitfield.Finish();
+        if (table_index == 2) {
+            new_table_sizes[1] = next_size;
+        }
+        bitfield_timer.PrintElapsed("bitfield time = ");
+
+        if (table_index == 7) {
+            // table 7 is already sorted by pos, so we just rewrite the pos
+            // and offset in-place, as they're mapped in order
+            BitfieldReader index(bitfield_files[6], table_sizes[6]);
+            for (int64_t batch_index = 0; batch_index < table_size; batch_index += batch_entries) {
+                int64_t const batch_size = std::min(batch_entries, table_size - batch_index);
+                disk.Read(batch_index * entry_size, batch.get(), batch_size * entry_size);
+                for (int64_t i = 0; i < batch_size; ++i) {
+                    uint8_t* entry = batch.get() + i * entry_size;
+                    uint64_t const entry_f7 = Util::SliceInt64FromBytes(entry, 0, k);
+                    uint64_t const entry_pos_offset =
+                        Util::SliceInt64FromBytes(entry, k, pos_offset_size);
+                    uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
+                    uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
+                    std::tie(entry_pos, entry_offset) = index.lookup(entry_pos, entry_offset);
+
+                    uint128_t new_entry = (uint128_t)entry_f7 << f7_shift;
+                    new_entry |= (uint128_t)((entry_pos << kOffsetSize) | entry_offset)
+                        << t7_pos_offset_shift;
+                    uint8_t bytes[16];
+                    Util::IntTo16Bytes(bytes, new_entry);
+                    memcpy(entry, bytes, entry_size);
+                }
+                // a task at a time, so the writes fit the write buffer
+                for (int64_t begin = 0; begin < batch_size; begin += kPhase2TaskEntries) {
+                    int64_t const end = std::min(begin + kPhase2TaskEntries, batch_size);
+                    disk.Write(
+                        (batch_index + begin) * entry_size,
+                        batch.get() + begin * entry_size,
+                        (end - begin) * entry_size);
+                }
+            }
+        }
+
+        if (flags & SHOW_PROGRESS) {
+            progress(2, 8 - table_index, 6);
+        }
+    }
+
+    int const table_index = 1;
+    int64_t const table_size = table_sizes[table_index];
+    int16_t const entry_size = EntrySizes::GetMaxEntrySize(k, table_index, false);
+    BufferedDisk disk(&tmp_1_disks[table_index], table_size * entry_size);
+
+    std::cout << "table " << table_index << " new size: " << new_table_sizes[table_index] << std::endl;
+
+    std::vector<std::unique_ptr<BitfieldReader>> position_maps(6);
+    for (int i = 1; i < 6; ++i) {
+        position_maps[i] = std::make_unique<BitfieldReader>(bitfield_files[i], table_sizes[i]);
+    }
+
+    BufferedDisk table7_disk(&tmp_1_disks[7], new_table_sizes[7] * new_entry_size);
+    disk.DiscardBehind();
+    table7_disk.DiscardBehind();
+
+    return {
+        FilteredDisk(
+            std::move(disk),
+            std::make_unique<BitfieldReader>(bitfield_files[1], table_size),
+            entry_size)
+        , std::move(table7_disk)
+        , std::move(output_files)
+        , std::move(new_table_sizes)
+        , std::move(position_maps)
+    };
+}
+
 // Backpropagate takes in as input, a file on which forward propagation has been done.
 // The purpose of backpropagate is to eliminate any dead entries that don't contribute
 // to final values in f7, to minimize disk usage. A sort on disk is applied to each table,
@@ -45,11 +333,12 @@ Phase2Results RunPhase2(
     std::vector<uint64_t> table_sizes,
     uint8_t const k,
     const uint8_t *id,
-    const std::string &tmp_dirname,
+    TempDirs const &tmp_dirs,
     const std::string &filename,
     uint64_t memory_size,
     uint32_t const num_buckets,
     uint32_t const log_num_buckets,
+    ThreadPool &pool,
     uint8_t const flags)
 {
     // After pruning each table will have 0.865 * 2^k or fewer entries on
@@ -74,7 +363,9 @@ Phase2Results RunPhase2(
     //    references to
 
     // The second scan of the table, we update the positions and offsets to
-    // reflect the entries that will be dropped in the next table.
+    // reflect the entries that will be dropped in the next table. If the
+    // entries that aren't dropped fit in memory, the first scan keeps them and
+    // the second one reads them from there, so the table is read only once.
 
     // At the end of the iteration, we transfer the next_bitfield to the current bitfield
     // to use it to prune the next table to scan.
@@ -82,6 +373,24 @@ Phase2Results RunPhase2(
     int64_t const max_table_size = *std::max_element(table_sizes.begin()
         , table_sizes.end());
 
+    // The two bitfields and the index of one take 9/32 of a byte per entry
+    // of the largest table. If that's more than the half of the memory the
+    // sorts leave, they're kept on disk instead.
+    if ((flags & SPILL_BITFIELDS) || uint64_t(max_table_size) / 8 * 9 / 4 > memory_size / 2) {
+        std::cout << "Spilling phase 2 bitfields to disk" << std::endl;
+        return RunPhase2Spilled(
+            tmp_1_disks,
+            std::move(table_sizes),
+            k,
+            tmp_dirs,
+            filename,
+            memory_size,
+            num_buckets,
+            log_num_buckets,
+            pool,
+            flags);
+    }
+
     bitfield next_bitfield(max_table_size);
     bitfield current_bitfield(max_table_size);
 
@@ -108,34 +417,86 @@ Phase2Results RunPhase2(
 
         BufferedDisk disk(&tmp_1_disks[table_index], table_size * entry_size);
 
-        // read_index is the number of entries we've processed so far (in the
-        // current table) i.e. the index to the current entry. This is not used
-        // for table 7
-
-        int64_t read_cursor = 0;
-        for (int64_t read_index = 0; read_index < table_size; ++read_index, read_cursor += entry_size)
-        {
-            uint8_t const* entry = disk.Read(read_cursor, entry_size);
-
-            uint64_t entry_pos_offset = 0;
-            if (table_index == 7) {
-                // table 7 is special, we never drop anything, so just build
-                // next_bitfield
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
-            } else {
-                if (!current_bitfield.get(read_index))
-                {
-                    // This entry should be dropped.
-                    continue;
-                }
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
+        // Both scans read the table in batches, and the threads of the pool
+        // each process a task of kPhase2TaskEntries entries of a batch.
+        // 7 bytes of head-room, since SliceInt64FromBytes() may overrun
+        int64_t const batch_entries = int64_t(kPhase2TaskEntries) * pool.size();
+        std::unique_ptr<uint8_t[]> batch(new uint8_t[batch_entries * entry_size + 7]);
+
+        // The index among the entries that aren't dropped of the first entry
+        // of each task, and of the entry following the batch
+        std::vector<int64_t> task_counters(cdiv(batch_entries, int64_t(kPhase2TaskEntries)) + 1);
+        // Sets task_counters for the batch, which starts at counter, and
+        // returns the number of tasks
+        auto const count_tasks = [&](int64_t const batch_index,
+                                     int64_t const batch_size,
+                                     bool const dropping,
+                                     int64_t const counter) {
+            uint32_t const num_tasks = cdiv(batch_size, int64_t(kPhase2TaskEntries));
+            task_counters[0] = counter;
+            for (uint32_t task = 0; task < num_tasks; ++task) {
+                int64_t const begin = batch_index + int64_t(task) * kPhase2TaskEntries;
+                int64_t const end = std::min(begin + kPhase2TaskEntries, batch_index + batch_size);
+                task_counters[task + 1] = task_counters[task] +
+                    (dropping ? current_bitfield.count(begin, end) : end - begin);
             }
+            return num_tasks;
+        };
+
+        // The entries that aren't dropped, if they fit the half of the memory
+        // the sorts don't need in this phase. Then this is the only pass over
+        // tables 2-6, and they're freed as they're read.
+        int64_t const kept_size =
+            table_index == 7 ? table_size : current_bitfield.count(0, table_size);
+        std::unique_ptr<uint8_t[]> kept;
+        if (uint64_t(kept_size) * entry_size <= memory_size / 2) {
+            kept.reset(new uint8_t[kept_size * entry_size + 7]);
+            if (table_index != 7) {
+                disk.DiscardBehind();
+            }
+        }
 
-            uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
-            uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
-            // mark the two matching entries as used (pos and pos+offset)
-            next_bitfield.set(entry_pos);
-            next_bitfield.set(entry_pos + entry_offset);
+        int64_t kept_counter = 0;
+        for (int64_t batch_index = 0; batch_index < table_size; batch_index += batch_entries) {
+            int64_t const batch_size = std::min(batch_entries, table_size - batch_index);
+            disk.Read(batch_index * entry_size, batch.get(), batch_size * entry_size);
+            uint32_t const num_tasks =
+                count_tasks(batch_index, batch_size, table_index != 7, kept_counter);
+
+            pool.Run(num_tasks, [&](uint32_t const task) {
+                int64_t const begin = int64_t(task) * kPhase2TaskEntries;
+                int64_t const end = std::min(begin + kPhase2TaskEntries, batch_size);
+                int64_t counter = task_counters[task];
+                for (int64_t i = begin; i < end; ++i) {
+                    uint8_t const* entry = batch.get() + i * entry_size;
+
+                    uint64_t entry_pos_offset = 0;
+                    if (table_index == 7) {
+                        // table 7 is special, we never drop anything, so just build
+                        // next_bitfield
+                        entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
+                    } else {
+                        if (!current_bitfield.get(batch_index + i))
+                        {
+                            // This entry should be dropped.
+                            continue;
+                        }
+                        entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
+                    }
+
+                    uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
+                    uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
+                    // mark the two matching entries as used (pos and pos+offset)
+                    next_bitfield.set_atomic(entry_pos);
+                    next_bitfield.set_atomic(entry_pos + entry_offset);
+
+                    if (kept) {
+                        memcpy(kept.get() + counter * entry_size, entry, entry_size);
+                    }
+                    ++counter;
+                }
+            });
+            kept_counter = task_counters[num_tasks];
         }
 
         std::cout << "scanned table " << table_index << std::endl;
@@ -144,7 +505,8 @@ Phase2Results RunPhase2(
         std::cout << "sorting table " << table_index << std::endl;
         Timer sort_timer;
 
-        // read the same table again. This time we'll output it to new files:
+        // read the same table again, or the entries we kept of it. This time
+        // we'll output it to new files:
         // * add sort_key (just the index of the current entry)
         // * update (pos, offset) to remain valid after table_index-1 has been
         //   compacted.
@@ -160,67 +522,118 @@ Phase2Results RunPhase2(
             num_buckets,
             log_num_buckets,
             new_entry_size,
-            tmp_dirname,
+            tmp_dirs,
             filename + ".p2.t" + std::to_string(table_index),
             uint32_t(k),
             0,
-            strategy_t::quicksort_last);
+            strategy_t::radix,
+            TmpDiskMode(flags),
+            pool.size(),
+            TmpBucketCodec(flags),
+            &pool);
 
         // as we scan the table for the second time, we'll also need to remap
         // the positions and offsets based on the next_bitfield.
         bitfield_index const index(next_bitfield);
 
-        read_cursor = 0;
-        int64_t write_counter = 0;
-        for (int64_t read_index = 0; read_index < table_size; ++read_index, read_cursor += entry_size)
-        {
-            uint8_t const* entry = disk.Read(read_cursor, entry_size);
-
-            uint64_t entry_f7 = 0;
-            uint64_t entry_pos_offset;
-            if (table_index == 7) {
-                // table 7 is special, we never drop anything, so just build
-                // next_bitfield
-                entry_f7 = Util::SliceInt64FromBytes(entry, 0, k);
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
-            } else {
-                // skipping
-                if (!current_bitfield.get(read_index)) continue;
-
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
-            }
+        // This is the last pass over tables 2-6, free them as they're read.
+        // Table 7 is rewritten in place.
+        if (table_index != 7 && !kept) {
+            disk.DiscardBehind();
+        }
 
-            uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
-            uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
+        // The new entries of a batch, in order
+        std::unique_ptr<uint8_t[]> new_entries(
+            new uint8_t[batch_entries * std::max<int64_t>(entry_size, new_entry_size)]);
 
-            // assemble the new entry and write it to the sort manager
+        // The kept entries are all written, otherwise entries are dropped
+        // as in the first scan
+        int64_t const scan_size = kept ? kept_size : table_size;
+        bool const dropping = !kept && table_index != 7;
 
-            // map the pos and offset to the new, compacted, positions and
-            // offsets
-            std::tie(entry_pos, entry_offset) = index.lookup(entry_pos, entry_offset);
-            entry_pos_offset = (entry_pos << kOffsetSize) | entry_offset;
+        int64_t write_counter = 0;
+        for (int64_t batch_index = 0; batch_index < scan_size; batch_index += batch_entries) {
+            int64_t const batch_size = std::min(batch_entries, scan_size - batch_index);
+            uint8_t const* entries = batch.get();
+            if (kept) {
+                entries = kept.get() + batch_index * entry_size;
+            } else {
+                disk.Read(batch_index * entry_size, batch.get(), batch_size * entry_size);
+            }
+            uint32_t const num_tasks = count_tasks(batch_index, batch_size, dropping, write_counter);
+
+            pool.Run(num_tasks, [&](uint32_t const task) {
+                int64_t const begin = int64_t(task) * kPhase2TaskEntries;
+                int64_t const end = std::min(begin + kPhase2TaskEntries, batch_size);
+                int64_t counter = task_counters[task];
+                for (int64_t i = begin; i < end; ++i) {
+                    uint8_t const* entry = entries + i * entry_size;
+
+                    uint64_t entry_f7 = 0;
+                    uint64_t entry_pos_offset;
+                    if (table_index == 7) {
+                        // table 7 is special, we never drop anything, so just build
+                        // next_bitfield
+                        entry_f7 = Util::SliceInt64FromBytes(entry, 0, k);
+                        entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
+                    } else {
+                        // skipping
+                        if (dropping && !current_bitfield.get(batch_index + i)) continue;
+
+                        entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
+                    }
+
+                    uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
+                    uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
+
+                    // assemble the new entry and write it to the sort manager
+
+                    // map the pos and offset to the new, compacted, positions and
+                    // offsets
+                    std::tie(entry_pos, entry_offset) = index.lookup(entry_pos, entry_offset);
+                    entry_pos_offset = (entry_pos << kOffsetSize) | entry_offset;
+
+                    // IntTo16Bytes() writes past the entry, into the next
+                    // task's entries, so it goes through bytes
+                    uint8_t bytes[16];
+                    if (table_index == 7) {
+                        // table 7 is already sorted by pos, so we just rewrite the
+                        // pos and offset in-place
+                        uint128_t new_entry = (uint128_t)entry_f7 << f7_shift;
+                        new_entry |= (uint128_t)entry_pos_offset << t7_pos_offset_shift;
+                        Util::IntTo16Bytes(bytes, new_entry);
+                        memcpy(new_entries.get() + i * entry_size, bytes, entry_size);
+                    }
+                    else {
+                        // The new entry is slightly different. Metadata is dropped, to
+                        // save space, and the counter of the entry is written (sort_key). We
+                        // use this instead of (y + pos + offset) since its smaller.
+                        uint128_t new_entry = (uint128_t)counter << write_counter_shift;
+                        new_entry |= (uint128_t)entry_pos_offset << pos_offset_shift;
+                        Util::IntTo16Bytes(bytes, new_entry);
+                        memcpy(
+                            new_entries.get() + (counter - write_counter) * new_entry_size,
+                            bytes,
+                            new_entry_size);
+                    }
+                    ++counter;
+                }
+            });
 
-            uint8_t bytes[16];
             if (table_index == 7) {
-                // table 7 is already sorted by pos, so we just rewrite the
-                // pos and offset in-place
-                uint128_t new_entry = (uint128_t)entry_f7 << f7_shift;
-                new_entry |= (uint128_t)entry_pos_offset << t7_pos_offset_shift;
-                Util::IntTo16Bytes(bytes, new_entry);
-
-                disk.Write(read_index * entry_size, bytes, entry_size);
-            }
-            else {
-                // The new entry is slightly different. Metadata is dropped, to
-                // save space, and the counter of the entry is written (sort_key). We
-                // use this instead of (y + pos + offset) since its smaller.
-                uint128_t new_entry = (uint128_t)write_counter << write_counter_shift;
-                new_entry |= (uint128_t)entry_pos_offset << pos_offset_shift;
-                Util::IntTo16Bytes(bytes, new_entry);
-
-                sort_manager->AddToCache(bytes);
+                // a task at a time, so the writes fit the write buffer
+                for (uint32_t task = 0; task < num_tasks; ++task) {
+                    int64_t const begin = int64_t(task) * kPhase2TaskEntries;
+                    int64_t const end = std::min(begin + kPhase2TaskEntries, batch_size);
+                    disk.Write(
+                        (batch_index + begin) * entry_size,
+                        new_entries.get() + begin * entry_size,
+                        (end - begin) * entry_size);
+                }
+            } else {
+                sort_manager->AddToCache(new_entries.get(), task_counters[num_tasks] - write_counter);
             }
-            ++write_counter;
+            write_counter = task_counters[num_tasks];
         }
 
         if (table_index != 7) {
@@ -265,11 +678,17 @@ Phase2Results RunPhase2(
 
     std::cout << "table " << table_index << " new size: " << new_table_sizes[table_index] << std::endl;
 
+    // Phase 3 reads tables 1 and 7 one last time
+    BufferedDisk table7_disk(&tmp_1_disks[7], new_table_sizes[7] * new_entry_size);
+    disk.DiscardBehind();
+    table7_disk.DiscardBehind();
+
     return {
         FilteredDisk(std::move(disk), std::move(current_bitfield), entry_size)
-        , BufferedDisk(&tmp_1_disks[7], new_table_sizes[7] * new_entry_size)
+        , std::move(table7_disk)
         , std::move(output_files)
         , std::move(new_table_sizes)
+        , {}
     };
 }
 
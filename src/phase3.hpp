@@ -20,6 +20,7 @@
 #include "exceptions.hpp"
 #include "pos_constants.hpp"
 #include "sort_manager.hpp"
+#include "phases.hpp"
 #include "progress.hpp"
 
 // Results of phase 3. These are passed into Phase 4, so the checkpoint tables
@@ -42,10 +43,9 @@ struct Phase3Results {
 // have many entries in each park, we can approximate how much space each park with take. Format
 // is: [2k bits of first_line_point]  [EPP-1 stubs] [Deltas size] [EPP-1 deltas]....
 // [first_line_point] ...
-void WriteParkToFile(
-    FileDisk &final_disk,
-    uint64_t table_start,
-    uint64_t park_index,
+// EncodePark() encodes the park into park_buffer, the first park_size_bytes of which are
+// the park.
+void EncodePark(
     uint32_t park_size_bytes,
     uint128_t first_line_point,
     const std::vector<uint8_t> &park_deltas,
@@ -55,9 +55,6 @@ void WriteParkToFile(
     uint8_t *park_buffer,
     uint64_t const park_buffer_size)
 {
-    // Parks are fixed size, so we know where to start writing. The deltas will not go over
-    // into the next park.
-    uint64_t writer = table_start + park_index * park_size_bytes;
     uint8_t *index = park_buffer;
 
     first_line_point <<= 128 - 2 * k;
@@ -101,8 +98,34 @@ void WriteParkToFile(
             " bytes. Space: " + std::to_string(park_buffer_size));
     }
     memset(index, 0x00, park_size_bytes - (index - park_buffer));
+}
+
+void WriteParkToFile(
+    FileDisk &final_disk,
+    uint64_t table_start,
+    uint64_t park_index,
+    uint32_t park_size_bytes,
+    uint128_t first_line_point,
+    const std::vector<uint8_t> &park_deltas,
+    const std::vector<uint64_t> &park_stubs,
+    uint8_t k,
+    uint8_t table_index,
+    uint8_t *park_buffer,
+    uint64_t const park_buffer_size)
+{
+    EncodePark(
+        park_size_bytes,
+        first_line_point,
+        park_deltas,
+        park_stubs,
+        k,
+        table_index,
+        park_buffer,
+        park_buffer_size);
 
-    final_disk.Write(writer, (uint8_t *)park_buffer, park_size_bytes);
+    // Parks are fixed size, so we know where to start writing. The deltas will not go over
+    // into the next park.
+    final_disk.Write(table_start + park_index * park_size_bytes, park_buffer, park_size_bytes);
 }
 
 // Compresses the plot file tables into the final file. In order to do this, entries must be
@@ -122,12 +145,13 @@ Phase3Results RunPhase3(
     FileDisk &tmp2_disk /*filename*/,
     Phase2Results res2,
     const uint8_t *id,
-    const std::string &tmp_dirname,
+    TempDirs const &tmp_dirs,
     const std::string &filename,
     uint32_t header_size,
     uint64_t memory_size,
     uint32_t num_buckets,
     uint32_t log_num_buckets,
+    ThreadPool &pool,
     const uint8_t flags)
 {
     uint8_t const pos_size = k;
@@ -147,12 +171,16 @@ Phase3Results RunPhase3(
     std::unique_ptr<SortManager> L_sort_manager;
     std::unique_ptr<SortManager> R_sort_manager;
 
-    // These variables are used in the WriteParkToFile method. They are preallocatted here
-    // to save time.
+    // The space EncodePark() needs, for any table
     uint64_t const park_buffer_size = EntrySizes::CalculateLinePointSize(k)
         + EntrySizes::CalculateStubsSize(k) + 2
         + EntrySizes::CalculateMaxDeltasSize(k, 1);
-    std::unique_ptr<uint8_t[]> park_buffer(new uint8_t[park_buffer_size]);
+
+    // The line points of a batch of parks, which the threads of the pool
+    // encode, kPhase3TaskParks parks each. Then the parks are written in order.
+    uint64_t const batch_parks = uint64_t(kPhase3TaskParks) * pool.size();
+    std::unique_ptr<uint128_t[]> batch_line_points(
+        new uint128_t[batch_parks * kEntriesPerPark]);
 
     // Iterates through all tables, starting at 1, with L and R pointers.
     // For each table, R entries are rewritten with line points. Then, the right table is
@@ -177,6 +205,13 @@ Phase3Results RunPhase3(
         Disk& right_disk = res2.disk_for_table(table_index + 1);
         Disk& left_disk = res2.disk_for_table(table_index);
 
+        // Maps the positions of the right entries into the compacted left
+        // table, if phase 2 couldn't
+        std::unique_ptr<BitfieldReader> position_map;
+        if (size_t(table_index) < res2.position_maps.size()) {
+            position_map = std::move(res2.position_maps[table_index]);
+        }
+
         // Sort key is k bits for all tables. For table 7 it is just y, which
         // is k bits, and for all other tables the number of entries does not
         // exceed 0.865 * 2^k on average.
@@ -203,11 +238,15 @@ Phase3Results RunPhase3(
             num_buckets,
             log_num_buckets,
             right_entry_size_bytes,
-            tmp_dirname,
+            tmp_dirs,
             filename + ".p3.t" + std::to_string(table_index + 1),
             0,
             0,
-            strategy_t::quicksort_last);
+            strategy_t::radix,
+            TmpDiskMode(flags),
+            pool.size(),
+            TmpBucketCodec(flags),
+            &pool);
 
         bool should_read_entry = true;
         std::vector<uint64_t> left_new_pos(kCachedPositionsSize);
@@ -241,6 +280,7 @@ Phase3Results RunPhase3(
                             end_of_right_table = true;
                             end_of_table_pos = current_pos;
                             right_disk.FreeMemory();
+                            position_map.reset();
                             break;
                         }
                         // The right entries are in the format from backprop, (sort_key, pos,
@@ -255,6 +295,11 @@ Phase3Results RunPhase3(
                             right_entry_buf, right_sort_key_size, pos_size);
                         entry_offset = Util::SliceInt64FromBytes(
                             right_entry_buf, right_sort_key_size + pos_size, kOffsetSize);
+                        // the entries are sorted by pos, as the map needs
+                        if (position_map) {
+                            std::tie(entry_pos, entry_offset) =
+                                position_map->lookup(entry_pos, entry_offset);
+                        }
                     } else if (cached_entry_pos == current_pos) {
                         entry_sort_key = cached_entry_sort_key;
                         entry_pos = cached_entry_pos;
@@ -388,17 +433,78 @@ Phase3Results RunPhase3(
             num_buckets,
             log_num_buckets,
             new_pos_entry_size_bytes,
-            tmp_dirname,
+            tmp_dirs,
             filename + ".p3s.t" + std::to_string(table_index + 1),
             0,
             0,
-            strategy_t::quicksort_last);
+            strategy_t::radix,
+            TmpDiskMode(flags),
+            pool.size(),
+            TmpBucketCodec(flags),
+            &pool);
 
-        std::vector<uint8_t> park_deltas;
-        std::vector<uint64_t> park_stubs;
-        uint128_t checkpoint_line_point = 0;
-        uint128_t last_line_point = 0;
         uint64_t park_index = 0;
+        uint64_t batch_size = 0;
+        std::unique_ptr<uint8_t[]> parks(new uint8_t[batch_parks * park_size_bytes]);
+
+        // Encodes the parks of the line points in the batch, and writes them
+        auto const write_parks = [&]() {
+            if (batch_size == 0) return;
+            uint64_t const num_parks = cdiv(batch_size, uint64_t(kEntriesPerPark));
+            uint32_t const num_tasks = cdiv(num_parks, uint64_t(kPhase3TaskParks));
+            pool.Run(num_tasks, [&](uint32_t const task) {
+                std::unique_ptr<uint8_t[]> park_buffer(new uint8_t[park_buffer_size]);
+                std::vector<uint8_t> park_deltas;
+                std::vector<uint64_t> park_stubs;
+                park_deltas.reserve(kEntriesPerPark - 1);
+                park_stubs.reserve(kEntriesPerPark - 1);
+
+                uint64_t const begin = uint64_t(task) * kPhase3TaskParks;
+                uint64_t const end = std::min(begin + kPhase3TaskParks, num_parks);
+                for (uint64_t park = begin; park < end; ++park) {
+                    uint128_t const* line_points =
+                        batch_line_points.get() + park * kEntriesPerPark;
+                    uint64_t const size =
+                        std::min(uint64_t(kEntriesPerPark), batch_size - park * kEntriesPerPark);
+
+                    // Since we have approx 2^k line_points between 0 and 2^2k, the average
+                    // space between them when sorted, is k bits. Much more efficient than
+                    // storing each line point. This is diveded into the stub and delta. The
+                    // stub is the least significant (k-kMinusStubs) bits, and largely
+                    // random/incompressible. The small delta is the rest, which can be
+                    // efficiently encoded since it's usually very small.
+                    park_deltas.clear();
+                    park_stubs.clear();
+                    for (uint64_t i = 1; i < size; ++i) {
+                        uint128_t const big_delta = line_points[i] - line_points[i - 1];
+                        uint64_t const stub = big_delta & ((1ULL << (k - kStubMinusBits)) - 1);
+                        uint64_t const small_delta = big_delta >> (k - kStubMinusBits);
+                        assert(small_delta < 256);
+                        park_deltas.push_back(small_delta);
+                        park_stubs.push_back(stub);
+                    }
+
+                    EncodePark(
+                        park_size_bytes,
+                        line_points[0],
+                        park_deltas,
+                        park_stubs,
+                        k,
+                        table_index,
+                        park_buffer.get(),
+                        park_buffer_size);
+                    memcpy(parks.get() + park * park_size_bytes, park_buffer.get(), park_size_bytes);
+                }
+            });
+
+            tmp2_disk.Write(
+                final_table_begin_pointers[table_index] + park_index * park_size_bytes,
+                parks.get(),
+                num_parks * park_size_bytes);
+            park_index += num_parks;
+            final_entries_written += batch_size;
+            batch_size = 0;
+        };
 
         uint8_t *right_reader_entry_buf;
 
@@ -427,76 +533,32 @@ Phase3Results RunPhase3(
             L_sort_manager->AddToCache(bytes);
             added_to_cache++;
 
-            // Every EPP entries, writes a park
-            if (index % kEntriesPerPark == 0) {
-                if (index != 0) {
-                    WriteParkToFile(
-                        tmp2_disk,
-                        final_table_begin_pointers[table_index],
-                        park_index,
-                        park_size_bytes,
-                        checkpoint_line_point,
-                        park_deltas,
-                        park_stubs,
-                        k,
-                        table_index,
-                        park_buffer.get(),
-                        park_buffer_size);
-                    park_index += 1;
-                    final_entries_written += (park_stubs.size() + 1);
-                }
-                park_deltas.clear();
-                park_stubs.clear();
-
-                checkpoint_line_point = line_point;
-            }
-            uint128_t big_delta = line_point - last_line_point;
-
-            // Since we have approx 2^k line_points between 0 and 2^2k, the average
-            // space between them when sorted, is k bits. Much more efficient than storing each
-            // line point. This is diveded into the stub and delta. The stub is the least
-            // significant (k-kMinusStubs) bits, and largely random/incompressible. The small
-            // delta is the rest, which can be efficiently encoded since it's usually very
-            // small.
-
-            uint64_t stub = big_delta & ((1ULL << (k - kStubMinusBits)) - 1);
-            uint64_t small_delta = big_delta >> (k - kStubMinusBits);
-
-            assert(small_delta < 256);
-
-            if ((index % kEntriesPerPark != 0)) {
-                park_deltas.push_back(small_delta);
-                park_stubs.push_back(stub);
+            // Every EPP entries start a park
+            batch_line_points[batch_size++] = line_point;
+            if (batch_size == batch_parks * kEntriesPerPark) {
+                write_parks();
             }
-            last_line_point = line_point;
         }
         R_sort_manager.reset();
         L_sort_manager->FlushCache();
 
-        computation_pass_2_timer.PrintElapsed("\tSecond computation pass time:");
-
-        if (park_deltas.size() > 0) {
-            // Since we don't have a perfect multiple of EPP entries, this writes the last ones
-            WriteParkToFile(
-                tmp2_disk,
-                final_table_begin_pointers[table_index],
-                park_index,
-                park_size_bytes,
-                checkpoint_line_point,
-                park_deltas,
-                park_stubs,
-                k,
-                table_index,
-                park_buffer.get(),
-                park_buffer_size);
-            final_entries_written += (park_stubs.size() + 1);
+        // Since we don't have a perfect multiple of EPP entries, this writes the last ones.
+        // A last park of just the checkpoint has no deltas, it's not written, but its
+        // space is kept.
+        if (batch_size % kEntriesPerPark == 1) {
+            --batch_size;
         }
+        write_parks();
+
+        computation_pass_2_timer.PrintElapsed("\tSecond computation pass time:");
 
         Encoding::ANSFree(kRValues[table_index - 1]);
         std::cout << "\tWrote " << final_entries_written << " entries" << std::endl;
 
+        uint64_t const table_parks =
+            std::max(cdiv(total_r_entries, uint64_t(kEntriesPerPark)), uint64_t(1));
         final_table_begin_pointers[table_index + 1] =
-            final_table_begin_pointers[table_index] + (park_index + 1) * park_size_bytes;
+            final_table_begin_pointers[table_index] + table_parks * park_size_bytes;
 
         final_table_writer = header_size - 8 * (10 - table_index);
         Util::IntToEightBytes(table_pointer_bytes, final_table_begin_pointers[table_index + 1]);
@@ -511,7 +573,7 @@ Phase3Results RunPhase3(
     }
 
     L_sort_manager->FreeMemory();
-    park_buffer.reset();
+    batch_line_points.reset();
 
     // These results will be used to write table P7 and the checkpoint tables in phase 4.
     return Phase3Results{
@@ -78,6 +78,12 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
     auto C3_entry_buf = new uint8_t[size_C3];
     auto P7_entry_buf = new uint8_t[P7_park_size];
 
+    // P7, C1 (followed by C2) and C3 are each written sequentially, through
+    // their own write-behind buffer
+    BufferedDisk P7_disk(&tmp2_disk, 0);
+    BufferedDisk C1_disk(&tmp2_disk, 0);
+    BufferedDisk C3_disk(&tmp2_disk, 0);
+
     std::cout << "\tStarting to write C1 and C3 tables" << std::endl;
 
     ParkBits to_write_p7;
@@ -97,7 +103,7 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
         if (f7_position % kEntriesPerPark == 0 && f7_position > 0) {
             memset(P7_entry_buf, 0, P7_park_size);
             to_write_p7.ToBytes(P7_entry_buf);
-            tmp2_disk.Write(final_file_writer_3, (P7_entry_buf), P7_park_size);
+            P7_disk.Write(final_file_writer_3, (P7_entry_buf), P7_park_size);
             final_file_writer_3 += P7_park_size;
             to_write_p7 = ParkBits();
         }
@@ -106,7 +112,7 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
 
         if (f7_position % kCheckpoint1Interval == 0) {
             entry_y_bits.ToBytes(C1_entry_buf);
-            tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
+            C1_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
             final_file_writer_1 += Util::ByteAlign(k) / 8;
             if (num_C1_entries > 0) {
                 final_file_writer_2 = begin_byte_C3 + (num_C1_entries - 1) * size_C3;
@@ -119,7 +125,13 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
                 // Write the size
                 Util::IntToTwoBytes(C3_entry_buf, num_bytes - 2);
 
-                tmp2_disk.Write(final_file_writer_2, (C3_entry_buf), num_bytes);
+                // The rest of the slot is zero either way, writing it keeps
+                // the C3 writes contiguous
+                if (num_bytes < size_C3) {
+                    memset(C3_entry_buf + num_bytes, 0, size_C3 - num_bytes);
+                    num_bytes = size_C3;
+                }
+                C3_disk.Write(final_file_writer_2, (C3_entry_buf), num_bytes);
                 final_file_writer_2 += num_bytes;
             }
             prev_y = entry_y;
@@ -143,7 +155,7 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
     memset(P7_entry_buf, 0, P7_park_size);
     to_write_p7.ToBytes(P7_entry_buf);
 
-    tmp2_disk.Write(final_file_writer_3, (P7_entry_buf), P7_park_size);
+    P7_disk.Write(final_file_writer_3, (P7_entry_buf), P7_park_size);
     final_file_writer_3 += P7_park_size;
 
     if (!deltas_to_write.empty()) {
@@ -154,27 +166,31 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
         // Write the size
         Util::IntToTwoBytes(C3_entry_buf, num_bytes);
 
-        tmp2_disk.Write(final_file_writer_2, (C3_entry_buf), size_C3);
+        C3_disk.Write(final_file_writer_2, (C3_entry_buf), size_C3);
         final_file_writer_2 += size_C3;
         Encoding::ANSFree(kC3R);
     }
 
     Bits(0, Util::ByteAlign(k)).ToBytes(C1_entry_buf);
-    tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
+    C1_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
     final_file_writer_1 += Util::ByteAlign(k) / 8;
     std::cout << "\tFinished writing C1 and C3 tables" << std::endl;
     std::cout << "\tWriting C2 table" << std::endl;
 
     for (Bits &C2_entry : C2) {
         C2_entry.ToBytes(C1_entry_buf);
-        tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
+        C1_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
         final_file_writer_1 += Util::ByteAlign(k) / 8;
     }
     Bits(0, Util::ByteAlign(k)).ToBytes(C1_entry_buf);
-    tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
+    C1_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
     final_file_writer_1 += Util::ByteAlign(k) / 8;
     std::cout << "\tFinished writing C2 table" << std::endl;
 
+    P7_disk.FlushCache();
+    C1_disk.FlushCache();
+    C3_disk.FlushCache();
+
     delete[] C3_entry_buf;
     delete[] C1_entry_buf;
     delete[] P7_entry_buf;
@@ -19,9 +19,41 @@
 
 #include <cstdint>
 
+#include "bucket_codec.hpp"
+#include "disk.hpp"
+
 enum phase_flags : uint8_t {
     ENABLE_BITFIELD = 1 << 0,
     SHOW_PROGRESS = 1 << 1,
+    // Keep temp files and sort buckets in memory instead of the temp directory
+    TMP_IN_MEMORY = 1 << 2,
+    // Access temp files and the plot with direct I/O, bypassing the page cache
+    DIRECT_IO = 1 << 3,
+    // Encode sort buckets, trading CPU time for less temp I/O
+    COMPRESS_TMP = 1 << 4,
+    // Back the sort memory with reserved huge pages, instead of transparent ones
+    HUGE_PAGES = 1 << 5,
+    // Keep the bitfields of phase 2 in temp files, for tables too large for
+    // the memory. Phase 2 does this by itself when they don't fit.
+    SPILL_BITFIELDS = 1 << 6,
 };
 
+// How the plot file is stored, for the given phase flags
+inline disk_mode_t PlotDiskMode(uint8_t const flags)
+{
+    return (flags & DIRECT_IO) ? disk_mode_t::direct : disk_mode_t::file;
+}
+
+// How temp files are stored, for the given phase flags
+inline disk_mode_t TmpDiskMode(uint8_t const flags)
+{
+    return (flags & TMP_IN_MEMORY) ? disk_mode_t::memory : PlotDiskMode(flags);
+}
+
+// How the entries of sort buckets are stored, for the given phase flags
+inline bucket_codec_t TmpBucketCodec(uint8_t const flags)
+{
+    return (flags & COMPRESS_TMP) ? bucket_codec_t::delta : bucket_codec_t::none;
+}
+
 #endif  // SRC_CPP_PHASES_HPP
@@ -37,6 +37,7 @@
 #include "calculate_bucket.hpp"
 #include "encoding.hpp"
 #include "exceptions.hpp"
+#include "memory_arena.hpp"
 #include "phases.hpp"
 #include "phase1.hpp"
 #include "phase2.hpp"
@@ -47,6 +48,7 @@
 #include "b17phase4.hpp"
 #include "pos_constants.hpp"
 #include "sort_manager.hpp"
+#include "temp_dirs.hpp"
 #include "util.hpp"
 
 #define B17PHASE23
@@ -54,12 +56,20 @@ namespace fs = std::filesystem;
 
 class DiskPlotter {
 public:
+    // numa_node is the NUMA node to allocate the sort memory on, or -1. The
+    // plotting threads are pinned to cpus, or to the CPUs of numa_node if
+    // cpus is empty. Concurrent plots can be given their own cores this way.
+    explicit DiskPlotter(int const numa_node = -1, std::vector<int> cpus = {})
+        : numa_node_(numa_node), cpus_(std::move(cpus))
+    {
+    }
+
     // This method creates a plot on disk with the filename. Many temporary files
     // (filename + ".table1.tmp", filename + ".p2.t3.sort_bucket_4.tmp", etc.) are created
     // and their total size will be larger than the final plot file. Temp files are deleted at the
     // end of the process.
     void CreatePlotDisk(
-        std::string tmp_dirname,
+        TempDirs tmp_dirs,
         std::string tmp2_dirname,
         std::string final_dirname,
         std::string filename,
@@ -108,7 +118,8 @@ public:
         }
 
         // Subtract some ram to account for dynamic allocation through the code
-        uint64_t thread_memory = num_threads * (2 * (stripe_size + 5000)) *
+        uint64_t thread_memory = num_threads * kPhase1StripeBuffersPerThread *
+                                 (2 * (stripe_size + 5000)) *
                                  EntrySizes::GetMaxEntrySize(k, 4, true) / (1024 * 1024);
         uint64_t sub_mbytes = (5 + (int)std::min(buf_megabytes * 0.05, (double)50) + thread_memory);
         if (sub_mbytes > buf_megabytes) {
@@ -150,6 +161,20 @@ public:
             throw InvalidValueException("Stripe size too large");
         }
 
+        if (phases_flags & TMP_IN_MEMORY && !(phases_flags & ENABLE_BITFIELD)) {
+            throw InvalidValueException("Temp files in memory need bitfield plotting");
+        }
+
+        // The plotting without bitfield does many small writes, which are
+        // slow without the page cache
+        if (phases_flags & DIRECT_IO && !(phases_flags & ENABLE_BITFIELD)) {
+            throw InvalidValueException("Direct I/O needs bitfield plotting");
+        }
+        // The sort buckets of the plotting without bitfield aren't encoded
+        if (phases_flags & COMPRESS_TMP && !(phases_flags & ENABLE_BITFIELD)) {
+            throw InvalidValueException("Encoded sort buckets need bitfield plotting");
+        }
+
 #if defined(_WIN32) || defined(__x86_64__)
         if (phases_flags & ENABLE_BITFIELD && !Util::HavePopcnt()) {
             throw InvalidValueException("Bitfield plotting not supported by CPU");
@@ -157,7 +182,7 @@ public:
 #endif /* defined(_WIN32) || defined(__x86_64__) */
 
         std::cout << std::endl
-                  << "Starting plotting progress into temporary dirs: " << tmp_dirname << " and "
+                  << "Starting plotting progress into temporary dirs: " << tmp_dirs.ToString() << " and "
                   << tmp2_dirname << std::endl;
         std::cout << "ID: " << Util::HexStr(id, id_len) << std::endl;
         std::cout << "Plot size is: " << static_cast<int>(k) << std::endl;
@@ -167,24 +192,66 @@ public:
         std::cout << "Using " << (int)num_threads << " threads of stripe size " << stripe_size
                   << std::endl;
         std::cout << "Process ID is: " << ::getpid() << std::endl;
+        if (phases_flags & TMP_IN_MEMORY) {
+            std::cout << "Temp files are kept in memory" << std::endl;
+        }
+        if (phases_flags & DIRECT_IO) {
+            std::cout << "Using direct I/O" << std::endl;
+        }
+        if (phases_flags & COMPRESS_TMP) {
+            std::cout << "Sort buckets are encoded" << std::endl;
+        }
+        if (phases_flags & HUGE_PAGES) {
+            std::cout << "Using reserved huge pages" << std::endl;
+        }
+        if (numa_node_ >= 0) {
+            std::cout << "Sort memory is on NUMA node " << numa_node_ << std::endl;
+        }
+        // The sort memory freed by a phase is kept for the next one, up to
+        // one buffer's worth. It's reset once the plot is written, or on error
+        auto arena = std::make_unique<MemoryArena::Scope>(
+            phases_flags & HUGE_PAGES, numa_node_, memory_size);
+
+        // The threads of all phases, kept for the next plot
+        std::vector<int> cpus = cpus_;
+        if (cpus.empty() && numa_node_ >= 0) cpus = NumaNodeCpus(numa_node_);
+        if (!pool_ || pool_->size() != num_threads || pool_->Cpus() != cpus) {
+            pool_ = std::make_unique<ThreadPool>(num_threads, cpus);
+        }
+        // The plotting thread is one of the threads of the pool, on the CPU
+        // none of the workers are pinned to
+        std::unique_ptr<CpuPin> pin;
+        if (!cpus.empty()) {
+            pin = std::make_unique<CpuPin>(cpus[0]);
+            std::cout << "Threads are pinned to CPUs";
+            for (int const cpu : cpus) std::cout << " " << cpu;
+            std::cout << std::endl;
+        }
 
         // Cross platform way to concatenate paths, gulrak library.
         std::vector<fs::path> tmp_1_filenames = std::vector<fs::path>();
 
         // The table0 file will be used for sort on disk spare. tables 1-7 are stored in their own
         // file.
-        tmp_1_filenames.push_back(fs::path(tmp_dirname) / fs::path(filename + ".sort.tmp"));
+        // The temp files are spread over the temp directories like the sort buckets
+        tmp_1_filenames.push_back(tmp_dirs.Dir(0) / fs::path(filename + ".sort.tmp"));
         for (size_t i = 1; i <= 7; i++) {
             tmp_1_filenames.push_back(
-                fs::path(tmp_dirname) / fs::path(filename + ".table" + std::to_string(i) + ".tmp"));
+                tmp_dirs.Dir(i) / fs::path(filename + ".table" + std::to_string(i) + ".tmp"));
         }
-        fs::path tmp_2_filename = fs::path(tmp2_dirname) / fs::path(filename + ".2.tmp");
         fs::path final_2_filename = fs::path(final_dirname) / fs::path(filename + ".2.tmp");
+        // With temp files in memory, the plot is written straight to the final directory,
+        // instead of to tmp2 and then copied
+        fs::path tmp_2_filename = (phases_flags & TMP_IN_MEMORY)
+                                      ? final_2_filename
+                                      : fs::path(tmp2_dirname) / fs::path(filename + ".2.tmp");
         fs::path final_filename = fs::path(final_dirname) / fs::path(filename);
 
         // Check if the paths exist
-        if (!fs::exists(tmp_dirname)) {
-            throw InvalidValueException("Temp directory " + tmp_dirname + " does not exist");
+        for (auto const& dir : tmp_dirs.Dirs()) {
+            if (!fs::exists(dir)) {
+                throw InvalidValueException("Temp directory " + dir.string() + " does not exist");
+            }
         }
 
         if (!fs::exists(tmp2_dirname)) {
@@ -204,9 +271,9 @@ public:
             // Scope for FileDisk
             std::vector<FileDisk> tmp_1_disks;
             for (auto const& fname : tmp_1_filenames)
-                tmp_1_disks.emplace_back(fname);
+                tmp_1_disks.emplace_back(fname, TmpDiskMode(phases_flags));
 
-            FileDisk tmp2_disk(tmp_2_filename);
+            FileDisk tmp2_disk(tmp_2_filename, PlotDiskMode(phases_flags));
 
             assert(id_len == kIdLen);
 
@@ -214,19 +281,34 @@ public:
                       << "Starting phase 1/4: Forward Propagation into tmp files... "
                       << Timer::GetNow();
 
+            // Phase 1 has versions for the production plot sizes, in which the entry widths,
+            // shifts and masks are compile-time constants
+            auto run_phase1 = RunPhase1<0>;
+            switch (k) {
+                case 32:
+                    run_phase1 = RunPhase1<32>;
+                    break;
+                case 33:
+                    run_phase1 = RunPhase1<33>;
+                    break;
+                case 34:
+                    run_phase1 = RunPhase1<34>;
+                    break;
+            }
+
             Timer p1;
             Timer all_phases;
-            std::vector<uint64_t> table_sizes = RunPhase1(
+            std::vector<uint64_t> table_sizes = run_phase1(
                 tmp_1_disks,
                 k,
                 id,
-                tmp_dirname,
+                tmp_dirs,
                 filename,
                 memory_size,
                 num_buckets,
                 log_num_buckets,
                 stripe_size,
-                num_threads,
+                *pool_,
                 phases_flags);
             p1.PrintElapsed("Time for phase 1 =");
 
@@ -235,7 +317,7 @@ public:
             if((phases_flags & ENABLE_BITFIELD) == 0)
             {
                 // Memory to be used for sorting and buffers
-                std::unique_ptr<uint8_t[]> memory(new uint8_t[memory_size + 7]);
+                auto memory = MemoryArena::Instance().Alloc(memory_size + 7);
 
                 std::cout << std::endl
                       << "Starting phase 2/4: Backpropagation without bitfield into tmp files... "
@@ -248,7 +330,7 @@ public:
                     table_sizes,
                     k,
                     id,
-                    tmp_dirname,
+                    tmp_dirs.Dir(0).string(),
                     filename,
                     memory_size,
                     num_buckets,
@@ -270,7 +352,7 @@ public:
                     tmp_1_disks,
                     backprop_table_sizes,
                     id,
-                    tmp_dirname,
+                    tmp_dirs.Dir(0).string(),
                     filename,
                     header_size,
                     memory_size,
@@ -298,11 +380,12 @@ public:
                     table_sizes,
                     k,
                     id,
-                    tmp_dirname,
+                    tmp_dirs,
                     filename,
                     memory_size,
                     num_buckets,
                     log_num_buckets,
+                    *pool_,
                     phases_flags);
                 p2.PrintElapsed("Time for phase 2 =");
 
@@ -318,12 +401,13 @@ public:
                     tmp2_disk,
                     std::move(res2),
                     id,
-                    tmp_dirname,
+                    tmp_dirs,
                     filename,
                     header_size,
                     memory_size,
                     num_buckets,
                     log_num_buckets,
+                    *pool_,
                     phases_flags);
                 p3.PrintElapsed("Time for phase 3 =");
 
@@ -355,6 +439,7 @@ public:
                       << " GiB" << std::endl;
             all_phases.PrintElapsed("Total time =");
         }
+        arena.reset();
 
         for (fs::path p : tmp_1_filenames) {
             fs::remove(p);
@@ -426,6 +511,10 @@ public:
     }
 
 private:
+    int numa_node_;
+    std::vector<int> cpus_;
+    std::unique_ptr<ThreadPool> pool_;
+
     // Writes the plot file header to a file
     uint32_t WriteHeader(
         FileDisk& plot_Disk,
@@ -55,6 +55,26 @@ const uint32_t kCheckpoint2Interval = 10000;
 // F1 evaluations are done in batches of 2^kBatchSizes
 const uint32_t kBatchSizes = 8;
 
+// Initial capacity of the reusable buckets in phase 1. A bucket holds kBC / kExtraBitsPow
+// (about 236) entries on average, the arrays grow if a bucket is larger.
+const uint32_t kPhase1BucketCapacity = 512;
+
+// Stripe output buffers per phase 1 thread. With more than one, a thread that finishes a
+// stripe before the stripes preceding it can start on the next one.
+const uint32_t kPhase1StripeBuffersPerThread = 2;
+
+// Bytes each F1 thread stages (split evenly across the sort buckets) before
+// appending to the bucket files
+const uint32_t kF1StagingBytes = 1U << 20;
+
+// Phase 2 scans a table in batches, split into tasks of this many entries for the
+// threads. A multiple of 64, so tasks start on a word of the bitfields.
+const uint32_t kPhase2TaskEntries = 16 * 1024;
+
+// Phase 3 encodes the parks of a table in batches, split into tasks of this many
+// parks for the threads.
+const uint32_t kPhase3TaskParks = 8;
+
 // EPP for the final file, the higher this is, the less variability, and lower delta
 // Note: if this is increased, ParkVector size must increase
 const uint32_t kEntriesPerPark = 2048;
@@ -0,0 +1,272 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_RADIXSORT_HPP_
+#define SRC_CPP_RADIXSORT_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "threading.hpp"
+
+namespace RadixSort {
+
+    // Ranges with at most this many entries are insertion sorted
+    inline uint64_t const kInsertionSortThreshold = 32;
+
+    // Ranges smaller than this are sorted on the calling thread only
+    inline uint64_t const kMinParallelEntries = 1 << 16;
+
+    // In-place MSD radix (American flag) sort of fixed size entries, by the
+    // bits starting at bits_begin, up to the end of the entry. The result is
+    // the same order as QuickSort::Sort() and UniformSort::SortToMemory()
+    // produce, since those compare the same bits with Util::MemCmpBits().
+    //
+    // The first pass partitions by up to 16 key bits, the resulting ranges
+    // are then sorted concurrently, one byte at a time. kLen is the entry
+    // size, or 0 to use entry_len at runtime. The threads come from pool, if
+    // there is one.
+    template <uint32_t kLen>
+    class Sorter {
+    public:
+        Sorter(
+            uint8_t *memory,
+            uint32_t entry_len,
+            uint64_t num_entries,
+            uint32_t bits_begin,
+            ThreadPool *pool = nullptr)
+            : memory_(memory)
+            , pool_(pool)
+            , len_(kLen ? kLen : entry_len)
+            , num_entries_(num_entries)
+            , start_byte_(bits_begin / 8)
+            , mask_((1 << (8 - (bits_begin % 8))) - 1)
+        {
+        }
+
+        void Sort(uint32_t const num_threads)
+        {
+            if (start_byte_ >= len_ || num_entries_ <= 1) return;
+
+            // The first digit is made from the partial first key byte and
+            // the byte following it, if there is one
+            uint32_t const top_end = std::min(start_byte_ + 2, len_);
+            uint32_t const top_shift = (top_end - start_byte_ - 1) * 8;
+            auto const top_digit = [&](uint8_t const *entry) {
+                uint32_t d = uint32_t(entry[start_byte_] & mask_) << top_shift;
+                if (top_shift) d |= entry[start_byte_ + 1];
+                return d;
+            };
+            uint32_t const num_digits = (uint32_t(mask_) + 1) << top_shift;
+
+            uint32_t const threads =
+                num_entries_ < kMinParallelEntries ? 1 : std::max(num_threads, 1U);
+
+            // Histogram, each thread counts a slice of the entries
+            std::vector<std::vector<uint64_t>> counts(threads);
+            RunThreads(threads, [&](uint32_t const t) {
+                counts[t].assign(num_digits, 0);
+                uint64_t const begin = num_entries_ * t / threads;
+                uint64_t const end = num_entries_ * (t + 1) / threads;
+                for (uint64_t i = begin; i < end; ++i) {
+                    ++counts[t][top_digit(memory_ + i * len_)];
+                }
+            });
+            for (uint32_t t = 1; t < threads; ++t) {
+                for (uint32_t d = 0; d < num_digits; ++d) counts[0][d] += counts[t][d];
+            }
+
+            std::vector<uint64_t> ends(num_digits);
+            uint64_t total = 0;
+            for (uint32_t d = 0; d < num_digits; ++d) {
+                total += counts[0][d];
+                ends[d] = total;
+            }
+            std::vector<uint64_t> next(num_digits);
+            Permute(memory_, num_digits, counts[0].data(), ends.data(), next.data(), top_digit);
+
+            // Ranges of the first digit are independent, threads claim them
+            // one at a time
+            std::atomic<uint32_t> next_digit{0};
+            RunThreads(threads, [&](uint32_t) {
+                for (uint32_t d = next_digit++; d < num_digits; d = next_digit++) {
+                    uint64_t const begin = ends[d] - counts[0][d];
+                    SortRange(memory_ + begin * len_, counts[0][d], top_end);
+                }
+            });
+        }
+
+    private:
+        uint8_t *const memory_;
+        ThreadPool *const pool_;
+        uint32_t const len_;
+        uint64_t const num_entries_;
+        uint32_t const start_byte_;
+        uint8_t const mask_;
+
+        template <typename Func>
+        void RunThreads(uint32_t const num_threads, Func const &func) const
+        {
+            if (num_threads == 1) {
+                func(0);
+                return;
+            }
+            if (pool_) {
+                pool_->Run(num_threads, func);
+                return;
+            }
+            std::vector<std::thread> threads;
+            for (uint32_t t = 0; t < num_threads; ++t) {
+                threads.emplace_back(func, t);
+            }
+            for (auto &t : threads) t.join();
+        }
+
+        // Moves every entry into the range of its digit, cycle by cycle.
+        // counts[] are the sizes of the ranges and ends[] where they end,
+        // next[] is scratch space for num_digits positions.
+        template <typename Digit>
+        void Permute(
+            uint8_t *data,
+            uint32_t const num_digits,
+            uint64_t const *counts,
+            uint64_t const *ends,
+            uint64_t *next,
+            Digit const &digit) const
+        {
+            for (uint32_t d = 0; d < num_digits; ++d) next[d] = ends[d] - counts[d];
+
+            uint8_t held[kLen ? kLen : 256];
+            uint8_t swap[kLen ? kLen : 256];
+            std::unique_ptr<uint8_t[]> large;
+            uint8_t *held_ptr = held;
+            uint8_t *swap_ptr = swap;
+            if (!kLen && len_ > 256) {
+                large.reset(new uint8_t[2 * len_]);
+                held_ptr = large.get();
+                swap_ptr = large.get() + len_;
+            }
+
+            for (uint32_t b = 0; b < num_digits; ++b) {
+                while (next[b] < ends[b]) {
+                    uint8_t *const slot = data + next[b] * len_;
+                    uint32_t d = digit(slot);
+                    if (d == b) {
+                        ++next[b];
+                        continue;
+                    }
+                    memcpy(held_ptr, slot, len_);
+                    // Follow the cycle until the entry for this slot turns up
+                    while (d != b) {
+                        uint8_t *const dest = data + next[d]++ * len_;
+                        memcpy(swap_ptr, dest, len_);
+                        memcpy(dest, held_ptr, len_);
+                        memcpy(held_ptr, swap_ptr, len_);
+                        d = digit(held_ptr);
+                    }
+                    memcpy(slot, held_ptr, len_);
+                    ++next[b];
+                }
+            }
+        }
+
+        // Sorts count entries which are equal before byte. They are compared
+        // from byte onwards, which is a plain memcmp()
+        void SortRange(uint8_t *data, uint64_t const count, uint32_t const byte) const
+        {
+            if (count <= 1 || byte >= len_) return;
+
+            if (count <= kInsertionSortThreshold) {
+                InsertionSort(data, count, byte);
+                return;
+            }
+
+            auto const digit = [byte](uint8_t const *entry) { return uint32_t(entry[byte]); };
+            uint64_t counts[256] = {};
+            for (uint64_t i = 0; i < count; ++i) ++counts[data[i * len_ + byte]];
+
+            // Nothing to move if all entries share this byte
+            if (counts[data[byte]] == count) {
+                SortRange(data, count, byte + 1);
+                return;
+            }
+
+            uint64_t ends[256];
+            uint64_t total = 0;
+            for (uint32_t d = 0; d < 256; ++d) {
+                total += counts[d];
+                ends[d] = total;
+            }
+            uint64_t next[256];
+            Permute(data, 256, counts, ends, next, digit);
+
+            for (uint32_t d = 0; d < 256; ++d) {
+                SortRange(data + (ends[d] - counts[d]) * len_, counts[d], byte + 1);
+            }
+        }
+
+        void InsertionSort(uint8_t *data, uint64_t const count, uint32_t const byte) const
+        {
+            uint8_t held[kLen ? kLen : 256];
+            std::unique_ptr<uint8_t[]> large;
+            uint8_t *held_ptr = held;
+            if (!kLen && len_ > 256) {
+                large.reset(new uint8_t[len_]);
+                held_ptr = large.get();
+            }
+            uint32_t const cmp_len = len_ - byte;
+
+            for (uint64_t i = 1; i < count; ++i) {
+                uint8_t *const entry = data + i * len_;
+                if (memcmp(entry - len_ + byte, entry + byte, cmp_len) <= 0) continue;
+                memcpy(held_ptr, entry, len_);
+                uint64_t j = i;
+                while (j > 0 && memcmp(data + (j - 1) * len_ + byte, held_ptr + byte, cmp_len) > 0) {
+                    memcpy(data + j * len_, data + (j - 1) * len_, len_);
+                    --j;
+                }
+                memcpy(data + j * len_, held_ptr, len_);
+            }
+        }
+    };
+
+    inline void Sort(
+        uint8_t *const memory,
+        uint32_t const entry_len,
+        uint64_t const num_entries,
+        uint32_t const bits_begin,
+        uint32_t const num_threads = 1,
+        ThreadPool *const pool = nullptr)
+    {
+        // Entry sizes of the sorts in phases 2 and 3, for k 32 and nearby
+        switch (entry_len) {
+            case 8:
+                return Sorter<8>(memory, entry_len, num_entries, bits_begin, pool).Sort(num_threads);
+            case 9:
+                return Sorter<9>(memory, entry_len, num_entries, bits_begin, pool).Sort(num_threads);
+            case 10:
+                return Sorter<10>(memory, entry_len, num_entries, bits_begin, pool).Sort(num_threads);
+            case 12:
+                return Sorter<12>(memory, entry_len, num_entries, bits_begin, pool).Sort(num_threads);
+            default:
+                return Sorter<0>(memory, entry_len, num_entries, bits_begin, pool).Sort(num_threads);
+        }
+    }
+}
+
+#endif  // SRC_CPP_RADIXSORT_HPP_
@@ -17,15 +17,23 @@
 
 #include <algorithm>
 #include <fstream>
+#include <atomic>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <filesystem>
 
 #include "./bits.hpp"
+#include "./bucket_codec.hpp"
 #include "./calculate_bucket.hpp"
 #include "./disk.hpp"
+#include "./memory_arena.hpp"
 #include "./quicksort.hpp"
+#include "./radixsort.hpp"
+#include "./temp_dirs.hpp"
 #include "./uniformsort.hpp"
 #include "disk.hpp"
 #include "exceptions.hpp"
@@ -41,6 +49,10 @@ enum class strategy_t : uint8_t
     // really poorly on data that isn't actually uniformly distributed. The last
     // buckets are often not uniformly distributed.
     quicksort_last,
+
+    // in-place radix sort, using num_threads threads. It needs no more memory
+    // than quicksort and doesn't depend on the data being uniform
+    radix,
 };
 
 class SortManager : public Disk {
@@ -50,11 +62,15 @@ public:
         uint32_t const num_buckets,
         uint32_t const log_num_buckets,
         uint16_t const entry_size,
-        const std::string &tmp_dirname,
+        TempDirs const &tmp_dirs,
         const std::string &filename,
         uint32_t begin_bits,
         uint64_t const stripe_size,
-        strategy_t const sort_strategy = strategy_t::uniform)
+        strategy_t const sort_strategy = strategy_t::uniform,
+        disk_mode_t const disk_mode = disk_mode_t::file,
+        uint32_t const num_threads = 1,
+        bucket_codec_t const codec = bucket_codec_t::none,
+        ThreadPool *const pool = nullptr)
         : memory_size_(memory_size)
         , entry_size_(entry_size)
         , begin_bits_(begin_bits)
@@ -64,22 +80,41 @@ public:
         // 7 bytes head-room for SliceInt64FromBytes()
         , entry_buf_(new uint8_t[entry_size + 7])
         , strategy_(sort_strategy)
+        , num_threads_(num_threads)
+        , bucket_locks_(new std::mutex[num_buckets])
+        , codec_(codec)
+        , pool_(pool)
     {
+        if (codec_ != bucket_codec_t::none && entry_size_ > BucketCodec::kMaxEntryLen) {
+            throw InvalidValueException(
+                "Entries of " + std::to_string(entry_size_) + " bytes are too large to encode");
+        }
+
         // Cross platform way to concatenate paths, gulrak library.
         std::vector<fs::path> bucket_filenames = std::vector<fs::path>();
 
+        // The buffers of the buckets are sized for the device, but together
+        // they use no more than an eighth of the memory, unless that's less
+        // than read_ahead each
+        uint64_t const max_buffer_size = std::max(
+            read_ahead, memory_size / num_buckets / 8 / kDirectAlignment * kDirectAlignment);
+        // Encoded buckets collect a block of entries before it's written,
+        // which takes as much memory as the write buffer of the bucket
+        block_entries_ = std::max(max_buffer_size / 2 / entry_size_, uint64_t(1));
+
         buckets_.reserve(num_buckets);
         for (size_t bucket_i = 0; bucket_i < num_buckets; bucket_i++) {
             std::ostringstream bucket_number_padded;
             bucket_number_padded << std::internal << std::setfill('0') << std::setw(3) << bucket_i;
 
             fs::path const bucket_filename =
-                fs::path(tmp_dirname) /
+                tmp_dirs.Dir(bucket_i) /
                 fs::path(filename + ".sort_bucket_" + bucket_number_padded.str() + ".tmp");
             fs::remove(bucket_filename);
 
-            buckets_.emplace_back(
-                FileDisk(bucket_filename));
+            FileDisk disk(bucket_filename, disk_mode);
+            uint64_t const buffer_size = std::min(disk.BufferSize(), max_buffer_size);
+            buckets_.emplace_back(std::move(disk), buffer_size);
         }
     }
 
@@ -94,13 +129,74 @@ public:
         if (this->done) {
             throw InvalidValueException("Already finished.");
         }
-        uint64_t const bucket_index =
-            Util::ExtractNum(entry, entry_size_, begin_bits_, log_num_buckets_);
-        bucket_t& b = buckets_[bucket_index];
-        b.file.Write(b.write_pointer, entry, entry_size_);
-        b.write_pointer += entry_size_;
+        uint64_t const bucket_index = BucketIndex(entry);
+        Append(buckets_[bucket_index], entry, 1);
+    }
+
+    // Appends count entries, stored back to back, like count calls to
+    // AddToCache(entry) would. The entries are counted per bucket first, then
+    // scattered into one run per bucket, so each bucket gets a single write.
+    // Like AddToCache(entry), this is for a single producer, concurrent ones
+    // should use a BucketWriter each.
+    void AddToCache(const uint8_t *entries, uint64_t const count)
+    {
+        if (this->done) {
+            throw InvalidValueException("Already finished.");
+        }
+        uint32_t const num_buckets = buckets_.size();
+        if (scatter_capacity_ < count) {
+            scatter_buf_.reset(new uint8_t[count * entry_size_]);
+            scatter_bucket_.reset(new uint32_t[count]);
+            scatter_capacity_ = count;
+        }
+        scatter_offsets_.assign(num_buckets + 1, 0);
+
+        for (uint64_t i = 0; i < count; ++i) {
+            uint32_t const bucket_index = BucketIndex(entries + i * entry_size_);
+            scatter_bucket_[i] = bucket_index;
+            ++scatter_offsets_[bucket_index + 1];
+        }
+        for (uint32_t i = 0; i < num_buckets; ++i) {
+            scatter_offsets_[i + 1] += scatter_offsets_[i];
+        }
+        // Afterwards, scatter_offsets_[i] is where the run of bucket i ends,
+        // which is also where the run of bucket i + 1 begins
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t const slot = scatter_offsets_[scatter_bucket_[i]]++;
+            memcpy(scatter_buf_.get() + slot * entry_size_, entries + i * entry_size_, entry_size_);
+        }
+
+        uint64_t begin = 0;
+        for (uint32_t i = 0; i < num_buckets; ++i) {
+            uint64_t const end = scatter_offsets_[i];
+            if (end == begin) continue;
+            Append(buckets_[i], scatter_buf_.get() + begin * entry_size_, end - begin);
+            begin = end;
+        }
+    }
+
+    // Appends count entries, which must all belong to bucket_index, to that
+    // bucket. This may be called concurrently from multiple threads, writers
+    // only contend when they append to the same bucket.
+    void AddToBucket(uint64_t const bucket_index, const uint8_t *entries, uint64_t const count)
+    {
+        if (this->done) {
+            throw InvalidValueException("Already finished.");
+        }
+        assert(bucket_index < buckets_.size());
+        std::lock_guard<std::mutex> l(bucket_locks_[bucket_index]);
+        Append(buckets_[bucket_index], entries, count);
+    }
+
+    uint64_t BucketIndex(const uint8_t *entry) const
+    {
+        return Util::ExtractNum(entry, entry_size_, begin_bits_, log_num_buckets_);
     }
 
+    uint32_t NumBuckets() const { return buckets_.size(); }
+
+    uint16_t EntrySize() const { return entry_size_; }
+
     uint8_t const* Read(uint64_t begin, uint64_t length) override
     {
         assert(length <= entry_size_);
@@ -131,7 +227,10 @@ public:
 
     void FreeMemory() override
     {
+        CancelPrefetch();
         for (auto& b : buckets_) {
+            FlushBlock(b);
+            b.block.reset();
             b.file.FreeMemory();
             // the underlying file will be re-opened again on-demand
             b.underlying_file.Close();
@@ -139,8 +238,6 @@ public:
         prev_bucket_buf_.reset();
         memory_start_.reset();
         final_position_end = 0;
-        // TODO: Ideally, bucket files should be deleted as we read them (in the
-        // last reading pass over them)
     }
 
     uint8_t *ReadEntry(uint64_t position)
@@ -164,7 +261,7 @@ public:
             throw InvalidValueException("Position too small");
         }
         assert(memory_start_);
-        return memory_start_.get() + (position - this->final_position_start);
+        return memory_start_.get() + bucket_offset_ + (position - this->final_position_start);
     }
 
     bool CloseToNewBucket(uint64_t position) const
@@ -195,7 +292,7 @@ public:
             memset(prev_bucket_buf_.get(), 0x00, this->prev_bucket_buf_size);
             memcpy(
                 prev_bucket_buf_.get(),
-                memory_start_.get() + position - this->final_position_start,
+                memory_start_.get() + bucket_offset_ + position - this->final_position_start,
                 cache_size);
         }
 
@@ -205,7 +302,10 @@ public:
 
     void FlushCache()
     {
+        CancelPrefetch();
         for (auto& b : buckets_) {
+            FlushBlock(b);
+            b.block.reset();
             b.file.FlushCache();
         }
         final_position_end = 0;
@@ -214,11 +314,10 @@ public:
 
     ~SortManager()
     {
+        CancelPrefetch();
         // Close and delete files in case we exit without doing the sort
         for (auto& b : buckets_) {
-            std::string const filename = b.file.GetFileName();
-            b.underlying_file.Close();
-            fs::remove(fs::path(filename));
+            b.underlying_file.Remove();
         }
     }
 
@@ -226,18 +325,37 @@ private:
 
     struct bucket_t
     {
-        bucket_t(FileDisk f) : underlying_file(std::move(f)), file(&underlying_file, 0) {}
+        bucket_t(FileDisk f, uint64_t const buffer_size)
+            : underlying_file(std::move(f)), file(&underlying_file, 0, buffer_size)
+        {
+        }
 
         // The amount of data written to the disk bucket
         uint64_t write_pointer = 0;
+        // The size of the file, less than write_pointer when it's encoded
+        uint64_t file_pointer = 0;
+
+        // Entries waiting to be encoded, see Append()
+        std::unique_ptr<uint8_t[]> block;
+        uint64_t block_count = 0;
 
         // The file for the bucket
         FileDisk underlying_file;
         BufferedDisk file;
     };
 
-    // The buffer we use to sort buckets in-memory
-    std::unique_ptr<uint8_t[]> memory_start_;
+    // The buffer we use to sort buckets in-memory. The bucket being read
+    // starts at bucket_offset_, the next one is sorted into the space left
+    // around it, starting at prefetch_offset_
+    MemoryArena::buffer memory_start_;
+    uint64_t bucket_offset_ = 0;
+    uint64_t prefetch_offset_ = 0;
+    // Set while the next bucket is being sorted in the background, on pool_
+    ThreadPool::Task prefetch_;
+    // Makes a prefetch that hasn't started yet skip the sort
+    std::atomic<bool> prefetch_cancelled_{false};
+    // What the background sort logs, printed once the bucket is read
+    std::ostringstream prefetch_log_;
     // Size of the whole memory array
     uint64_t memory_size_;
     // Size of each entry
@@ -260,23 +378,149 @@ private:
     uint64_t next_bucket_to_sort = 0;
     std::unique_ptr<uint8_t[]> entry_buf_;
     strategy_t strategy_;
+    uint32_t num_threads_;
+    // One lock per bucket, taken by AddToBucket()
+    std::unique_ptr<std::mutex[]> bucket_locks_;
+    // Scratch space of the bulk AddToCache(), for scatter_capacity_ entries
+    std::unique_ptr<uint8_t[]> scatter_buf_;
+    std::unique_ptr<uint32_t[]> scatter_bucket_;
+    uint64_t scatter_capacity_ = 0;
+    std::vector<uint64_t> scatter_offsets_;
+    bucket_codec_t codec_;
+    // Where the radix sort runs its threads, if set
+    ThreadPool *pool_;
+    // Number of entries encoded together
+    uint64_t block_entries_;
+
+    // Appends count entries to bucket b. With a codec, they are collected
+    // into blocks, which are encoded once full.
+    void Append(bucket_t& b, const uint8_t* entries, uint64_t const count)
+    {
+        uint64_t const length = count * entry_size_;
+        b.write_pointer += length;
+        if (codec_ == bucket_codec_t::none) {
+            b.file.Write(b.file_pointer, entries, length);
+            b.file_pointer += length;
+            return;
+        }
+        if (!b.block) b.block.reset(new uint8_t[block_entries_ * entry_size_]);
+        for (uint64_t i = 0; i < count;) {
+            uint64_t const n = std::min(count - i, block_entries_ - b.block_count);
+            memcpy(
+                b.block.get() + b.block_count * entry_size_,
+                entries + i * entry_size_,
+                n * entry_size_);
+            b.block_count += n;
+            i += n;
+            if (b.block_count == block_entries_) FlushBlock(b);
+        }
+    }
+
+    void FlushBlock(bucket_t& b)
+    {
+        if (b.block_count == 0) return;
+        b.file_pointer += BucketCodec::EncodeBlock(
+            b.file, b.file_pointer, b.block.get(), b.block_count, entry_size_);
+        b.block_count = 0;
+    }
+
+    // Reads all entries of bucket b into memory
+    void ReadBucket(bucket_t& b, uint8_t* const memory)
+    {
+        if (codec_ == bucket_codec_t::none) {
+            b.underlying_file.Read(0, memory, b.write_pointer);
+        } else {
+            BucketCodec::Decoder(b.underlying_file, b.file_pointer, entry_size_)
+                .Read(0, memory, b.write_pointer);
+        }
+    }
 
     void SortBucket()
     {
         if (!memory_start_) {
             // we allocate the memory to sort the bucket in lazily. It'se freed
             // in FreeMemory() or the destructor
-            memory_start_.reset(new uint8_t[memory_size_]);
+            memory_start_ = MemoryArena::Instance().Alloc(memory_size_);
         }
 
         this->done = true;
         if (next_bucket_to_sort >= buckets_.size()) {
             throw InvalidValueException("Trying to sort bucket which does not exist.");
         }
-        uint64_t const bucket_i = this->next_bucket_to_sort;
+        bucket_t const& b = buckets_[next_bucket_to_sort];
+
+        if (prefetch_.valid()) {
+            // the background sort always works on next_bucket_to_sort
+            prefetch_.Wait();
+            std::cout << prefetch_log_.str() << std::flush;
+            prefetch_log_.str("");
+            bucket_offset_ = prefetch_offset_;
+        } else {
+            SortBucketInto(next_bucket_to_sort, memory_start_.get(), memory_size_, std::cout);
+            bucket_offset_ = 0;
+        }
+
+        this->final_position_start = this->final_position_end;
+        this->final_position_end += b.write_pointer;
+        this->next_bucket_to_sort += 1;
+
+        PrefetchNextBucket();
+    }
+
+    // Starts sorting the next bucket on a worker of pool_, while the current
+    // one is being read. It's only sorted into memory not used by the current
+    // bucket, so if neither side of it has room for at least a quicksort, or
+    // there's no pool, the next bucket is sorted synchronously instead, once
+    // the current one is done.
+    void PrefetchNextBucket()
+    {
+        if (!pool_ || next_bucket_to_sort >= buckets_.size()) return;
+
+        uint64_t const bucket_i = next_bucket_to_sort;
+        // The next bucket starts on a block boundary, so with direct I/O
+        // it's read straight into place
+        uint64_t const current_end = std::min(
+            (bucket_offset_ + (this->final_position_end - this->final_position_start) +
+             kDirectAlignment - 1) / kDirectAlignment * kDirectAlignment,
+            memory_size_);
+        uint64_t const space_before = bucket_offset_;
+        uint64_t const space_after = memory_size_ - current_end;
+
+        uint64_t const space = std::max(space_before, space_after);
+        if (buckets_[bucket_i].write_pointer > space) return;
+
+        prefetch_offset_ = (space_after >= space_before) ? current_end : 0;
+        uint8_t* const memory = memory_start_.get() + prefetch_offset_;
+        prefetch_cancelled_ = false;
+        prefetch_ = pool_->Submit([this, bucket_i, memory, space] {
+            if (prefetch_cancelled_) return;
+            SortBucketInto(bucket_i, memory, space, prefetch_log_);
+        });
+    }
+
+    void CancelPrefetch()
+    {
+        if (!prefetch_.valid()) return;
+        prefetch_cancelled_ = true;
+        try {
+            prefetch_.Wait();
+        } catch (...) {
+            // the bucket is sorted again by the next SortBucket(), if any
+        }
+        prefetch_log_.str("");
+    }
+
+    // Reads bucket_i from disk and sorts it into memory, using at most
+    // memory_size bytes of it. The sorted entries always start at memory.
+    void SortBucketInto(
+        uint64_t const bucket_i,
+        uint8_t* const memory,
+        uint64_t const memory_size,
+        std::ostream& log)
+    {
         bucket_t& b = buckets_[bucket_i];
         uint64_t const bucket_entries = b.write_pointer / entry_size_;
-        uint64_t const entries_fit_in_memory = this->memory_size_ / entry_size_;
+        uint64_t const entries_fit_in_memory = memory_size / entry_size_;
 
         double const have_ram = entry_size_ * entries_fit_in_memory / (1024.0 * 1024.0 * 1024.0);
         double const qs_ram = entry_size_ * bucket_entries / (1024.0 * 1024.0 * 1024.0);
@@ -295,41 +539,106 @@ private:
         bool const force_quicksort = (strategy_ == strategy_t::quicksort)
             || (strategy_ == strategy_t::quicksort_last && last_bucket);
 
-        // Do SortInMemory algorithm if it fits in the memory
-        // (number of entries required * entry_size_) <= total memory available
-        if (!force_quicksort &&
-            Util::RoundSize(bucket_entries) * entry_size_ <= memory_size_) {
-            std::cout << "\tBucket " << bucket_i << " uniform sort. Ram: " << std::fixed
-                      << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
-                      << "GiB, qs min: " << qs_ram << "GiB." << std::endl;
-            UniformSort::SortToMemory(
-                b.underlying_file,
-                0,
-                memory_start_.get(),
+        if (strategy_ == strategy_t::radix) {
+            log << "\tBucket " << bucket_i << " radix sort. Ram: " << std::fixed
+                << std::setprecision(3) << have_ram << "GiB, qs min: " << qs_ram
+                << "GiB." << std::endl;
+            ReadBucket(b, memory);
+            RadixSort::Sort(
+                memory,
                 entry_size_,
                 bucket_entries,
-                begin_bits_ + log_num_buckets_);
+                begin_bits_ + log_num_buckets_,
+                num_threads_,
+                pool_);
+        } else if (!force_quicksort &&
+            Util::RoundSize(bucket_entries) * entry_size_ <= memory_size) {
+            // Do SortInMemory algorithm if it fits in the memory
+            // (number of entries required * entry_size_) <= total memory available
+            log << "\tBucket " << bucket_i << " uniform sort. Ram: " << std::fixed
+                << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
+                << "GiB, qs min: " << qs_ram << "GiB." << std::endl;
+            if (codec_ == bucket_codec_t::none) {
+                UniformSort::SortToMemory(
+                    b.underlying_file,
+                    0,
+                    memory,
+                    entry_size_,
+                    bucket_entries,
+                    begin_bits_ + log_num_buckets_);
+            } else {
+                BucketCodec::Decoder decoder(b.underlying_file, b.file_pointer, entry_size_);
+                UniformSort::SortToMemory(
+                    decoder, 0, memory, entry_size_, bucket_entries, begin_bits_ + log_num_buckets_);
+            }
         } else {
             // Are we in Compress phrase 1 (quicksort=1) or is it the last bucket (quicksort=2)?
             // Perform quicksort if so (SortInMemory algorithm won't always perform well), or if we
             // don't have enough memory for uniform sort
-            std::cout << "\tBucket " << bucket_i << " QS. Ram: " << std::fixed
-                      << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
-                      << "GiB, qs min: " << qs_ram << "GiB. force_qs: " << force_quicksort
-                      << std::endl;
-            b.underlying_file.Read(0, memory_start_.get(), bucket_entries * entry_size_);
-            QuickSort::Sort(memory_start_.get(), entry_size_, bucket_entries, begin_bits_ + log_num_buckets_);
+            log << "\tBucket " << bucket_i << " QS. Ram: " << std::fixed
+                << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
+                << "GiB, qs min: " << qs_ram << "GiB. force_qs: " << force_quicksort
+                << std::endl;
+            ReadBucket(b, memory);
+            QuickSort::Sort(memory, entry_size_, bucket_entries, begin_bits_ + log_num_buckets_);
         }
 
         // Deletes the bucket file
-        std::string filename = b.file.GetFileName();
-        b.underlying_file.Close();
-        fs::remove(fs::path(filename));
+        b.underlying_file.Remove();
+    }
+};
 
-        this->final_position_start = this->final_position_end;
-        this->final_position_end += b.write_pointer;
-        this->next_bucket_to_sort += 1;
+// Stages the entries of one producer per bucket, and appends whole runs to
+// the buckets with SortManager::AddToBucket(). Any number of producers can
+// feed the same SortManager this way, they only contend when they append to
+// the same bucket. Flush() must be called once the producer is done.
+class BucketWriter {
+public:
+    BucketWriter(SortManager &sort_manager, uint64_t const staging_bytes)
+        : sort_manager_(sort_manager)
+        , entry_size_(sort_manager.EntrySize())
+        , staging_entries_(std::max(
+              staging_bytes / sort_manager.NumBuckets() / sort_manager.EntrySize(), uint64_t(1)))
+        , staging_buf_(new uint8_t[sort_manager.NumBuckets() * staging_entries_ * entry_size_])
+        , staging_count_(sort_manager.NumBuckets(), 0)
+    {
+    }
+
+    void Add(const uint8_t *entry)
+    {
+        uint64_t const bucket = sort_manager_.BucketIndex(entry);
+        uint8_t *bucket_buf = staging_buf_.get() + bucket * staging_entries_ * entry_size_;
+        memcpy(bucket_buf + staging_count_[bucket] * entry_size_, entry, entry_size_);
+        if (++staging_count_[bucket] == staging_entries_) {
+            sort_manager_.AddToBucket(bucket, bucket_buf, staging_entries_);
+            staging_count_[bucket] = 0;
+        }
+    }
+
+    void Add(const uint8_t *entries, uint64_t const count)
+    {
+        for (uint64_t i = 0; i < count; ++i) Add(entries + i * entry_size_);
+    }
+
+    // Writes out whatever is left
+    void Flush()
+    {
+        for (uint32_t bucket = 0; bucket < staging_count_.size(); bucket++) {
+            if (staging_count_[bucket] == 0) continue;
+            sort_manager_.AddToBucket(
+                bucket,
+                staging_buf_.get() + bucket * staging_entries_ * entry_size_,
+                staging_count_[bucket]);
+            staging_count_[bucket] = 0;
+        }
     }
+
+private:
+    SortManager &sort_manager_;
+    uint32_t const entry_size_;
+    uint64_t const staging_entries_;
+    std::unique_ptr<uint8_t[]> staging_buf_;
+    std::vector<uint64_t> staging_count_;
 };
 
 #endif  // SRC_CPP_FAST_SORT_ON_DISK_HPP_
@@ -0,0 +1,127 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_TEMP_DIRS_HPP_
+#define SRC_CPP_TEMP_DIRS_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include "disk.hpp"
+#include "exceptions.hpp"
+
+// The temp directories that temp files and sort buckets are spread over, so
+// a plot can use the bandwidth of several drives. The n-th file goes to
+// Dir(n), which is round-robin, or weighted by the throughput of the
+// directories once MeasureThroughput() was called.
+class TempDirs {
+public:
+    TempDirs(std::string const &dir) : TempDirs(std::vector<std::string>{dir}) {}
+    TempDirs(char const *dir) : TempDirs(std::string(dir)) {}
+
+    explicit TempDirs(std::vector<std::string> const &dirs)
+    {
+        if (dirs.empty()) {
+            throw InvalidValueException("No temp directory");
+        }
+        for (auto const &dir : dirs) dirs_.emplace_back(dir);
+        weights_.assign(dirs_.size(), 1.0);
+    }
+
+    fs::path const &Dir(uint64_t const n) const
+    {
+        if (dirs_.size() == 1) return dirs_[0];
+        // Smooth weighted round-robin, every step each directory gains its
+        // weight, and the one with the most pays for the file. This spreads
+        // the files of a directory evenly over the sequence.
+        double const total = std::accumulate(weights_.begin(), weights_.end(), 0.0);
+        std::vector<double> credit(dirs_.size(), 0.0);
+        size_t pick = 0;
+        for (uint64_t i = 0; i <= n; ++i) {
+            for (size_t d = 0; d < dirs_.size(); ++d) credit[d] += weights_[d];
+            pick = std::max_element(credit.begin(), credit.end()) - credit.begin();
+            credit[pick] -= total;
+        }
+        return dirs_[pick];
+    }
+
+    std::vector<fs::path> const &Dirs() const { return dirs_; }
+
+    std::vector<double> const &Weights() const { return weights_; }
+
+    void SetWeights(std::vector<double> weights)
+    {
+        if (weights.size() != dirs_.size() ||
+            std::any_of(weights.begin(), weights.end(), [](double w) { return !(w > 0); })) {
+            throw InvalidValueException("Need a positive weight for each temp directory");
+        }
+        weights_ = std::move(weights);
+    }
+
+    // Weights the directories by how fast they write and read back a test
+    // file, with direct I/O where it's supported
+    void MeasureThroughput(uint64_t const test_size = kTestSize)
+    {
+        if (dirs_.size() == 1) return;
+        std::vector<double> weights;
+        aligned_buffer buffer = AllocAligned(kTestChunk);
+        std::fill(buffer.get(), buffer.get() + kTestChunk, 0x5a);
+        for (auto const &dir : dirs_) {
+            fs::path const filename = dir / "throughput-test.tmp";
+            auto const start = std::chrono::steady_clock::now();
+            {
+                FileDisk disk(filename, disk_mode_t::direct);
+                for (uint64_t offset = 0; offset < test_size; offset += kTestChunk) {
+                    disk.Write(offset, buffer.get(), kTestChunk);
+                }
+                for (uint64_t offset = 0; offset < test_size; offset += kTestChunk) {
+                    disk.Read(offset, buffer.get(), kTestChunk);
+                }
+                disk.Remove();
+            }
+            double const seconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double const mib_per_second = 2.0 * test_size / (1024 * 1024) / seconds;
+            std::cout << "Temp directory " << dir << ": " << std::fixed << std::setprecision(0)
+                      << mib_per_second << " MiB/s" << std::endl;
+            weights.push_back(std::max(mib_per_second, 1.0));
+        }
+        SetWeights(std::move(weights));
+    }
+
+    std::string ToString() const
+    {
+        std::string result;
+        for (auto const &dir : dirs_) {
+            if (!result.empty()) result += ", ";
+            result += dir.string();
+        }
+        return result;
+    }
+
+private:
+    static constexpr uint64_t kTestSize = 256 * 1024 * 1024;
+    static constexpr uint64_t kTestChunk = 4 * 1024 * 1024;
+
+    std::vector<fs::path> dirs_;
+    std::vector<double> weights_;
+};
+
+#endif  // SRC_CPP_TEMP_DIRS_HPP_
@@ -5,64 +5,413 @@
 #ifndef CHIAPOS_THREADING_HPP
 #define CHIAPOS_THREADING_HPP
 
-#ifdef _WIN32
-#define WIN32_LEAN_AND_MEAN
-#define VC_EXTRALEAN
-#define STRICT
-#include <windows.h>
-#elif __APPLE__
-#include <unistd.h>
-#include <dispatch/dispatch.h>
-#else
-#include <unistd.h>
-#include <semaphore.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
 #endif
 
-// TODO: in C++20, this can be replaced with std::binary_semaphore
-namespace Sem {
-#ifdef _WIN32
-    using type = HANDLE;
-    inline void Wait(HANDLE* semaphore) { WaitForSingleObject(*semaphore, INFINITE); }
-    inline void Post(HANDLE* semaphore) { ReleaseSemaphore(*semaphore, 1, NULL); }
-    inline HANDLE Create() {
-        return CreateSemaphore(
-            nullptr,   // default security attributes
-            0,      // initial count
-            2,      // maximum count
-            nullptr);  // unnamed semaphore
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "exceptions.hpp"
+
+// Parses a list of CPUs like "0-3,8,10-11", the format of taskset and of
+// /sys/devices/system/node/node*/cpulist
+inline std::vector<int> ParseCpuList(std::string const& list)
+{
+    std::vector<int> cpus;
+    std::stringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        range.erase(0, range.find_first_not_of(" \t\n"));
+        range.erase(range.find_last_not_of(" \t\n") + 1);
+        if (range.empty()) continue;
+        size_t const dash = range.find('-');
+        try {
+            int const first = std::stoi(range.substr(0, dash));
+            int const last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            if (first < 0 || last < first) throw std::invalid_argument(range);
+            for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        } catch (std::logic_error const&) {
+            throw InvalidValueException("Invalid CPU list: " + list);
+        }
     }
-    inline void Destroy(HANDLE sem) {
-        CloseHandle(sem);
+    return cpus;
+}
+
+// The CPUs of a NUMA node, or none if that's not known
+inline std::vector<int> NumaNodeCpus(int const node)
+{
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!std::getline(file, list)) return {};
+    return ParseCpuList(list);
+}
+
+#ifdef __linux__
+// Restricts a thread to the CPUs of set, warns if that's not possible
+inline bool SetThreadAffinity(pthread_t const thread, cpu_set_t const& set, int const cpu)
+{
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) == 0) return true;
+    std::cout << "Can't pin a thread to CPU " << cpu << std::endl;
+    return false;
+}
+#endif
+
+// Pins the thread that creates it to a CPU, until it's destroyed, which
+// restores the CPUs the thread could run on before. Elsewhere than on Linux,
+// the thread isn't pinned.
+class CpuPin {
+public:
+    explicit CpuPin(int const cpu)
+    {
+#ifdef __linux__
+        if (pthread_getaffinity_np(pthread_self(), sizeof(previous_), &previous_) != 0) return;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pinned_ = SetThreadAffinity(pthread_self(), set, cpu);
+#endif
+    }
+
+    ~CpuPin()
+    {
+#ifdef __linux__
+        if (pinned_) pthread_setaffinity_np(pthread_self(), sizeof(previous_), &previous_);
+#endif
+    }
+
+    CpuPin(CpuPin const&) = delete;
+    CpuPin& operator=(CpuPin const&) = delete;
+
+private:
+#ifdef __linux__
+    cpu_set_t previous_;
+#endif
+    bool pinned_ = false;
+};
+
+// The threads the plotting phases run their parallel work on. The workers
+// are started once, and optionally pinned to CPUs, so concurrent plots can
+// each be given their own cores. The thread calling Run() runs tasks too, it
+// is one of the threads of the pool.
+class ThreadPool {
+    struct Batch;
+
+public:
+    // Starts num_threads - 1 workers. They're pinned to cpus round-robin,
+    // starting with the second, or not at all if it's empty. The first is
+    // for the thread calling Run(), see CpuPin.
+    explicit ThreadPool(uint32_t const num_threads, std::vector<int> cpus = {})
+        : cpus_(std::move(cpus))
+    {
+        for (uint32_t i = 1; i < std::max(num_threads, 1U); i++) {
+            workers_.emplace_back([this] { WorkerThread(); });
+#ifdef __linux__
+            if (!cpus_.empty()) {
+                int const cpu = cpus_[i % cpus_.size()];
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                SetThreadAffinity(workers_.back().native_handle(), set, cpu);
+            }
+#endif
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : workers_) t.join();
+    }
+
+    // The number of threads that run tasks, including the one calling Run()
+    uint32_t size() const { return workers_.size() + 1; }
+
+    std::vector<int> const& Cpus() const { return cpus_; }
+
+    // Runs func(0) to func(n - 1) concurrently, and returns once all have
+    // finished. The calling thread runs the tasks no worker has picked up
+    // yet, so this makes progress even when all workers are busy, like when
+    // it's called from a task. The first exception a task throws is
+    // rethrown here.
+    void Run(uint32_t const n, std::function<void(uint32_t)> const& func)
+    {
+        if (n == 0) return;
+        auto batch = std::make_shared<Batch>(func, n);
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            for (uint32_t i = 1; i < std::min(n, size()); i++) queue_.push_back(batch);
+        }
+        cv_.notify_all();
+
+        batch->Wait();
+    }
+
+    // A function Submit() started in the background
+    class Task {
+    public:
+        Task() = default;
+
+        bool valid() const { return batch_ != nullptr; }
+
+        // Returns once the function has run. If no worker has picked it up
+        // yet, it runs on the calling thread, so waiting can't get stuck
+        // behind tasks that wait for this one. Rethrows its exception.
+        void Wait()
+        {
+            auto batch = std::move(batch_);
+            batch->Wait();
+        }
+
+    private:
+        friend class ThreadPool;
+        explicit Task(std::shared_ptr<Batch> batch) : batch_(std::move(batch)) {}
+
+        std::shared_ptr<Batch> batch_;
+    };
+
+    // Queues func for the first idle worker and returns right away. Without
+    // workers, it runs in Task::Wait().
+    Task Submit(std::function<void()> const& func)
+    {
+        auto batch = std::make_shared<Batch>([func](uint32_t) { func(); }, 1);
+        if (!workers_.empty()) {
+            {
+                std::lock_guard<std::mutex> l(mutex_);
+                queue_.push_back(batch);
+            }
+            cv_.notify_one();
+        }
+        return Task(std::move(batch));
     }
-#elif __APPLE__
-    using type = dispatch_semaphore_t;
-    inline void Wait(dispatch_semaphore_t *semaphore) {
-        dispatch_semaphore_wait(*semaphore, DISPATCH_TIME_FOREVER);
+
+private:
+    struct Batch {
+        Batch(std::function<void(uint32_t)> const& f, uint32_t const count) : func(f), n(count) {}
+
+        // Runs tasks until there are none left to claim
+        void Work()
+        {
+            for (uint32_t i = next++; i < n; i = next++) {
+                std::exception_ptr e;
+                try {
+                    func(i);
+                } catch (...) {
+                    e = std::current_exception();
+                }
+                std::lock_guard<std::mutex> l(mutex);
+                if (e && !error) error = e;
+                if (++finished == n) cv.notify_all();
+            }
+        }
+
+        // Helps with the tasks left, waits for the others to finish them, and
+        // rethrows the first exception
+        void Wait()
+        {
+            Work();
+            std::unique_lock<std::mutex> l(mutex);
+            cv.wait(l, [this] { return finished == n; });
+            if (error) std::rethrow_exception(error);
+        }
+
+        std::function<void(uint32_t)> const func;
+        uint32_t const n;
+        std::atomic<uint32_t> next{0};
+
+        // Guards everything below
+        std::mutex mutex;
+        std::condition_variable cv;
+        uint32_t finished = 0;
+        std::exception_ptr error;
+    };
+
+    std::vector<int> const cpus_;
+    std::vector<std::thread> workers_;
+
+    // Guards everything below
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    // A batch is queued once for every worker that may help with it
+    std::deque<std::shared_ptr<Batch>> queue_;
+    bool stop_ = false;
+
+    void WorkerThread()
+    {
+        for (;;) {
+            std::shared_ptr<Batch> batch;
+            {
+                std::unique_lock<std::mutex> l(mutex_);
+                cv_.wait(l, [this] { return stop_ || !queue_.empty(); });
+                if (queue_.empty()) return;
+                batch = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            batch->Work();
+        }
     }
-    inline void Post(dispatch_semaphore_t *semaphore) {
-        dispatch_semaphore_signal(*semaphore);
+};
+
+// Hands out the stripes of a table to worker threads dynamically, and commits
+// their output in stripe order.
+//
+// Stripes are claimed in increasing order, so a thread that finishes early
+// just takes the next one, instead of waiting for its turn. The output of a
+// stripe that finishes before the ones preceding it is parked in a reorder
+// buffer, and the thread that finishes the oldest outstanding stripe commits
+// every stripe that is ready. Output buffers come from a fixed pool, which
+// bounds how far ahead of the oldest stripe the threads can get.
+template <typename Output>
+class StripeScheduler {
+public:
+    StripeScheduler(
+        uint64_t num_stripes,
+        uint32_t num_buffers,
+        std::function<std::unique_ptr<Output>()> const& make_buffer,
+        std::function<void(Output&)> commit)
+        : num_stripes_(num_stripes), commit_(std::move(commit))
+    {
+        for (uint32_t i = 0; i < num_buffers; i++) {
+            pool_.push_back(make_buffer());
+        }
     }
-    inline dispatch_semaphore_t Create() {
-        return dispatch_semaphore_create(0);
+
+    // Claims the next stripe, and returns an output buffer for it, or nullptr once
+    // all stripes have been claimed. start(stripe) is called before the next stripe
+    // can be claimed, so claims can do work that has to happen in stripe order.
+    std::unique_ptr<Output> Claim(uint64_t& stripe, std::function<void(uint64_t)> const& start)
+    {
+        // The buffer is taken before the stripe, so the oldest outstanding stripe
+        // always has one
+        std::unique_ptr<Output> out;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return aborted_ || !pool_.empty(); });
+            if (aborted_) return nullptr;
+            out = std::move(pool_.back());
+            pool_.pop_back();
+        }
+
+        std::lock_guard<std::mutex> claim_lock(claim_mutex_);
+        if (next_stripe_ >= num_stripes_ || Aborted()) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pool_.push_back(std::move(out));
+            cv_.notify_all();
+            return nullptr;
+        }
+        stripe = next_stripe_++;
+        start(stripe);
+        return out;
     }
-    inline void Destroy(dispatch_semaphore_t sem) {
-        dispatch_release(sem);
+
+    // Blocks until all the stripes before this one have been finished. Only to be
+    // called from start(), since later stripes can't be claimed in the meantime.
+    // Throws if the stripes were aborted, as some of them will never finish.
+    void WaitForStripesBefore(uint64_t stripe)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this, stripe] { return aborted_ || num_finished_ == stripe; });
+        if (aborted_) {
+            throw InvalidStateException("Stripe " + std::to_string(stripe) + " aborted");
+        }
     }
-#else
-    using type = sem_t;
-    inline void Wait(sem_t *semaphore) { sem_wait(semaphore); }
-    inline void Post(sem_t *semaphore) { sem_post(semaphore); }
-    inline sem_t Create() {
-        sem_t ret;
-        sem_init(&ret, 0, 0);
-        return ret;
+
+    // For a stripe that failed and won't be finished. Claims return nullptr from
+    // now on, and threads waiting for the stripe give up.
+    void Abort()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        aborted_ = true;
+        cv_.notify_all();
     }
-    inline void Destroy(sem_t& sem) {
-        sem_close(&sem);
+
+    // Aborts the scheduler if the scope it's in is left with an exception
+    class AbortOnException {
+    public:
+        explicit AbortOnException(StripeScheduler& scheduler)
+            : scheduler_(scheduler), exceptions_(std::uncaught_exceptions())
+        {
+        }
+
+        ~AbortOnException()
+        {
+            if (std::uncaught_exceptions() > exceptions_) scheduler_.Abort();
+        }
+
+    private:
+        StripeScheduler& scheduler_;
+        int const exceptions_;
+    };
+
+    // Hands over the output of a stripe, and commits all stripes that are ready if
+    // no other thread is doing it.
+    void Finish(uint64_t stripe, std::unique_ptr<Output> out)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.emplace(stripe, std::move(out));
+        num_finished_++;
+        cv_.notify_all();
+        if (committing_) {
+            return;
+        }
+
+        committing_ = true;
+        while (!ready_.empty() && ready_.begin()->first == next_commit_) {
+            std::unique_ptr<Output> next = std::move(ready_.begin()->second);
+            ready_.erase(ready_.begin());
+            lock.unlock();
+            commit_(*next);
+            lock.lock();
+            pool_.push_back(std::move(next));
+            next_commit_++;
+            cv_.notify_all();
+        }
+        committing_ = false;
     }
-#endif
 
+private:
+    uint64_t const num_stripes_;
+    std::function<void(Output&)> const commit_;
+
+    // Serializes claims, including their start()
+    std::mutex claim_mutex_;
+    uint64_t next_stripe_ = 0;
+
+    // Guards everything below
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::unique_ptr<Output>> pool_;
+    std::map<uint64_t, std::unique_ptr<Output>> ready_;
+    uint64_t num_finished_ = 0;
+    uint64_t next_commit_ = 0;
+    bool committing_ = false;
+    bool aborted_ = false;
+
+    bool Aborted()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return aborted_;
+    }
 };
 
-//        std::cout << ptd->index << " waited 0" << std::endl;
 #endif  // CHIAPOS_THREADING_HPP
@@ -36,8 +36,11 @@ namespace UniformSort {
         return true;
     }
 
+    // input_disk is a FileDisk, or anything else that reads entries at their
+    // offsets and has a BufferSize(), like BucketCodec::Decoder
+    template <typename Input>
     inline void SortToMemory(
-        FileDisk &input_disk,
+        Input &input_disk,
         uint64_t const input_disk_begin,
         uint8_t *const memory,
         uint32_t const entry_len,
@@ -46,7 +49,10 @@ namespace UniformSort {
     {
         uint64_t const memory_len = Util::RoundSize(num_entries) * entry_len;
         auto const swap_space = std::make_unique<uint8_t[]>(entry_len);
-        auto const buffer = std::make_unique<uint8_t[]>(BUF_SIZE);
+        // Reads are as large as the buffers of the device, so the bucket is
+        // read in few seeks
+        uint64_t const buffer_size = std::max<uint64_t>(BUF_SIZE, input_disk.BufferSize());
+        auto const buffer = std::make_unique<uint8_t[]>(buffer_size);
         uint64_t bucket_length = 0;
         // The number of buckets needed (the smallest power of 2 greater than 2 * num_entries).
         while ((1ULL << bucket_length) < 2 * num_entries) bucket_length++;
@@ -59,7 +65,7 @@ namespace UniformSort {
         for (uint64_t i = 0; i < num_entries; i++) {
             if (buf_size == 0) {
                 // If read buffer is empty, read from disk and refill it.
-                buf_size = std::min((uint64_t)BUF_SIZE / entry_len, num_entries - i);
+                buf_size = std::min(buffer_size / entry_len, num_entries - i);
                 buf_ptr = 0;
                 input_disk.Read(read_pos, buffer.get(), buf_size * entry_len);
                 read_pos += buf_size * entry_len;
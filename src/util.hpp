@@ -54,6 +54,13 @@ std::ostream &operator<<(std::ostream &strm, uint128_t const &v)
 
 #endif
 
+// With GCC and clang on x86-64, functions can be compiled for a newer instruction
+// set with __attribute__((target(...))), and called after a runtime check.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 // compiler-specific byte swap macros.
 #if defined(_MSC_VER)
 
@@ -247,6 +254,40 @@ namespace Util {
         return tmp;
     }
 
+    // ORs the low num_bits (at most 64) bits of value into the big endian bit
+    // string bytes, at start_bit. Those bits must be zero. Needs 7 bytes of
+    // head-room after the last byte that is written, like SliceInt64FromBytes().
+    inline void OrBitsIntoBytes(
+        uint8_t *bytes,
+        uint64_t start_bit,
+        uint64_t value,
+        uint32_t num_bits)
+    {
+        if (num_bits == 0) return;
+        uint64_t const aligned = value << (64 - num_bits);
+        uint32_t const shift = start_bit % 8;
+        bytes += start_bit / 8;
+        IntToEightBytes(bytes, EightBytesToInt(bytes) | (aligned >> shift));
+        if (shift + num_bits > 64) {
+            bytes[8] |= (uint8_t)(aligned << (8 - shift));
+        }
+    }
+
+    // Same as OrBitsIntoBytes(), for up to 128 bits
+    inline void OrBits128IntoBytes(
+        uint8_t *bytes,
+        uint64_t start_bit,
+        uint128_t value,
+        uint32_t num_bits)
+    {
+        if (num_bits > 64) {
+            OrBitsIntoBytes(bytes, start_bit, (uint64_t)(value >> 64), num_bits - 64);
+            OrBitsIntoBytes(bytes, start_bit + num_bits - 64, (uint64_t)value, 64);
+        } else {
+            OrBitsIntoBytes(bytes, start_bit, (uint64_t)value, num_bits);
+        }
+    }
+
     inline uint64_t SliceInt64FromBytesFull(
         const uint8_t *bytes,
         uint32_t start_bit,
@@ -361,6 +402,33 @@ namespace Util {
     }
 #endif /* defined(_WIN32) || defined(__x86_64__) */
 
+#if defined(HAVE_X86_SIMD)
+    // These also check that the OS saves the wide registers
+    inline bool HaveAVX2() { return __builtin_cpu_supports("avx2"); }
+
+    inline bool HaveAVX512()
+    {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    }
+
+    inline bool HaveAVX512Popcnt()
+    {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq");
+    }
+#endif /* defined(HAVE_X86_SIMD) */
+
+    // n must not be 0
+    inline uint32_t CountTrailingZeros(uint64_t n)
+    {
+#if defined(_MSC_VER)
+        unsigned long r;
+        _BitScanForward64(&r, n);
+        return r;
+#else
+        return __builtin_ctzll(n);
+#endif
+    }
+
     inline uint64_t PopCount(uint64_t n)
     {
 #if defined(_WIN32)
@@ -14,6 +14,7 @@
 
 #include <stdio.h>
 
+#include <atomic>
 #include <set>
 
 #include <catch2/catch_test_macros.hpp>
@@ -269,6 +270,55 @@ bool CheckMatch(int64_t yl, int64_t yr)
     return false;
 }
 
+// FindMatches() as it was before it used SIMD, the order of the matches is by left index,
+// then by m, then by right index.
+int32_t ReferenceFindMatches(
+    const vector<uint64_t>& bucket_L,
+    const vector<uint64_t>& bucket_R,
+    uint16_t* idx_L,
+    uint16_t* idx_R)
+{
+    int32_t idx_count = 0;
+    uint16_t const parity = (bucket_L[0] / kBC) % 2;
+    uint64_t const remove = (bucket_R[0] / kBC) * kBC;
+    for (size_t l = 0; l < bucket_L.size(); l++) {
+        uint64_t const r = bucket_L[l] - (remove - kBC);
+        for (uint8_t m = 0; m < kExtraBitsPow; m++) {
+            for (size_t j = 0; j < bucket_R.size(); j++) {
+                if (bucket_R[j] - remove == L_targets[parity][r][m]) {
+                    idx_L[idx_count] = l;
+                    idx_R[idx_count] = j;
+                    idx_count++;
+                }
+            }
+        }
+    }
+    return idx_count;
+}
+
+// Random sorted pair of adjacent buckets, with the average number of entries
+void RandomBucketPair(
+    std::mt19937_64& rng,
+    uint64_t bucket,
+    PlotEntryBucket& bucket_L,
+    PlotEntryBucket& bucket_R)
+{
+    bucket_L.clear();
+    bucket_R.clear();
+    for (auto [b, out] : {std::make_pair(bucket, &bucket_L), std::make_pair(bucket + 1, &bucket_R)}) {
+        vector<uint64_t> ys(kBC / kExtraBitsPow);
+        for (uint64_t& y : ys) {
+            y = b * kBC + rng() % kBC;
+        }
+        sort(ys.begin(), ys.end());
+        for (uint64_t y : ys) {
+            PlotEntry e = PlotEntry();
+            e.y = y;
+            out->push_back(e);
+        }
+    }
+}
+
 // Get next set in the Cartesian product of k ranges of [0, n - 1], similar to
 // k nested 'for' loops from 0 to n - 1
 static int CartProdNext(uint8_t* items, uint8_t n, uint8_t k, bool init)
@@ -388,6 +438,43 @@ TEST_CASE("F functions")
         REQUIRE(result4.first.GetValue() == results[max_batch - 1]);
     }
 
+    SECTION("ChaCha8 multi-block")
+    {
+        // The multi-block keystream is computed with SIMD kernels where
+        // available, single blocks always use the scalar code.
+        struct chacha8_ctx ctx;
+        chacha8_keysetup(&ctx, plot_id_1, 256, NULL);
+        vector<uint8_t> multi(64 * 100), single(64 * 100);
+        for (uint64_t pos : {0ULL, 5ULL, 0xfffffff0ULL, 0x1fffffffaULL}) {
+            for (uint32_t n = 0; n < 100; n++) {
+                chacha8_get_keystream(&ctx, pos, n, multi.data());
+                for (uint32_t i = 0; i < n; i++) {
+                    chacha8_get_keystream(&ctx, pos + i, 1, single.data() + 64 * i);
+                }
+                REQUIRE(memcmp(multi.data(), single.data(), 64 * n) == 0);
+            }
+        }
+    }
+
+    SECTION("F1 batches")
+    {
+        uint64_t results[256];
+        for (uint8_t test_k : {18, 32, 35, 50}) {
+            F1Calculator f1(test_k, plot_id_3);
+            // The last start crosses a keystream counter of 2^32 for k50
+            for (uint64_t first_x : {0ULL, 1ULL, 12345ULL, (1ULL << 32) * 512 / 50 - 100}) {
+                first_x &= (1ULL << test_k) - 1;
+                for (uint64_t n : {1, 3, 4, 101, 256}) {
+                    f1.CalculateBuckets(first_x, n, results);
+                    for (uint64_t i = 0; i < n; i++) {
+                        REQUIRE(
+                            f1.CalculateF(Bits(first_x + i, test_k)).GetValue() == results[i]);
+                    }
+                }
+            }
+        }
+    }
+
     SECTION("F2")
     {
         uint8_t test_key_2[] = {20,  2,  5,  4,   51, 52,  23,  84,  91, 10, 111,
@@ -479,6 +566,259 @@ TEST_CASE("F functions")
         VerifyFC(7, 16, 0x5fec898f, 0x82283d15, 0x14f410, 0x24c3c2, 0x0);
         VerifyFC(7, 16, 0x64ac5db9, 0x7923986, 0x590fd, 0x1c74a2, 0x0);
     }
+
+    SECTION("BLAKE3 batches")
+    {
+        uint32_t const n = 40;
+        vector<uint8_t> inputs(n * Blake3Batch::kInputStride, 0);
+        vector<uint8_t> out(n * Blake3Batch::kOutputSize), expected(out.size());
+        for (uint32_t len : {1, 13, 37, 57, 64}) {
+            for (uint32_t i = 0; i < n; i++) {
+                for (uint32_t j = 0; j < len; j++) {
+                    inputs[i * Blake3Batch::kInputStride + j] = i * 31 + j * 7 + len;
+                }
+                blake3_hasher hasher;
+                blake3_hasher_init(&hasher);
+                blake3_hasher_update(&hasher, &inputs[i * Blake3Batch::kInputStride], len);
+                blake3_hasher_finalize(
+                    &hasher, &expected[i * Blake3Batch::kOutputSize], Blake3Batch::kOutputSize);
+            }
+            Blake3Batch::HashSingleBlocks(inputs.data(), len, n, out.data());
+            REQUIRE(out == expected);
+#if defined(HAVE_X86_SIMD)
+            // HashSingleBlocks() only uses AVX2 for the tail when AVX-512 is available
+            if (Util::HaveAVX2()) {
+                std::fill(out.begin(), out.end(), 0);
+                Blake3Batch::HashAVX2(inputs.data(), len, n / 8, out.data());
+                REQUIRE(out == expected);
+            }
+#endif
+        }
+    }
+
+    SECTION("Fx batches")
+    {
+        // Metadata is split in PlotEntry like phase 1 stores it: the first 128 bits in
+        // left_metadata and the rest in right_metadata.
+        auto to_bits = [](uint128_t left, uint128_t right, uint32_t size) {
+            if (size > 128) {
+                return Bits(left, 128) + Bits(right, size - 128);
+            }
+            return Bits(left, size);
+        };
+        auto random_bits = [](std::mt19937_64& rng, uint32_t size) {
+            uint128_t const v = (uint128_t)rng() << 64 | rng();
+            return size >= 128 ? v : v & (((uint128_t)1 << size) - 1);
+        };
+
+        std::mt19937_64 rng(42);
+        uint32_t const n = 37;
+        uint16_t idx_L[n], idx_R[n];
+        uint64_t f_out[n];
+        uint128_t meta_left[n], meta_right[n];
+        for (uint8_t k : {18, 32, 35, 50}) {
+            for (uint8_t table_index = 2; table_index <= 7; table_index++) {
+                uint32_t const meta_size = kVectorLens[table_index] * k;
+                uint32_t const out_meta_size = table_index < 7 ? kVectorLens[table_index + 1] * k : 0;
+                FxCalculator f(k, table_index);
+
+                vector<PlotEntry> bucket_L(n), bucket_R(n);
+                for (uint32_t i = 0; i < n; i++) {
+                    for (PlotEntry* e : {&bucket_L[i], &bucket_R[i]}) {
+                        e->y = rng() & ((1ULL << (k + kExtraBits)) - 1);
+                        e->left_metadata = random_bits(rng, std::min(meta_size, 128U));
+                        e->right_metadata =
+                            meta_size > 128 ? random_bits(rng, meta_size - 128) : 0;
+                    }
+                    idx_L[i] = (i * 7) % n;
+                    idx_R[i] = (i * 11) % n;
+                }
+
+                PlotEntryBucket soa_L, soa_R;
+                for (uint32_t i = 0; i < n; i++) {
+                    soa_L.push_back(bucket_L[i]);
+                    soa_R.push_back(bucket_R[i]);
+                }
+                f.CalculateBuckets(soa_L, soa_R, idx_L, idx_R, n, f_out, meta_left, meta_right);
+                for (uint32_t i = 0; i < n; i++) {
+                    const PlotEntry& L = bucket_L[idx_L[i]];
+                    const PlotEntry& R = bucket_R[idx_R[i]];
+                    auto const expected = f.CalculateBucket(
+                        Bits(L.y, k + kExtraBits),
+                        to_bits(L.left_metadata, L.right_metadata, meta_size),
+                        to_bits(R.left_metadata, R.right_metadata, meta_size));
+                    REQUIRE(expected.first.GetValue() == f_out[i]);
+                    if (out_meta_size > 0) {
+                        REQUIRE(
+                            expected.second ==
+                            to_bits(meta_left[i], meta_right[i], out_meta_size));
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("FindMatches")
+{
+    FxCalculator f(32, 2);
+    std::mt19937_64 rng(7);
+    PlotEntryBucket bucket_L, bucket_R;
+    uint16_t idx_L[10000], idx_R[10000], ref_L[10000], ref_R[10000];
+    int64_t total_matches = 0;
+    for (uint64_t bucket = 1000; bucket < 1400; bucket++) {
+        RandomBucketPair(rng, bucket, bucket_L, bucket_R);
+        int32_t const count = f.FindMatches(bucket_L, bucket_R, idx_L, idx_R);
+        int32_t const ref_count = ReferenceFindMatches(bucket_L.y, bucket_R.y, ref_L, ref_R);
+        REQUIRE(count == ref_count);
+        REQUIRE(memcmp(idx_L, ref_L, count * sizeof(uint16_t)) == 0);
+        REQUIRE(memcmp(idx_R, ref_R, count * sizeof(uint16_t)) == 0);
+        REQUIRE(f.FindMatches(bucket_L, bucket_R, nullptr, nullptr) == count);
+        total_matches += count;
+    }
+    // About one match per entry
+    REQUIRE(total_matches > 400 * 200);
+}
+
+// Not run by default, select it with the [benchmark] tag
+TEST_CASE("FindMatches throughput", "[.benchmark]")
+{
+    FxCalculator f(32, 2);
+    std::mt19937_64 rng(7);
+    uint32_t const pairs = 64;
+    vector<PlotEntryBucket> buckets_L(pairs), buckets_R(pairs);
+    for (uint32_t i = 0; i < pairs; i++) {
+        RandomBucketPair(rng, 1000 + i, buckets_L[i], buckets_R[i]);
+    }
+
+    uint16_t idx_L[10000], idx_R[10000];
+    uint32_t const rounds = 200;
+    int64_t matches = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (uint32_t i = 0; i < pairs; i++) {
+            matches += f.FindMatches(buckets_L[i], buckets_R[i], idx_L, idx_R);
+        }
+    }
+    double const seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "FindMatches: " << std::fixed << std::setprecision(0)
+              << (rounds * pairs / seconds) << " bucket pairs/s, " << (matches / seconds)
+              << " matches/s" << std::endl;
+}
+
+// Runs GetLeftEntry() and FxCalculator::CalculateBuckets() for the left table kTable at k = kK,
+// the way phase 1 does, both in the generic and in the specialized version. Checks that they
+// give the same results, and returns the seconds that each version took.
+template <uint8_t kK, uint8_t kTable>
+std::pair<double, double> CompareSpecializedPhase1(uint32_t const rounds)
+{
+    uint8_t const metadata_size = kVectorLens[kTable + 1] * kK;
+    uint32_t const entry_size = EntrySizes::GetMaxEntrySize(kK, kTable, true);
+    std::mt19937_64 rng(kK * 8 + kTable);
+
+    uint32_t const num_entries = 1000;
+    vector<uint8_t> entries(num_entries * entry_size + 8);
+    for (uint8_t& b : entries) {
+        b = rng();
+    }
+
+    PlotEntryBucket bucket_L, bucket_R;
+    RandomBucketPair(rng, 1000, bucket_L, bucket_R);
+    for (PlotEntryBucket* b : {&bucket_L, &bucket_R}) {
+        for (size_t i = 0; i < b->size(); i++) {
+            uint128_t const v = (uint128_t)rng() << 64 | rng();
+            b->left_metadata[i] =
+                metadata_size >= 128 ? v : v & (((uint128_t)1 << metadata_size) - 1);
+            b->right_metadata[i] =
+                metadata_size > 128 ? rng() & ((1ULL << (metadata_size - 128)) - 1) : 0;
+        }
+    }
+    FxCalculator f(kK, kTable + 1);
+    uint16_t idx_L[10000], idx_R[10000];
+    int32_t const n = f.FindMatches(bucket_L, bucket_R, idx_L, idx_R);
+    REQUIRE(n > 0);
+
+    vector<uint64_t> f_out[2] = {vector<uint64_t>(n), vector<uint64_t>(n)};
+    vector<uint128_t> meta_left[2] = {vector<uint128_t>(n), vector<uint128_t>(n)};
+    vector<uint128_t> meta_right[2] = {vector<uint128_t>(n), vector<uint128_t>(n)};
+    uint128_t checksum[2] = {0, 0};
+    double seconds[2];
+    for (int specialized = 0; specialized < 2; specialized++) {
+        auto const start = std::chrono::steady_clock::now();
+        for (uint32_t round = 0; round < rounds; round++) {
+            for (uint32_t i = 0; i < num_entries; i++) {
+                uint8_t const* const buf = entries.data() + i * entry_size;
+                PlotEntry const e =
+                    specialized ? GetLeftEntry<kK, kTable>(kTable, buf, kK, metadata_size, kK)
+                                : GetLeftEntry(kTable, buf, kK, metadata_size, kK);
+                checksum[specialized] += e.y ^ e.read_posoffset ^ e.left_metadata ^
+                                         (e.right_metadata << 1);
+            }
+            if (specialized) {
+                f.CalculateBuckets<kK, kTable + 1>(
+                    bucket_L,
+                    bucket_R,
+                    idx_L,
+                    idx_R,
+                    n,
+                    f_out[1].data(),
+                    meta_left[1].data(),
+                    meta_right[1].data());
+            } else {
+                f.CalculateBuckets(
+                    bucket_L,
+                    bucket_R,
+                    idx_L,
+                    idx_R,
+                    n,
+                    f_out[0].data(),
+                    meta_left[0].data(),
+                    meta_right[0].data());
+            }
+            checksum[specialized] += f_out[specialized][round % n];
+        }
+        seconds[specialized] =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    REQUIRE(checksum[0] == checksum[1]);
+    REQUIRE(f_out[0] == f_out[1]);
+    REQUIRE(meta_left[0] == meta_left[1]);
+    REQUIRE(meta_right[0] == meta_right[1]);
+    return {seconds[0], seconds[1]};
+}
+
+template <uint8_t kK>
+std::pair<double, double> CompareSpecializedPhase1Tables(uint32_t const rounds)
+{
+    std::pair<double, double> total(0, 0);
+    for (auto const& t :
+         {CompareSpecializedPhase1<kK, 1>(rounds),
+          CompareSpecializedPhase1<kK, 2>(rounds),
+          CompareSpecializedPhase1<kK, 3>(rounds),
+          CompareSpecializedPhase1<kK, 4>(rounds),
+          CompareSpecializedPhase1<kK, 5>(rounds),
+          CompareSpecializedPhase1<kK, 6>(rounds)}) {
+        total.first += t.first;
+        total.second += t.second;
+    }
+    return total;
+}
+
+TEST_CASE("Phase 1 specialized for k")
+{
+    CompareSpecializedPhase1Tables<32>(3);
+    CompareSpecializedPhase1Tables<33>(3);
+    CompareSpecializedPhase1Tables<34>(3);
+}
+
+// Not run by default, select it with the [benchmark] tag
+TEST_CASE("Phase 1 specialized throughput", "[.benchmark]")
+{
+    auto const seconds = CompareSpecializedPhase1Tables<32>(2000);
+    std::cout << "Phase 1 entry decoding and f, k32 tables 1-6: generic " << std::fixed
+              << std::setprecision(3) << seconds.first << "s, specialized " << seconds.second
+              << "s" << std::endl;
 }
 
 TEST_CASE("(De)Serialization")
@@ -673,12 +1013,26 @@ void PlotAndTestProofOfSpace(
     uint32_t buffer,
     uint32_t num_proofs,
     uint32_t stripe_size,
-    uint8_t num_threads)
+    uint8_t num_threads,
+    uint8_t flags = ENABLE_BITFIELD)
 {
     DiskPlotter plotter = DiskPlotter();
     uint8_t memo[5] = {1, 2, 3, 4, 5};
     plotter.CreatePlotDisk(
-        ".", ".", ".", filename, k, memo, 5, plot_id, 32, buffer, 0, stripe_size, num_threads);
+        ".",
+        ".",
+        ".",
+        filename,
+        k,
+        memo,
+        5,
+        plot_id,
+        32,
+        buffer,
+        0,
+        stripe_size,
+        num_threads,
+        flags);
     TestProofOfSpace(filename, iterations, k, plot_id, num_proofs);
     REQUIRE(remove(filename.c_str()) == 0);
 }
@@ -705,6 +1059,42 @@ TEST_CASE("Plotting")
     {
         PlotAndTestProofOfSpace("cpp-test-plot.dat", 5000, 21, plot_id_3, 100, 4945, 8192, 4);
     }
+    SECTION("Disk plot k21 small buffer")
+    {
+        // phase 2 can't keep the tables in memory, and reads them twice
+        PlotAndTestProofOfSpace("cpp-test-plot.dat", 500, 21, plot_id_3, 11, 455, 8192, 2);
+    }
+    SECTION("Disk plot k18 temp files in memory")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, ENABLE_BITFIELD | TMP_IN_MEMORY);
+    }
+    SECTION("Disk plot k18 direct I/O")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, ENABLE_BITFIELD | DIRECT_IO);
+    }
+    SECTION("Disk plot k18 encoded sort buckets")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, ENABLE_BITFIELD | COMPRESS_TMP);
+    }
+    SECTION("Disk plot k18 huge pages")
+    {
+        // falls back to transparent huge pages, if none are reserved
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, ENABLE_BITFIELD | HUGE_PAGES);
+        CHECK(MemoryArena::Instance().CachedBytes() == 0);
+    }
+    SECTION("Disk plot k18 spilled bitfields")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, ENABLE_BITFIELD | SPILL_BITFIELDS);
+    }
+    SECTION("Disk plot k18 small stripes")
+    {
+        PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 2000, 8);
+    }
     // SECTION("Disk plot k24") { PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 24, plot_id_3,
     // 100, 107); }
 }
@@ -747,6 +1137,83 @@ TEST_CASE("Invalid plot")
     }
 }
 
+TEST_CASE("Temp directories")
+{
+    fs::create_directory("test-tmp-a");
+    fs::create_directory("test-tmp-b");
+    TempDirs dirs(vector<string>{"test-tmp-a", "test-tmp-b"});
+
+    SECTION("round-robin")
+    {
+        for (uint64_t i = 0; i < 10; i++) {
+            REQUIRE(dirs.Dir(i) == ((i % 2) ? "test-tmp-b" : "test-tmp-a"));
+        }
+        REQUIRE(TempDirs(".").Dir(5) == ".");
+    }
+
+    SECTION("weighted")
+    {
+        dirs.SetWeights({3, 1});
+        uint32_t count_a = 0;
+        for (uint64_t i = 0; i < 400; i++) {
+            if (dirs.Dir(i) == "test-tmp-a") ++count_a;
+            // spread evenly, never more than three in a row
+            if (i >= 3) {
+                REQUIRE(!(dirs.Dir(i) == dirs.Dir(i - 1) && dirs.Dir(i) == dirs.Dir(i - 2) &&
+                          dirs.Dir(i) == dirs.Dir(i - 3)));
+            }
+        }
+        REQUIRE(count_a == 300);
+        REQUIRE_THROWS(dirs.SetWeights({1, 0}));
+        REQUIRE_THROWS(dirs.SetWeights({1}));
+
+        dirs.MeasureThroughput(8 * 1024 * 1024);
+        REQUIRE(dirs.Weights()[0] > 0);
+        REQUIRE(dirs.Weights()[1] > 0);
+        REQUIRE(!fs::exists("test-tmp-a/throughput-test.tmp"));
+    }
+
+    SECTION("sort buckets")
+    {
+        uint32_t const iters = 100000;
+        uint32_t const size = 16;
+        vector<Bits> input;
+        SortManager manager(1000000, 16, 4, size, dirs, "test-files", 0, 1);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            vector<unsigned char> hash(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+            Bits to_write = Bits(hash.data(), size, size * 8);
+            input.emplace_back(to_write);
+            manager.AddToCache(to_write);
+        }
+        manager.FlushCache();
+        REQUIRE(fs::exists("test-tmp-a/test-files.sort_bucket_000.tmp"));
+        REQUIRE(fs::exists("test-tmp-b/test-files.sort_bucket_001.tmp"));
+        REQUIRE(!fs::exists("test-tmp-b/test-files.sort_bucket_000.tmp"));
+
+        uint8_t buf[size];
+        sort(input.begin(), input.end());
+        for (uint32_t i = 0; i < iters; i++) {
+            input[i].ToBytes(buf);
+            REQUIRE(memcmp(buf, manager.ReadEntry(i * size), size) == 0);
+        }
+    }
+
+    SECTION("plot")
+    {
+        DiskPlotter plotter = DiskPlotter();
+        uint8_t memo[5] = {1, 2, 3, 4, 5};
+        plotter.CreatePlotDisk(
+            dirs, ".", ".", "cpp-test-plot.dat", 18, memo, 5, plot_id_1, 32, 11, 0, 4000, 2);
+        TestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 95);
+        REQUIRE(remove("cpp-test-plot.dat") == 0);
+    }
+
+    fs::remove_all("test-tmp-a");
+    fs::remove_all("test-tmp-b");
+}
+
 TEST_CASE("Sort on disk")
 {
     SECTION("ExtractNum")
@@ -887,6 +1354,172 @@ TEST_CASE("Sort on disk")
         }
     }
 
+    SECTION("Lazy Sort Manager prefetch")
+    {
+        uint32_t iters = 120000;
+        uint32_t const size = 32;
+        vector<Bits> input;
+        // leaves room for the next bucket on either side of the current
+        // one, some of them with uniform sort, some with quicksort
+        const uint32_t memory_len = 1000000;
+        SortManager manager(memory_len, 16, 4, size, ".", "test-files", 0, 1);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            vector<unsigned char> hash(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+            Bits to_write = Bits(hash.data(), size, size * 8);
+            input.emplace_back(to_write);
+            manager.AddToCache(to_write);
+        }
+        manager.FlushCache();
+        uint8_t buf[size];
+        sort(input.begin(), input.end());
+        for (uint32_t i = 0; i < iters; i++) {
+            // keep the previous entry around too
+            if (i > 0 && manager.CloseToNewBucket(i * size)) {
+                manager.TriggerNewBucket((i - 1) * size);
+            }
+            input[i].ToBytes(buf);
+            REQUIRE(memcmp(buf, manager.ReadEntry(i * size), size) == 0);
+            // the previous entry may come from the saved tail of the last bucket
+            if (i > 0) {
+                input[i - 1].ToBytes(buf);
+                REQUIRE(memcmp(buf, manager.ReadEntry((i - 1) * size), size) == 0);
+            }
+        }
+    }
+
+    SECTION("Radix sort")
+    {
+        uint32_t const iters = 200000;
+        for (uint32_t const size : {8, 9, 10, 12, 13, 26}) {
+            for (uint32_t const bits_begin : {0, 7, 20, 37}) {
+                for (uint32_t const threads : {1, 4}) {
+                    std::vector<uint8_t> data(iters * size);
+                    for (uint32_t i = 0; i < iters; i++) {
+                        vector<unsigned char> hash_input = intToBytes(i, 4);
+                        vector<unsigned char> hash(picosha2::k_digest_size);
+                        picosha2::hash256(
+                            hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+                        // Not uniform, with runs of equal prefixes and duplicates
+                        if (i % 3 == 0) memset(hash.data() + 5, 0, 4);
+                        if (i % 1000 == 0) hash = vector<unsigned char>(hash.size(), 0xab);
+                        // The bits before bits_begin are equal, like bucket bits
+                        for (uint32_t bit = 0; bit < bits_begin; bit++) {
+                            hash[bit / 8] &= ~(0x80 >> (bit % 8));
+                        }
+                        memcpy(data.data() + i * size, hash.data(), size);
+                    }
+                    std::vector<uint8_t> expected = data;
+                    QuickSort::Sort(expected.data(), size, iters, bits_begin);
+                    RadixSort::Sort(data.data(), size, iters, bits_begin, threads);
+                    REQUIRE(data == expected);
+                }
+            }
+        }
+    }
+
+    SECTION("Lazy Sort Manager radix sort")
+    {
+        uint32_t iters = 120000;
+        uint32_t const size = 32;
+        vector<Bits> input;
+        const uint32_t memory_len = 1000000;
+        // the next bucket is sorted on the pool while one is read
+        ThreadPool pool(4);
+        SortManager manager(
+            memory_len, 16, 4, size, ".", "test-files", 0, 1,
+            strategy_t::radix, disk_mode_t::file, 4, bucket_codec_t::none, &pool);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            vector<unsigned char> hash(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+            Bits to_write = Bits(hash.data(), size, size * 8);
+            input.emplace_back(to_write);
+            manager.AddToCache(to_write);
+        }
+        manager.FlushCache();
+        uint8_t buf[size];
+        sort(input.begin(), input.end());
+        for (uint32_t i = 0; i < iters; i++) {
+            input[i].ToBytes(buf);
+            REQUIRE(memcmp(buf, manager.ReadEntry(i * size), size) == 0);
+        }
+    }
+
+    SECTION("Lazy Sort Manager batched writes")
+    {
+        uint32_t iters = 120000;
+        uint32_t const size = 32;
+        std::vector<uint8_t> entries(iters * size + 7);
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            picosha2::hash256(
+                hash_input.begin(), hash_input.end(), entries.begin() + i * size,
+                entries.begin() + (i + 1) * size);
+        }
+        std::vector<uint8_t> sorted(entries.begin(), entries.end() - 7);
+        QuickSort::Sort(sorted.data(), size, iters, 0);
+
+        const uint32_t memory_len = 1000000;
+        SortManager bulk(memory_len, 16, 4, size, ".", "test-files-bulk", 0, 1);
+        // batches of varying sizes, including empty ones
+        for (uint32_t i = 0, n = 0, batch = 0; i < iters; i += batch, n++) {
+            batch = std::min((n * 7919) % 5000, iters - i);
+            bulk.AddToCache(entries.data() + i * size, batch);
+        }
+        bulk.FlushCache();
+
+        SortManager concurrent(memory_len, 16, 4, size, ".", "test-files-writers", 0, 1);
+        std::vector<std::thread> threads;
+        for (uint32_t t = 0; t < 3; t++) {
+            threads.emplace_back([&, t] {
+                BucketWriter writer(concurrent, 4096);
+                for (uint32_t i = t; i < iters; i += 3) {
+                    writer.Add(entries.data() + i * size);
+                }
+                writer.Flush();
+            });
+        }
+        for (auto& t : threads) t.join();
+        concurrent.FlushCache();
+
+        for (uint32_t i = 0; i < iters; i++) {
+            REQUIRE(memcmp(sorted.data() + i * size, bulk.ReadEntry(i * size), size) == 0);
+            REQUIRE(memcmp(sorted.data() + i * size, concurrent.ReadEntry(i * size), size) == 0);
+        }
+    }
+
+    SECTION("Lazy Sort Manager encoded buckets")
+    {
+        uint32_t iters = 120000;
+        uint32_t const size = 13;
+        std::vector<uint8_t> entries(iters * size + 7);
+        Util::GetRandomBytes(entries.data(), entries.size());
+        // many duplicates, and entries that share most of their bits
+        for (uint32_t i = 0; i < iters; i += 5) {
+            memcpy(entries.data() + i * size, entries.data() + (i / 2) * size, size);
+            entries[(i / 2) * size + size - 1] ^= 1;
+        }
+        std::vector<uint8_t> sorted(entries.begin(), entries.end() - 7);
+        QuickSort::Sort(sorted.data(), size, iters, 0);
+
+        for (auto const strategy : {strategy_t::uniform, strategy_t::quicksort, strategy_t::radix}) {
+            SortManager manager(
+                iters * size, 16, 4, size, ".", "test-files-encoded", 0, 1, strategy,
+                disk_mode_t::file, 2, bucket_codec_t::delta);
+            for (uint32_t i = 0; i < iters; i++) {
+                manager.AddToCache(entries.data() + i * size);
+                // flushing writes the partial blocks, so buckets have several
+                if (i % 50000 == 0) manager.FlushCache();
+            }
+            manager.FlushCache();
+            for (uint32_t i = 0; i < iters; i++) {
+                REQUIRE(memcmp(sorted.data() + i * size, manager.ReadEntry(i * size), size) == 0);
+            }
+        }
+    }
+
     SECTION("Sort in Memory")
     {
         uint32_t iters = 100000;
@@ -917,6 +1550,489 @@ TEST_CASE("Sort on disk")
     }
 }
 
+TEST_CASE("Memory arena")
+{
+    MemoryArena& arena = MemoryArena::Instance();
+    uint64_t const size = 5 * 1024 * 1024 + 100;
+
+    SECTION("no reuse by default")
+    {
+        arena.Alloc(size);
+        CHECK(arena.CachedBytes() == 0);
+    }
+
+    SECTION("reuse")
+    {
+        arena.Configure(false, -1, 16 * 1024 * 1024);
+        uint8_t* first;
+        {
+            auto buffer = arena.Alloc(size);
+            first = buffer.get();
+            CHECK(reinterpret_cast<uintptr_t>(first) % kDirectAlignment == 0);
+            memset(first, 0xab, size);
+        }
+        CHECK(arena.CachedBytes() >= size);
+        {
+            // a little smaller still fits the kept buffer
+            auto buffer = arena.Alloc(size - 4096);
+            CHECK(buffer.get() == first);
+            CHECK(buffer[size - 4097] == 0xab);
+            CHECK(arena.CachedBytes() == 0);
+        }
+        {
+            // much smaller doesn't, and the kept buffer is given back
+            auto buffer = arena.Alloc(size / 4);
+            memset(buffer.get(), 0, size / 4);
+            CHECK(arena.CachedBytes() == 0);
+        }
+        {
+            // the cache is bounded
+            auto a = arena.Alloc(10 * 1024 * 1024);
+            auto b = arena.Alloc(10 * 1024 * 1024);
+        }
+        CHECK(arena.CachedBytes() <= 16 * 1024 * 1024);
+        arena.Reset();
+        CHECK(arena.CachedBytes() == 0);
+    }
+
+    SECTION("huge pages and NUMA")
+    {
+        // every machine has node 0. Reserved huge pages may not be available,
+        // then the arena falls back to transparent ones
+        arena.Configure(true, 0, 0);
+        for (uint64_t const n : {uint64_t(4096), size, uint64_t(64) * 1024 * 1024}) {
+            auto buffer = arena.Alloc(n);
+            memset(buffer.get(), 1, n);
+            CHECK(buffer[n - 1] == 1);
+        }
+        arena.Reset();
+        CHECK_THROWS_AS(arena.Configure(false, 100000, 0), InvalidValueException);
+    }
+
+    SECTION("scope")
+    {
+        // reset when leaving the scope on an exception
+        try {
+            MemoryArena::Scope scope(false, -1, 16 * 1024 * 1024);
+            arena.Alloc(size);
+            CHECK(arena.CachedBytes() >= size);
+            throw InvalidStateException("plot failed");
+        } catch (InvalidStateException const&) {
+        }
+        CHECK(arena.CachedBytes() == 0);
+        arena.Alloc(size);
+        CHECK(arena.CachedBytes() == 0);
+    }
+}
+
+TEST_CASE("Thread pool")
+{
+    SECTION("runs every task once")
+    {
+        ThreadPool pool(3);
+        CHECK(pool.size() == 3);
+        for (uint32_t const n : {0U, 1U, 3U, 4U, 100U}) {
+            std::vector<std::atomic<uint32_t>> runs(n);
+            pool.Run(n, [&](uint32_t const i) { runs[i]++; });
+            for (auto const& r : runs) CHECK(r == 1);
+        }
+    }
+
+    SECTION("single thread")
+    {
+        // the calling thread is the only one
+        ThreadPool pool(1);
+        CHECK(pool.size() == 1);
+        std::atomic<uint32_t> others{0};
+        std::thread::id const caller = std::this_thread::get_id();
+        pool.Run(10, [&](uint32_t) { others += std::this_thread::get_id() != caller; });
+        CHECK(others == 0);
+    }
+
+    SECTION("nested")
+    {
+        ThreadPool pool(2);
+        std::atomic<uint32_t> sum{0};
+        pool.Run(4, [&](uint32_t const i) {
+            pool.Run(4, [&](uint32_t const j) { sum += i * 4 + j; });
+        });
+        CHECK(sum == 120);
+    }
+
+    SECTION("exceptions")
+    {
+        ThreadPool pool(2);
+        std::atomic<uint32_t> runs{0};
+        CHECK_THROWS_AS(
+            pool.Run(
+                8,
+                [&](uint32_t const i) {
+                    runs++;
+                    if (i == 5) throw InvalidStateException("task failed");
+                }),
+            InvalidStateException);
+        // the other tasks still run, and the pool is still usable
+        CHECK(runs == 8);
+        pool.Run(2, [&](uint32_t) { runs++; });
+        CHECK(runs == 10);
+    }
+
+    SECTION("submit")
+    {
+        for (uint32_t const threads : {1U, 2U}) {
+            ThreadPool pool(threads);
+            std::atomic<uint32_t> runs{0};
+            ThreadPool::Task task = pool.Submit([&] { runs++; });
+            CHECK(task.valid());
+            task.Wait();
+            CHECK(!task.valid());
+            CHECK(runs == 1);
+
+            // waiting runs it here if the workers are busy
+            std::atomic<bool> release{false};
+            pool.Run(threads, [&](uint32_t) {
+                ThreadPool::Task inner = pool.Submit([&] { release = true; });
+                inner.Wait();
+                CHECK(release);
+            });
+
+            task = pool.Submit([] { throw InvalidStateException("task failed"); });
+            CHECK_THROWS_AS(task.Wait(), InvalidStateException);
+        }
+    }
+
+    SECTION("pinned")
+    {
+        // every machine has CPU 0
+        ThreadPool pool(2, {0});
+        CHECK(pool.Cpus() == std::vector<int>{0});
+        std::atomic<uint32_t> runs{0};
+        pool.Run(2, [&](uint32_t) { runs++; });
+        CHECK(runs == 2);
+
+#ifdef __linux__
+        // the calling thread can run on its CPUs again afterwards
+        cpu_set_t before, after;
+        REQUIRE(pthread_getaffinity_np(pthread_self(), sizeof(before), &before) == 0);
+        {
+            CpuPin const pin(0);
+            pool.Run(2, [&](uint32_t) { runs++; });
+        }
+        REQUIRE(pthread_getaffinity_np(pthread_self(), sizeof(after), &after) == 0);
+        CHECK(CPU_EQUAL(&before, &after));
+        CHECK(runs == 4);
+#endif
+    }
+
+    SECTION("CPU lists")
+    {
+        CHECK(ParseCpuList("").empty());
+        CHECK(ParseCpuList("3") == std::vector<int>{3});
+        CHECK(ParseCpuList("0-3,8, 10-11\n") == std::vector<int>{0, 1, 2, 3, 8, 10, 11});
+        CHECK_THROWS_AS(ParseCpuList("3-1"), InvalidValueException);
+        CHECK_THROWS_AS(ParseCpuList("a"), InvalidValueException);
+        CHECK_THROWS_AS(ParseCpuList("-2"), InvalidValueException);
+    }
+}
+
+TEST_CASE("Bucket codec")
+{
+    FileDisk disk("test-bucket-codec.tmp");
+
+    auto const round_trip = [&](std::vector<uint8_t> block, uint32_t const entry_len) {
+        uint64_t const count = block.size() / entry_len;
+        std::vector<uint8_t> sorted = block;
+        QuickSort::Sort(sorted.data(), entry_len, count, 0);
+
+        uint64_t size = 0;
+        // two blocks, to cover the block boundary
+        size += BucketCodec::EncodeBlock(disk, size, block.data(), count, entry_len);
+        size += BucketCodec::EncodeBlock(disk, size, block.data(), count, entry_len);
+
+        BucketCodec::Decoder decoder(disk, size, entry_len);
+        std::vector<uint8_t> decoded(block.size());
+        for (int i = 0; i < 2; i++) {
+            // read in odd sized pieces
+            for (uint64_t n = 0; n < count; n += 3) {
+                uint64_t const length = std::min<uint64_t>(3, count - n) * entry_len;
+                decoder.Read(
+                    i * block.size() + n * entry_len, decoded.data() + n * entry_len, length);
+            }
+            CHECK(decoded == sorted);
+        }
+        return size;
+    };
+
+    SECTION("single entry")
+    {
+        std::vector<uint8_t> block(16, 0xff);
+        CHECK(round_trip(block, 16) == 2 * (8 + 17));
+    }
+
+    SECTION("equal entries")
+    {
+        std::vector<uint8_t> block(10 * 1000, 0x5a);
+        // after the first entry, only the byte counts are stored
+        CHECK(round_trip(block, 10) == 2 * (8 + 11 + 999));
+    }
+
+    SECTION("carries")
+    {
+        // entries differ in their last byte, and the difference overflows
+        std::vector<uint8_t> block;
+        for (uint32_t i = 0; i < 3000; i++) {
+            uint8_t entry[9] = {};
+            Util::IntToEightBytes(entry + 1, uint64_t(i) * 0x3f1);
+            entry[0] = i % 3;
+            block.insert(block.end(), entry, entry + sizeof(entry));
+        }
+        round_trip(block, 9);
+    }
+
+    SECTION("random entries")
+    {
+        for (uint32_t const entry_len : {1, 8, 13, 32, 128}) {
+            std::vector<uint8_t> block(entry_len * 20000);
+            Util::GetRandomBytes(block.data(), block.size());
+            round_trip(block, entry_len);
+        }
+    }
+
+    disk.Remove();
+}
+
+// Not run by default, select it with the [benchmark] tag
+TEST_CASE("Bucket codec throughput", "[.benchmark]")
+{
+    uint64_t const iters = 1 << 23;
+    uint32_t const size = 10;
+    std::mt19937_64 rng(7);
+
+    // Like the entries of the phase 2 sort: a counter, followed by a random
+    // position and offset. And entries that are random throughout.
+    std::vector<uint8_t> counted(iters * size + 7);
+    std::vector<uint8_t> random(iters * size + 7);
+    for (uint64_t i = 0; i < iters; ++i) {
+        uint128_t const entry = ((uint128_t)i << 96) | ((uint128_t)(rng() >> 22) << 54);
+        Util::IntTo16Bytes(counted.data() + i * size, entry);
+    }
+    Util::GetRandomBytes(random.data(), random.size());
+
+    for (auto const& [name, input] :
+         {std::pair{"counter entries", &counted}, std::pair{"random entries", &random}}) {
+        for (auto const codec : {bucket_codec_t::none, bucket_codec_t::delta}) {
+            auto const start = std::chrono::steady_clock::now();
+            SortManager manager(
+                iters * size, 16, 4, size, ".", "test-codec-bench", 0, 1, strategy_t::radix,
+                disk_mode_t::file, 1, codec);
+            manager.AddToCache(input->data(), iters);
+            manager.FlushCache();
+            for (uint64_t i = 0; i < iters; i += 1000) manager.ReadEntry(i * size);
+            double const seconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << name << (codec == bucket_codec_t::none ? ", raw: " : ", delta: ")
+                      << std::fixed << std::setprecision(3) << seconds << "s" << std::endl;
+        }
+
+        FileDisk disk("test-codec-bench.tmp");
+        uint64_t const block_entries = 1 << 16;
+        uint64_t encoded = 0;
+        for (uint64_t i = 0; i < iters; i += block_entries) {
+            encoded += BucketCodec::EncodeBlock(
+                disk, encoded, input->data() + i * size, block_entries, size);
+        }
+        std::cout << name << ", encoded to " << std::setprecision(1)
+                  << 100.0 * encoded / (iters * size) << "%" << std::endl;
+        disk.Remove();
+    }
+}
+
+TEST_CASE("F1 to sort buckets")
+{
+    uint8_t const k = 18;
+    uint32_t const entry_size = EntrySizes::GetMaxEntrySize(k, 1, true);
+    uint64_t const memory_len = 16 * 1024 * 1024;
+
+    SortManager single(memory_len, 16, 4, entry_size, ".", "test-f1-single", 0, 1);
+    ThreadPool single_pool(1);
+    RunF1(&single, k, plot_id_1, single_pool);
+    single.FlushCache();
+
+    SortManager multi(memory_len, 16, 4, entry_size, ".", "test-f1-multi", 0, 1);
+    ThreadPool multi_pool(3);
+    RunF1(&multi, k, plot_id_1, multi_pool);
+    multi.FlushCache();
+
+    F1Calculator f1(k, plot_id_1);
+    uint64_t prev_y = 0;
+    for (uint64_t i = 0; i < (1ULL << k); i++) {
+        uint8_t const* a = single.ReadEntry(i * entry_size);
+        uint8_t const* b = multi.ReadEntry(i * entry_size);
+        REQUIRE(memcmp(a, b, entry_size) == 0);
+
+        uint64_t const y = Util::SliceInt64FromBytes(a, 0, k + kExtraBits);
+        uint64_t const x = Util::SliceInt64FromBytes(a, k + kExtraBits, k);
+        REQUIRE(y >= prev_y);
+        REQUIRE(f1.CalculateF(Bits(x, k)).GetValue() == y);
+        prev_y = y;
+    }
+}
+
+// Not run by default, select it with the [benchmark] tag
+TEST_CASE("F1 throughput", "[.benchmark]")
+{
+    uint8_t const k = 22;
+    uint32_t const entry_size = EntrySizes::GetMaxEntrySize(k, 1, true);
+    uint32_t const max_threads = std::max(std::thread::hardware_concurrency(), 1U);
+
+    for (uint32_t threads = 1; threads <= max_threads; threads *= 2) {
+        SortManager manager(
+            (1ULL << k) * entry_size, 128, 7, entry_size, ".", "test-f1-bench", 0, 1);
+        ThreadPool pool(threads);
+        auto const start = std::chrono::steady_clock::now();
+        RunF1(&manager, k, plot_id_1, pool);
+        manager.FlushCache();
+        double const seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "F1 k" << (int)k << ", " << threads << " threads: " << std::fixed
+                  << std::setprecision(0) << ((1ULL << k) / seconds) << " entries/s"
+                  << std::endl;
+    }
+}
+
+// Not run by default, select it with the [benchmark] tag
+TEST_CASE("Sort throughput", "[.benchmark]")
+{
+    uint64_t const iters = 1 << 23;
+    uint32_t const max_threads = std::max(std::thread::hardware_concurrency(), 1U);
+
+    for (uint32_t const size : {8, 10, 12, 13}) {
+        FileDisk disk("test-sort-bench.tmp");
+        std::vector<uint8_t> input(iters * size);
+        Util::GetRandomBytes(input.data(), input.size());
+        // Sorted after the bucket bits, like SortManager does
+        for (uint64_t i = 0; i < iters; ++i) input[i * size] &= 0x0f;
+        disk.Write(0, input.data(), input.size());
+
+        auto const time = [&](char const* name, auto const& sort) {
+            auto const start = std::chrono::steady_clock::now();
+            sort();
+            double const seconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << size << " byte entries, " << name << ": " << std::fixed
+                      << std::setprecision(3) << seconds << "s" << std::endl;
+        };
+
+        std::vector<uint8_t> memory(Util::RoundSize(iters) * size);
+        time("uniform sort", [&] {
+            UniformSort::SortToMemory(disk, 0, memory.data(), size, iters, 4);
+        });
+        time("quicksort", [&] {
+            disk.Read(0, memory.data(), iters * size);
+            QuickSort::Sort(memory.data(), size, iters, 4);
+        });
+        for (uint32_t threads = 1; threads <= max_threads; threads *= 2) {
+            time(("radix sort, " + std::to_string(threads) + " threads").c_str(), [&] {
+                disk.Read(0, memory.data(), iters * size);
+                RadixSort::Sort(memory.data(), size, iters, 4, threads);
+            });
+        }
+        disk.Remove();
+    }
+}
+
+TEST_CASE("Stripe scheduler")
+{
+    struct Output {
+        uint64_t stripe;
+    };
+    uint64_t const num_stripes = 1000;
+    std::vector<uint64_t> committed;
+    std::vector<uint64_t> started;
+
+    StripeScheduler<Output> scheduler(
+        num_stripes,
+        6,
+        []() { return std::make_unique<Output>(); },
+        [&](Output& out) { committed.push_back(out.stripe); });
+
+    std::atomic<uint64_t> finished{0};
+    std::atomic<bool> waited_for_all{true};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&, t]() {
+            uint64_t stripe = 0;
+            auto start = [&](uint64_t s) {
+                started.push_back(s);
+                if (s % 100 == 0) {
+                    scheduler.WaitForStripesBefore(s);
+                    if (finished != s) {
+                        waited_for_all = false;
+                    }
+                }
+            };
+            while (std::unique_ptr<Output> out = scheduler.Claim(stripe, start)) {
+                // Uneven work, so stripes finish out of order
+                std::this_thread::sleep_for(std::chrono::microseconds(((stripe * 7 + t) % 5) * 50));
+                out->stripe = stripe;
+                finished++;
+                scheduler.Finish(stripe, std::move(out));
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    REQUIRE(waited_for_all);
+    REQUIRE(started.size() == num_stripes);
+    REQUIRE(committed.size() == num_stripes);
+    for (uint64_t i = 0; i < num_stripes; i++) {
+        REQUIRE(started[i] == i);
+        REQUIRE(committed[i] == i);
+    }
+}
+
+TEST_CASE("Stripe scheduler failing stripe")
+{
+    struct Output {
+        uint64_t stripe;
+    };
+    uint64_t const num_stripes = 1000;
+    std::atomic<uint64_t> committed{0};
+
+    StripeScheduler<Output> scheduler(
+        num_stripes,
+        6,
+        []() { return std::make_unique<Output>(); },
+        [&](Output&) { committed++; });
+
+    // Stripe 150 throws before it finishes, and the claim of stripe 200
+    // waits for it
+    ThreadPool pool(3);
+    REQUIRE_THROWS_AS(
+        pool.Run(
+            4,
+            [&](uint32_t) {
+                uint64_t stripe = 0;
+                auto start = [&](uint64_t s) {
+                    if (s % 100 == 0) scheduler.WaitForStripesBefore(s);
+                };
+                StripeScheduler<Output>::AbortOnException const abort_on_exception(scheduler);
+                while (std::unique_ptr<Output> out = scheduler.Claim(stripe, start)) {
+                    if (stripe == 150) throw InvalidStateException("Stripe failed");
+                    out->stripe = stripe;
+                    scheduler.Finish(stripe, std::move(out));
+                }
+            }),
+        InvalidStateException);
+    REQUIRE(committed < num_stripes);
+
+    // Claims end once the scheduler is aborted
+    uint64_t stripe = 0;
+    REQUIRE(scheduler.Claim(stripe, [](uint64_t) {}) == nullptr);
+}
+
 TEST_CASE("bitfield-simple")
 {
     bitfield b(4);
@@ -970,6 +2086,141 @@ TEST_CASE("bitfield-count-unaligned")
     }
 }
 
+TEST_CASE("bitfield-find-set")
+{
+    bitfield b(1000);
+    CHECK(b.find_set(0) == b.size());
+
+    b.set(3);
+    b.set(64);
+    b.set(65);
+    b.set(700);
+    b.set(999);
+
+    CHECK(b.find_set(0) == 3);
+    CHECK(b.find_set(3) == 3);
+    CHECK(b.find_set(4) == 64);
+    CHECK(b.find_set(0, 1) == 64);
+    CHECK(b.find_set(0, 2) == 65);
+    CHECK(b.find_set(0, 3) == 700);
+    CHECK(b.find_set(66) == 700);
+    CHECK(b.find_set(65, 2) == 999);
+    CHECK(b.find_set(0, 5) == b.size());
+    CHECK(b.find_set(1000) == b.size());
+    CHECK(b.find_set(b.size()) == b.size());
+}
+
+TEST_CASE("Bit count kernels")
+{
+    std::mt19937_64 rng(11);
+    std::vector<uint64_t> words(1000);
+    for (auto& w : words) {
+        // sparse, dense and random words
+        uint64_t const r = rng();
+        w = r % 3 == 0 ? r & rng() & rng() : r % 3 == 1 ? r | rng() : r;
+    }
+
+    // all lengths around the vector sizes and the Harley-Seal block, and
+    // unaligned starts
+    for (uint64_t const start : {0, 1, 3}) {
+        for (uint64_t n = 0; n < 300; n++) {
+            uint64_t const* const w = words.data() + start;
+            uint64_t const expected = BitCount::CountGeneric(w, n);
+            REQUIRE(BitCount::Count(w, n) == expected);
+
+            std::vector<uint8_t> expected_counts(n + 1), counts(n + 1, 0xff);
+            BitCount::WordCountsGeneric(w, n, expected_counts.data());
+            BitCount::WordCounts(w, n, counts.data());
+            REQUIRE(memcmp(counts.data(), expected_counts.data(), n) == 0);
+            // nothing written past the end
+            REQUIRE(counts[n] == 0xff);
+
+#if defined(HAVE_X86_SIMD)
+            if (Util::HaveAVX2()) {
+                REQUIRE(BitCount::CountAVX2(w, n) == expected);
+                BitCount::WordCountsAVX2(w, n, counts.data());
+                REQUIRE(memcmp(counts.data(), expected_counts.data(), n) == 0);
+            }
+            if (Util::HaveAVX512Popcnt()) {
+                REQUIRE(BitCount::CountAVX512(w, n) == expected);
+                BitCount::WordCountsAVX512(w, n, counts.data());
+                REQUIRE(memcmp(counts.data(), expected_counts.data(), n) == 0);
+            }
+#endif
+        }
+    }
+
+    // the largest counts
+    std::vector<uint64_t> ones(64, ~uint64_t(0));
+    CHECK(BitCount::Count(ones.data(), ones.size()) == 64 * 64);
+}
+
+// Not run by default, select it with the [benchmark] tag
+TEST_CASE("Bit count throughput", "[.benchmark]")
+{
+    std::mt19937_64 rng(11);
+    std::vector<uint64_t> words(1 << 20);
+    for (auto& w : words) w = rng();
+    std::vector<uint8_t> counts(words.size());
+    int const iters = 200;
+
+    auto const bench = [&](char const* name, auto const& count) {
+        uint64_t sum = 0;
+        auto const start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iters; i++) {
+            // so the count isn't hoisted out of the loop
+            words[i] ^= 1;
+            sum += count();
+        }
+        double const seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << name << ": " << std::fixed << std::setprecision(2)
+                  << (iters * words.size() * 8 / seconds / 1e9) << " GB/s (" << sum << ")"
+                  << std::endl;
+    };
+
+    bench("count, generic", [&] { return BitCount::CountGeneric(words.data(), words.size()); });
+    bench("word counts, generic", [&] {
+        BitCount::WordCountsGeneric(words.data(), words.size(), counts.data());
+        return counts[7];
+    });
+#if defined(HAVE_X86_SIMD)
+    if (Util::HaveAVX2()) {
+        bench("count, AVX2", [&] { return BitCount::CountAVX2(words.data(), words.size()); });
+        bench("word counts, AVX2", [&] {
+            BitCount::WordCountsAVX2(words.data(), words.size(), counts.data());
+            return counts[7];
+        });
+    }
+    if (Util::HaveAVX512Popcnt()) {
+        bench("count, AVX-512", [&] { return BitCount::CountAVX512(words.data(), words.size()); });
+        bench("word counts, AVX-512", [&] {
+            BitCount::WordCountsAVX512(words.data(), words.size(), counts.data());
+            return counts[7];
+        });
+    }
+#endif
+
+    bitfield b(words.size() * 64);
+    for (uint64_t i = 0; i < words.size() * 64; i += 3) b.set(i);
+    bench("bitfield_index", [&] {
+        bitfield_index const idx(b);
+        return idx.rank(b.size() - 1);
+    });
+}
+
+TEST_CASE("bitfield-set-atomic")
+{
+    // threads setting bits of the same words
+    bitfield b(4096);
+    ThreadPool pool(3);
+    pool.Run(4, [&](uint32_t const t) {
+        for (int64_t i = t; i < 4096; i += 8) b.set_atomic(i);
+    });
+    for (int64_t i = 0; i < 4096; ++i) CHECK(b.get(i) == (i % 8 < 4));
+    CHECK(b.count(0, 4096) == 2048);
+}
+
 TEST_CASE("bitfield_index-simple")
 {
     bitfield b(64);
@@ -1041,6 +2292,107 @@ TEST_CASE("bitfield_index edge-sizes")
     test_bitfield_size(bitfield_index::kIndexBucket + 1);
 }
 
+TEST_CASE("bitfield_index rank")
+{
+    // dense and sparse words, and a partial last bucket
+    int64_t const size = 5 * bitfield_index::kIndexBucket + 192;
+    bitfield b(size);
+    std::mt19937_64 rng(7);
+    for (int64_t i = 0; i < size; ++i) {
+        if (rng() % ((i / 300) % 4 + 1) == 0) b.set(i);
+    }
+    bitfield_index const idx(b);
+    for (int64_t i = 0; i < size; ++i) {
+        REQUIRE(idx.rank(i) == uint64_t(b.count(0, i)));
+    }
+}
+
+namespace {
+
+std::shared_ptr<FileDisk> bitfield_file(std::string const& filename)
+{
+    return std::shared_ptr<FileDisk>(new FileDisk(filename), [](FileDisk* f) {
+        f->Remove();
+        delete f;
+    });
+}
+
+}
+
+TEST_CASE("Bitfield files")
+{
+    // spans several windows of the writer and the reader
+    int64_t const size = 20000000 + 17;
+    bitfield b(size);
+    std::mt19937_64 rng(3);
+    std::shared_ptr<FileDisk> file = bitfield_file("test_bitfield.tmp");
+    {
+        BitfieldWriter writer(file.get(), size);
+        int64_t i = 0;
+        while (i < size) {
+            b.set(i);
+            writer.set(i);
+            // sometimes twice
+            if (rng() % 4 == 0) writer.set(i);
+            i += rng() % 3 == 0 ? rng() % 5000 + 1 : rng() % 4 + 1;
+        }
+        REQUIRE(writer.Finish() == b.count(0, size));
+    }
+
+    SECTION("get and count")
+    {
+        BitfieldReader reader(file, size);
+        for (int64_t i = 0; i < size; i += 997) {
+            REQUIRE(reader.get(i) == b.get(i));
+            // bitfield counts from the start of a word
+            int64_t const start = i / 64 * 64;
+            int64_t const end = std::min(i + 1500, size);
+            REQUIRE(reader.count(start, end) == b.count(start, end));
+            REQUIRE(reader.count(i, end) == b.count(start, end) - b.count(start, i + 1) + b.get(i));
+        }
+    }
+
+    SECTION("lookup")
+    {
+        BitfieldReader reader(file, size);
+        bitfield_index const index(b);
+        int64_t pos = b.find_set(0);
+        while (pos < size) {
+            int64_t const offset = b.find_set(pos, rng() % 20) - pos;
+            if (pos + offset >= size || offset >= (1 << kOffsetSize)) break;
+            REQUIRE(reader.lookup(pos, offset) == index.lookup(pos, offset));
+            pos = b.find_set(pos + 1, rng() % 50);
+        }
+    }
+
+    SECTION("find_set")
+    {
+        BitfieldReader reader(file, size);
+        for (int64_t i = 0; i < size; i += 9973) {
+            int64_t const n = rng() % 100;
+            REQUIRE(reader.find_set(i, n) == b.find_set(i, n));
+        }
+    }
+
+    SECTION("shared file")
+    {
+        auto first = std::make_unique<BitfieldReader>(file, size);
+        BitfieldReader second(std::move(file), size);
+        std::vector<uint64_t> words(1000);
+        first->read_words(12345, words.size(), words.data());
+        first.reset();
+        for (int64_t w = 0; w < int64_t(words.size()); ++w) {
+            REQUIRE(
+                int64_t(Util::PopCount(words[w])) == b.count((12345 + w) * 64, (12346 + w) * 64));
+        }
+        REQUIRE(second.count(12345 * 64, 13345 * 64) == b.count(12345 * 64, 13345 * 64));
+        REQUIRE(fs::exists("test_bitfield.tmp"));
+    }
+    // removed with the last reader
+    file.reset();
+    REQUIRE(!fs::exists("test_bitfield.tmp"));
+}
+
 namespace {
 
 constexpr int num_test_entries = 2000000;
@@ -1075,6 +2427,119 @@ TEST_CASE("FileDisk")
     remove("test_file.bin");
 }
 
+TEST_CASE("FileDisk in memory")
+{
+    FileDisk d = FileDisk("test_file.bin", disk_mode_t::memory);
+    write_disk_file(d);
+    REQUIRE(!fs::exists("test_file.bin"));
+    REQUIRE(d.GetWriteMax() == num_test_entries * 4);
+
+    std::uint32_t val = 0;
+    for (uint32_t i = num_test_entries - 1; i > 0; --i) {
+        d.Read(i * 4, reinterpret_cast<std::uint8_t*>(&val), 4);
+        CHECK(i == val);
+    }
+
+    // Truncated bytes read as zero when the file grows again
+    d.Truncate(400);
+    REQUIRE_THROWS(d.Read(400, reinterpret_cast<std::uint8_t*>(&val), 4));
+    val = 7;
+    d.Write(800, reinterpret_cast<std::uint8_t const*>(&val), 4);
+    d.Read(404, reinterpret_cast<std::uint8_t*>(&val), 4);
+    REQUIRE(val == 0);
+    d.Read(396, reinterpret_cast<std::uint8_t*>(&val), 4);
+    REQUIRE(val == 99);
+    d.Read(800, reinterpret_cast<std::uint8_t*>(&val), 4);
+    REQUIRE(val == 7);
+    // so do those past the capacity the file shrank to
+    d.Write(num_test_entries * 4 - 4, reinterpret_cast<std::uint8_t const*>(&val), 4);
+    d.Read(3 * 1024 * 1024, reinterpret_cast<std::uint8_t*>(&val), 4);
+    REQUIRE(val == 0);
+
+    // Still in memory after moving
+    FileDisk moved(std::move(d));
+    moved.Read(396, reinterpret_cast<std::uint8_t*>(&val), 4);
+    REQUIRE(val == 99);
+    moved.Remove();
+    REQUIRE_THROWS(moved.Read(0, reinterpret_cast<std::uint8_t*>(&val), 4));
+}
+
+TEST_CASE("FileDisk direct I/O")
+{
+    SECTION("small writes")
+    {
+        FileDisk d = FileDisk("test_file.bin", disk_mode_t::direct);
+        write_disk_file(d);
+        REQUIRE(d.GetWriteMax() == num_test_entries * 4);
+
+        std::uint32_t val = 0;
+        for (uint32_t i = 0; i < num_test_entries; i += 997) {
+            d.Read(i * 4, reinterpret_cast<std::uint8_t*>(&val), 4);
+            CHECK(i == val);
+        }
+        // The padding of the last block is dropped
+        d.Close();
+        REQUIRE(fs::file_size("test_file.bin") == num_test_entries * 4);
+    }
+
+    SECTION("unaligned writes")
+    {
+        // Writes at random offsets, across block boundaries, of unaligned
+        // memory, compared to the same writes to a vector
+        std::mt19937_64 rng(12);
+        std::vector<uint8_t> expected(3 * 1024 * 1024 + 123);
+        std::vector<uint8_t> buf(expected.size() + 1);
+        FileDisk d = FileDisk("test_file.bin", disk_mode_t::direct);
+        d.Write(0, expected.data(), expected.size());
+        for (int i = 0; i < 300; ++i) {
+            uint64_t const length = 1 + rng() % ((i % 10 == 0) ? 1024 * 1024 : 10000);
+            uint64_t const begin = rng() % (expected.size() - length);
+            for (uint64_t j = 0; j < length; ++j) buf[1 + j] = rng();
+            d.Write(begin, buf.data() + 1, length);
+            memcpy(expected.data() + begin, buf.data() + 1, length);
+            if (i % 3 == 0) {
+                uint64_t const at = rng() % (expected.size() - length);
+                d.Read(at, buf.data() + 1, length);
+                REQUIRE(memcmp(buf.data() + 1, expected.data() + at, length) == 0);
+            }
+        }
+        d.Read(0, buf.data(), expected.size());
+        REQUIRE(memcmp(buf.data(), expected.data(), expected.size()) == 0);
+
+        d.Close();
+        REQUIRE(fs::file_size("test_file.bin") == expected.size());
+        std::ifstream in("test_file.bin", std::ios::binary);
+        in.read(reinterpret_cast<char*>(buf.data()), expected.size());
+        REQUIRE(memcmp(buf.data(), expected.data(), expected.size()) == 0);
+    }
+
+    SECTION("BufferedDisk")
+    {
+        uint32_t const entry_size = 12;
+        uint64_t const num_entries = 300000;
+        FileDisk d = FileDisk("test_file.bin", disk_mode_t::direct);
+        {
+            BufferedDisk bd(&d, 0);
+            uint8_t entry[entry_size] = {};
+            for (uint64_t i = 0; i < num_entries; ++i) {
+                memcpy(entry, &i, sizeof(i));
+                bd.Write(i * entry_size, entry, entry_size);
+            }
+            bd.FlushCache();
+        }
+        BufferedDisk bd(&d, num_entries * entry_size);
+        for (uint64_t i = 1; i < num_entries; i += 7) {
+            uint64_t val;
+            memcpy(&val, bd.Read(i * entry_size, entry_size), sizeof(val));
+            REQUIRE(i == val);
+        }
+        d.Close();
+        REQUIRE(fs::file_size("test_file.bin") == num_entries * entry_size);
+    }
+
+    remove("test_file.bin");
+}
+
 TEST_CASE("BufferedDisk")
 {
     FileDisk d = FileDisk("test_file.bin");
@@ -1097,6 +2562,226 @@ TEST_CASE("BufferedDisk")
     remove("test_file.bin");
 }
 
+TEST_CASE("BufferedDisk in the background")
+{
+    // 12 byte entries, so reads straddle the read-ahead windows
+    uint32_t const entry_size = 12;
+    uint64_t const num_entries = 1000000;
+    FileDisk d = FileDisk("test_file.bin");
+    {
+        BufferedDisk bd(&d, 0);
+        uint8_t entry[entry_size] = {};
+        for (uint64_t i = 0; i < num_entries; ++i) {
+            memcpy(entry, &i, sizeof(i));
+            bd.Write(i * entry_size, entry, entry_size);
+        }
+        bd.FlushCache();
+    }
+    REQUIRE(d.GetWriteMax() == num_entries * entry_size);
+
+    SECTION("read-ahead")
+    {
+        BufferedDisk bd(&d, num_entries * entry_size);
+        for (uint64_t i = 0; i < num_entries; i += (i % 5 == 0) ? 1 : 3) {
+            uint64_t val;
+            memcpy(&val, bd.Read(i * entry_size, entry_size), sizeof(val));
+            REQUIRE(i == val);
+        }
+    }
+
+    SECTION("copying reads")
+    {
+        // batches larger than the read buffer, and not aligned to it
+        BufferedDisk bd(&d, num_entries * entry_size);
+        uint64_t const batch = 123457;
+        std::vector<uint8_t> buf(batch * entry_size);
+        for (uint64_t first = 0; first < num_entries; first += batch) {
+            uint64_t const n = std::min(batch, num_entries - first);
+            bd.Read(first * entry_size, buf.data(), n * entry_size);
+            for (uint64_t i = 0; i < n; ++i) {
+                uint64_t val;
+                memcpy(&val, buf.data() + i * entry_size, sizeof(val));
+                REQUIRE(first + i == val);
+            }
+        }
+    }
+
+    SECTION("large reads")
+    {
+        std::vector<uint8_t> buf(num_entries * entry_size);
+        d.Read(0, buf.data(), buf.size());
+        for (uint64_t i = 0; i < num_entries; ++i) {
+            uint64_t val;
+            memcpy(&val, buf.data() + i * entry_size, sizeof(val));
+            REQUIRE(i == val);
+        }
+    }
+
+    remove("test_file.bin");
+}
+
+TEST_CASE("BufferedDisk buffer sizes")
+{
+    uint64_t const device_size = DeviceBufferSize(".");
+    REQUIRE(device_size >= read_ahead);
+    REQUIRE(device_size <= kMaxBufferSize);
+    REQUIRE(device_size % kDirectAlignment == 0);
+
+    uint32_t const entry_size = 12;
+    uint64_t const num_entries = 500000;
+    for (uint64_t const buffer_size : {uint64_t(16 * 1024), uint64_t(8 * 1024 * 1024)}) {
+        FileDisk d = FileDisk("test_file.bin");
+        REQUIRE(d.BufferSize() == device_size);
+        {
+            BufferedDisk bd(&d, 0, buffer_size);
+            uint8_t entry[entry_size] = {};
+            for (uint64_t i = 0; i < num_entries; ++i) {
+                memcpy(entry, &i, sizeof(i));
+                bd.Write(i * entry_size, entry, entry_size);
+            }
+            bd.FlushCache();
+        }
+        BufferedDisk bd(&d, num_entries * entry_size, buffer_size);
+        for (uint64_t i = 0; i < num_entries; i += 3) {
+            uint64_t val;
+            memcpy(&val, bd.Read(i * entry_size, entry_size), sizeof(val));
+            REQUIRE(i == val);
+        }
+    }
+    remove("test_file.bin");
+}
+
+TEST_CASE("BufferedDisk discard behind")
+{
+    uint64_t const num_entries = 64 * 1024 * 1024 / 8;
+    for (auto const mode : {disk_mode_t::file, disk_mode_t::direct, disk_mode_t::memory}) {
+        FileDisk d = FileDisk("test_file.bin", mode);
+        std::vector<uint64_t> chunk(1024 * 1024 / 8);
+        for (uint64_t i = 0; i < num_entries; i += chunk.size()) {
+            std::iota(chunk.begin(), chunk.end(), i);
+            d.Write(i * 8, reinterpret_cast<uint8_t const*>(chunk.data()), chunk.size() * 8);
+        }
+
+        BufferedDisk bd(&d, num_entries * 8);
+        bd.DiscardBehind();
+        for (uint64_t i = 0; i < num_entries; ++i) {
+            uint64_t val;
+            memcpy(&val, bd.Read(i * 8, 8), sizeof(val));
+            REQUIRE(i == val);
+        }
+        bd.FreeMemory();
+
+        if (mode != disk_mode_t::memory) {
+#ifdef __linux__
+            // All but the last of the 16 MiB chunks were freed
+            d.Close();
+            struct stat st;
+            REQUIRE(::stat("test_file.bin", &st) == 0);
+            REQUIRE(st.st_size == num_entries * 8);
+            REQUIRE(uint64_t(st.st_blocks) * 512 <= 20 * 1024 * 1024);
+#endif
+        } else {
+            // discarded memory reads as zero
+            uint64_t val = 1;
+            d.Read(8, reinterpret_cast<uint8_t*>(&val), 8);
+            REQUIRE(val == 0);
+        }
+        d.Remove();
+    }
+}
+
+// Not run by default, select it with the [benchmark] tag. Writes and reads
+// back files interleaved, like the buckets of a SortManager, with direct I/O
+// so the page cache doesn't hide the seeks. Run it in a directory on the
+// device to measure.
+TEST_CASE("BufferedDisk throughput", "[.benchmark]")
+{
+    uint32_t const num_files = 64;
+    uint64_t const file_size = 16 * 1024 * 1024;
+    uint32_t const entry_size = 16;
+    uint64_t const num_entries = file_size / entry_size;
+    std::cout << "Buffer size for this device: " << DeviceBufferSize(".") << std::endl;
+
+    for (uint64_t const buffer_size : {read_ahead, uint64_t(8 * 1024 * 1024)}) {
+        std::vector<FileDisk> files;
+        files.reserve(num_files);
+        for (uint32_t f = 0; f < num_files; ++f) {
+            files.emplace_back("test-buffered-bench-" + std::to_string(f), disk_mode_t::direct);
+        }
+        uint8_t entry[entry_size] = {};
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::vector<BufferedDisk> writers;
+            writers.reserve(num_files);
+            for (auto& f : files) writers.emplace_back(&f, 0, buffer_size);
+            for (uint64_t i = 0; i < num_entries; ++i) {
+                for (auto& w : writers) w.Write(i * entry_size, entry, entry_size);
+            }
+            for (auto& w : writers) w.FlushCache();
+        }
+        double const write_seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        {
+            std::vector<BufferedDisk> readers;
+            readers.reserve(num_files);
+            for (auto& f : files) readers.emplace_back(&f, file_size, buffer_size);
+            for (uint64_t i = 0; i < num_entries; ++i) {
+                for (auto& r : readers) r.Read(i * entry_size, entry_size);
+            }
+        }
+        double const read_seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        double const mib = double(num_files) * file_size / (1024 * 1024);
+        std::cout << "Buffers of " << (buffer_size / 1024) << " KiB: write " << std::fixed
+                  << std::setprecision(0) << (mib / write_seconds) << " MiB/s, read "
+                  << (mib / read_seconds) << " MiB/s" << std::endl;
+        for (auto& f : files) f.Remove();
+    }
+}
+
+#ifndef _WIN32
+TEST_CASE("AsyncIO")
+{
+    for (auto const backend : {AsyncIO::backend_t::io_uring, AsyncIO::backend_t::threads}) {
+        AsyncIO io(backend);
+        FILE* f = fopen("test_file.bin", "w+b");
+        REQUIRE(f != nullptr);
+        int const fd = fileno(f);
+
+        // More requests than fit in the queue at once
+        uint32_t const chunk = 65536;
+        uint32_t const num_chunks = AsyncIO::kQueueDepth * 2;
+        std::vector<uint8_t> data(chunk * num_chunks);
+        Util::GetRandomBytes(data.data(), data.size());
+        std::vector<uint64_t> tickets;
+        for (uint32_t i = 0; i < num_chunks; ++i) {
+            tickets.push_back(io.Write(fd, i * chunk, data.data() + i * chunk, chunk));
+        }
+        for (uint64_t t : tickets) REQUIRE(io.Wait(t) == 0);
+
+        std::vector<uint8_t> back(data.size());
+        tickets.clear();
+        for (uint32_t i = 0; i < num_chunks; ++i) {
+            tickets.push_back(io.Read(fd, i * chunk, back.data() + i * chunk, chunk));
+        }
+        // in a different order than they were started
+        std::reverse(tickets.begin(), tickets.end());
+        for (uint64_t t : tickets) REQUIRE(io.Wait(t) == 0);
+        REQUIRE(back == data);
+
+        // reading past the end fails
+        REQUIRE(io.Wait(io.Read(fd, data.size(), back.data(), chunk)) != 0);
+
+        fclose(f);
+        remove("test_file.bin");
+    }
+}
+#endif
+
 TEST_CASE("DiskProver")
 {
     SECTION("Move constructor")
@@ -1179,6 +2864,47 @@ TEST_CASE("FilteredDisk")
             CHECK((i * 2) == val);
         }
     }
+    SECTION("long runs of dropped entries")
+    {
+        BufferedDisk bd(&d, num_test_entries * 4);
+        // keep runs of entries, separated by runs of dropped ones of up to
+        // many times the size of the read buffer
+        bitfield filter(num_test_entries);
+        std::vector<uint32_t> kept;
+        std::mt19937 rng(1);
+        int i = 0;
+        while (i < num_test_entries) {
+            int const keep = rng() % 100;
+            for (int j = 0; j < keep && i < num_test_entries; ++j, ++i) {
+                filter.set(i);
+                kept.push_back(i);
+            }
+            i += rng() % 3 == 0 ? rng() % 1000000 : rng() % 200;
+        }
+        FilteredDisk fd(std::move(bd), std::move(filter), 4);
+
+        for (uint32_t n = 0; n < kept.size(); ++n) {
+            auto const val = *reinterpret_cast<std::uint32_t const*>(fd.Read(n * 4, 4));
+            CHECK(kept[n] == val);
+        }
+    }
+
+    SECTION("skipping reads")
+    {
+        BufferedDisk bd(&d, num_test_entries * 4);
+        bitfield filter(num_test_entries);
+        for (int i = 0; i < num_test_entries; ++i) {
+            if (i % 5 != 0) filter.set(i);
+        }
+        FilteredDisk fd(std::move(bd), std::move(filter), 4);
+
+        // read every 7th logical entry only
+        for (uint32_t n = 0; n < num_test_entries / 5 * 4; n += 7) {
+            auto const val = *reinterpret_cast<std::uint32_t const*>(fd.Read(n * 4, 4));
+            CHECK(n / 4 * 5 + n % 4 + 1 == val);
+        }
+    }
+
 /*
     SECTION("empty bitfield")
     {